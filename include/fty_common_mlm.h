@@ -39,14 +39,29 @@ typedef struct _fty_common_mlm_stream_client_t fty_common_mlm_stream_client_t;
 #define FTY_COMMON_MLM_STREAM_CLIENT_T_DEFINED
 typedef struct _fty_common_mlm_basic_mailbox_server_t fty_common_mlm_basic_mailbox_server_t;
 #define FTY_COMMON_MLM_BASIC_MAILBOX_SERVER_T_DEFINED
+typedef struct _fty_common_mlm_timer_wheel_t fty_common_mlm_timer_wheel_t;
+#define FTY_COMMON_MLM_TIMER_WHEEL_T_DEFINED
+typedef struct _fty_common_mlm_agent_group_t fty_common_mlm_agent_group_t;
+#define FTY_COMMON_MLM_AGENT_GROUP_T_DEFINED
+typedef struct _fty_common_mlm_connection_manager_t fty_common_mlm_connection_manager_t;
+#define FTY_COMMON_MLM_CONNECTION_MANAGER_T_DEFINED
+typedef struct _fty_common_mlm_local_registry_t fty_common_mlm_local_registry_t;
+#define FTY_COMMON_MLM_LOCAL_REGISTRY_T_DEFINED
+typedef struct _fty_common_mlm_shared_payload_t fty_common_mlm_shared_payload_t;
+#define FTY_COMMON_MLM_SHARED_PAYLOAD_T_DEFINED
 
 
 //  Public classes, each with its own header file
 #include "fty_common_mlm_agent.h"
+#include "fty_common_mlm_agent_group.h"
 #include "fty_common_mlm_basic_mailbox_server.h"
+#include "fty_common_mlm_connection_manager.h"
 #include "fty_common_mlm_guards.h"
+#include "fty_common_mlm_local_registry.h"
+#include "fty_common_mlm_shared_payload.h"
 #include "fty_common_mlm_stream_client.h"
 #include "fty_common_mlm_sync_client.h"
+#include "fty_common_mlm_timer_wheel.h"
 #include "fty_common_mlm_tntmlm.h"
 #include "fty_common_mlm_utils.h"
 #include "fty_common_mlm_uuid.h"
@@ -21,11 +21,25 @@
 
 #pragma once
 
+#include "fty_common_mlm_timer_wheel.h"
+#include <cstdint>
 #include <czmq.h>
+#include <deque>
 #include <exception>
+#include <functional>
+#include <memory>
 #include <malamute.h>
+#include <random>
+#include <regex>
+#include <string>
+#include <sys/epoll.h>
+#include <unordered_map>
+#include <vector>
 
 namespace mlm {
+
+class MlmLocalInbox;
+
 /**
  * \brief Helper class to structure the writing of a mlm_client.
  *
@@ -36,6 +50,90 @@ namespace mlm {
 class MlmAgent
 {
 public:
+    /**
+     * \brief Maps a message delivered by malamute to a priority lane (0 is the highest priority).
+     *
+     * The callback DOESN'T take ownership of the message and must not consume its frames.
+     */
+    using Classifier = std::function<unsigned(const char* subject, zmsg_t* message)>;
+
+    /**
+     * \brief Handler of a socket added with registerSocket(). The handler DOESN'T take ownership of the message.
+     * \return false to stop the agent, true otherwise.
+     */
+    using SocketHandler = std::function<bool(zmsg_t* message)>;
+
+    /**
+     * \brief Handler of the messages routed with onMailbox()/onStream(). The handler DOESN'T take ownership.
+     * \return false to stop the agent, true otherwise.
+     */
+    using MessageHandler = std::function<bool(zmsg_t* message)>;
+
+    /**
+     * \brief Malamute command of the message being handled, parsed once per message.
+     */
+    enum class Command
+    {
+        Mailbox,
+        Stream,
+        Service,
+        Unknown
+    };
+
+    /**
+     * \brief Key of a stream message for setStreamPartition(). The callback DOESN'T take ownership.
+     */
+    using KeyFunction = std::function<std::string(const char* subject, zmsg_t* message)>;
+
+    /**
+     * \brief Handler of a file descriptor added with registerFd().
+     * \param events Ready epoll events (EPOLLIN, EPOLLOUT...)
+     * \return false to stop the agent, true otherwise.
+     */
+    using FdHandler = std::function<bool(int fd, uint32_t events)>;
+
+    /**
+     * \brief Event loop backend of the mainloop.
+     *
+     * ZPoller (the default) uses the zpoller_t returned by zpoller(). Epoll watches the ZMQ_FD of the
+     * pipe, of the malamute connection and of the registered sockets, as well as the registered
+     * file descriptors, in an epoll set updated in place when sockets are (un)registered.
+     */
+    enum class Backend
+    {
+        ZPoller,
+        Epoll
+    };
+
+    /**
+     * \brief Event loop counters of the agent, see stats().
+     *
+     * Durations are in microseconds. The counters are only updated by the agent thread, without
+     * locks: read them from this thread, or from others with the STATS pipe command, whose reply is
+     * "STATS" followed by name/value frames ("iterations", "42", "mailbox.messages", "12"...).
+     */
+    struct Stats
+    {
+        struct Handler
+        {
+            uint64_t messages = 0;
+            uint64_t bytes    = 0;
+            uint64_t time     = 0;
+        };
+
+        uint64_t iterations     = 0;
+        uint64_t pollTime       = 0; // blocked waiting for events
+        uint64_t maxHandlerTime = 0;
+        uint64_t foreignStream  = 0; // stream messages of other shards, see setStreamPartition()
+        uint64_t reconnections  = 0;
+        Handler  pipe;
+        Handler  mailbox;
+        Handler  stream;
+        Handler  sockets; // registered sockets and handleOther()
+        Handler  fds;     // registered file descriptors (bytes aren't counted)
+        Handler  timers;  // one message per mainloop iteration running due timers
+    };
+
     /**
      * \brief Destructor.
      *
@@ -52,6 +150,198 @@ public:
      */
     void mainloop();
 
+    /**
+     * \brief Serve malamute deliveries by priority lanes instead of arrival order.
+     *
+     * Once enabled, every message pending on the malamute connection is read and queued in the lane
+     * returned by the classifier (values out of range go to the last lane). The queued message of the
+     * highest priority lane is dispatched first, but a non-empty lower lane is served at the latest after
+     * being passed over starvationLimit times, so background traffic still progresses under load.
+     *
+     * \param lanes Number of lanes (0 disables the lanes)
+     * \param classifier Callback selecting the lane of each delivered message
+     * \param starvationLimit Maximum number of times a non-empty lane is passed over, at least 1
+     * \param maxQueued Maximum number of queued messages, further messages stay in the connection
+     * \throw std::invalid_argument without classifier or with a 0 starvationLimit
+     */
+    void setPriorityLanes(
+        unsigned lanes, Classifier classifier, unsigned starvationLimit = 16, size_t maxQueued = 1024);
+
+    /**
+     * \brief Handle several messages per poller wakeup.
+     *
+     * After a wakeup, messages are read without polling from the ready socket as long as it has
+     * some, up to maxMessages and during at most timeSlice ms (0 for no limit). The pipe is checked
+     * between two messages, and when a batch is cut the other ready sockets are served before the
+     * next batch of the same socket. With priority lanes, up to maxMessages queued messages are
+     * dispatched per wakeup.
+     *
+     * \param maxMessages Maximum messages per batch (1, the default, disables batches)
+     * \param timeSlice Maximum duration of a batch in ms
+     */
+    void setBatch(size_t maxMessages, int64_t timeSlice = 0);
+
+    /**
+     * \brief Poll an additional socket (zsock_t, zactor_t...) and pass its messages to handler.
+     *
+     * Can be called at any time, including from a handler: the default zpoller() is rebuilt before
+     * the next wait. Registering a socket again replaces its handler. The agent doesn't take the
+     * ownership of the socket, it must stay alive until unregisterSocket().
+     */
+    void registerSocket(void* socket, SocketHandler handler);
+
+    /**
+     * \brief Stop polling a socket added with registerSocket(). Can be called from its own handler.
+     * \return false if the socket isn't registered.
+     */
+    bool unregisterSocket(void* socket);
+
+    /**
+     * \brief Select the event loop backend, before mainloop().
+     *
+     * With Epoll, zpoller() isn't used: sockets added by overriding it must be registered instead.
+     * The readiness of a socket is only asked again after the agent read it: a registered socket
+     * also sent to or read outside its handler (by a timer...) may wait for its next message.
+     */
+    void setBackend(Backend backend);
+
+    /**
+     * \brief Watch a file descriptor (timerfd, eventfd, inotify, unix socket...), Epoll backend only.
+     *
+     * The descriptor is watched level triggered for events (EPOLLIN by default), the handler must
+     * consume them. Registering a descriptor again replaces its events and handler. The agent doesn't
+     * take the ownership of the descriptor, it must stay open until unregisterFd().
+     */
+    void registerFd(int fd, FdHandler handler, uint32_t events = EPOLLIN);
+
+    /**
+     * \brief Stop watching a file descriptor added with registerFd(). Can be called from its own handler.
+     * \return false if the descriptor isn't registered.
+     */
+    bool unregisterFd(int fd);
+
+    /**
+     * \brief Route the mailbox messages with the given subject to handler instead of handleMailbox().
+     *
+     * Subjects are looked up in a hash table, messages with an unregistered subject still go to
+     * handleMailbox(). Registering a subject again replaces its handler, an empty handler removes it.
+     * Can be called at any time, including from a handler.
+     */
+    void onMailbox(const std::string& subject, MessageHandler handler);
+
+    /**
+     * \brief Route the messages of stream whose subject matches subjectPattern to handler instead of
+     * handleStream().
+     *
+     * A pattern without regular expression metacharacters is an exact subject, looked up in a hash
+     * table before the patterns. Other patterns are compiled once (ECMAScript syntax) and searched in
+     * the subject like malamute consumer patterns, in registration order. The agent must still consume
+     * the stream (mlm_client_set_consumer()). Registering a pattern again replaces its handler, an empty
+     * handler removes it. Can be called at any time, including from a handler.
+     */
+    void onStream(const std::string& stream, const std::string& subjectPattern, MessageHandler handler);
+
+    /**
+     * \brief Event loop counters, to be read from the agent thread.
+     */
+    const Stats& stats() const
+    {
+        return m_stats;
+    }
+
+    void resetStats()
+    {
+        m_stats = Stats();
+    }
+
+    /**
+     * \brief Only handle the stream messages whose key belongs to shard, out of shards.
+     *
+     * Every shard of a sharded agent (see MlmAgentGroup) consumes the whole streams, and drops the
+     * messages of the other shards as soon as they are received, before priority lanes and handlers.
+     * Keys are spread with MlmUtils::shardOf(). By default the key is the message subject.
+     *
+     * \param shard Index of this agent in [0, shards)
+     * \param shards Number of shards (0 or 1 disables the partition)
+     * \param key Callback returning the key of a message
+     */
+    void setStreamPartition(size_t shard, size_t shards, KeyFunction key = nullptr);
+
+    /**
+     * \brief Reconnect to the broker when the connection is lost, instead of leaving the agent deaf.
+     *
+     * The connection is checked every checkInterval ms. Once it is lost, onDisconnect() is called and
+     * the agent reconnects after minBackoff ms, doubled after each failed attempt up to maxBackoff ms,
+     * each delay shortened by a random jitter of up to one half so that restarted brokers aren't hit by
+     * all their clients at once. The registrations made with setConsumer()/setProducer()/setWorker()
+     * are then restored and onReconnect() is called.
+     *
+     * A broker restarted between two checks is noticed as well, even if mlm_client_t reconnected by
+     * itself meanwhile: the agent is the worker of a service of its own ("$liveness/<address>") and
+     * sends itself a probe at each check. A probe still unanswered one check later means the broker
+     * forgot the registrations. The agent thread is blocked connectTimeout ms at most per attempt.
+     *
+     * Reconnecting replaces the mlm_client_t: don't keep the pointer returned by client(). An agent
+     * overriding zpoller() must rebuild its poller in onReconnect().
+     *
+     * \param checkInterval Interval between connection checks in ms (0 disables the reconnection)
+     * \param minBackoff First delay before reconnecting in ms
+     * \param maxBackoff Maximum delay between two attempts in ms
+     * \param connectTimeout Connection timeout of each attempt in ms
+     */
+    void setReconnect(int64_t checkInterval = 1000, int64_t minBackoff = 100, int64_t maxBackoff = 30000,
+        int connectTimeout = 500);
+
+    /**
+     * \brief Drain before stopping on $TERM, instead of stopping at once.
+     *
+     * On $TERM the agent stops accepting mailbox requests: those not already queued in the priority
+     * lanes go to rejectMailbox() instead of the handlers. Queued messages, stream messages and timers
+     * are still served, and mainloop() returns as soon as the lanes and the connection are empty, or
+     * after gracePeriod ms at most. A second $TERM stops the agent at once.
+     *
+     * \param gracePeriod Maximum drain duration in ms (0, the default, stops at once)
+     */
+    void setDrain(int64_t gracePeriod);
+
+    /**
+     * \brief Exchange with the agents and clients of the process without going through the broker.
+     *
+     * Once enabled, the mailbox of the agent and the streams it consumes with setConsumer() are
+     * registered in the MlmLocalRegistry: what the local senders (agents, MlmConnectionManager sessions)
+     * send there is queued in memory and handled like a malamute delivery, with the same handlers,
+     * envelope getters, priority lanes and drain. sendto() uses the registry first as well. The copies the
+     * broker delivers of the streams mirrored by local publishers are dropped, as already received, unless
+     * the agent doesn't consume them with setConsumer() (mlm_client_set_consumer() on client()...) or its
+     * inbox was full (see MlmLocalRegistry::receivedLocally()).
+     * The agent must be connected.
+     */
+    void setLocalDelivery(bool enable);
+
+    using TimerId = TimerWheel::TimerId;
+
+    /**
+     * \brief Add a periodic timer, run by the mainloop every interval ms.
+     *
+     * The mainloop wakes up for the nearest timer, so timers fire on time whatever the traffic.
+     * The callback returns false to stop the agent.
+     *
+     * \return Identifier of the timer, for cancelTimer()
+     */
+    TimerId addTimer(int64_t interval, TimerWheel::Callback callback);
+
+    /**
+     * \brief Add a timer run once by the mainloop, delay ms from now.
+     * \return Identifier of the timer, for cancelTimer()
+     */
+    TimerId addOneShot(int64_t delay, TimerWheel::Callback callback);
+
+    /**
+     * \brief Cancel a timer, it can be called from a timer callback.
+     * \return false if the timer doesn't exist (anymore).
+     */
+    bool cancelTimer(TimerId id);
+
 protected:
     /**
      * \brief Constructor.
@@ -63,7 +353,7 @@ protected:
      * \param pipe Pipe of the zactor_t
      * \param endpoint Endpoint to connect to
      * \param address Name of the established connection
-     * \param pollerTimeout Timeout of poller and rough interval between tick() invocations (-1 to disable)
+     * \param pollerTimeout Interval between tick() invocations (-1 to disable)
      * \param connectionTimeout Timeout for connection attempt
      */
     MlmAgent(zsock_t* pipe, const char* endpoint = nullptr, const char* address = nullptr, int pollerTimeout = -1,
@@ -76,7 +366,37 @@ protected:
      */
     virtual void connect(const char* endpoint, const char* address, int connectionTimeout = 5000);
     /**
-     * \brief Periodic callback, if enabled.
+     * \brief mlm_client_set_consumer(), mlm_client_set_producer() and mlm_client_set_worker() on the
+     * current connection, remembered to be restored after a reconnection (see setReconnect()).
+     * \return 0 on success, -1 otherwise.
+     */
+    int setConsumer(const std::string& stream, const std::string& pattern);
+    int setProducer(const std::string& stream);
+    int setWorker(const std::string& service, const std::string& pattern);
+
+    /**
+     * \brief mlm_client_sendto() going through the local registry when address is a local mailbox
+     * (see setLocalDelivery()), content is consumed.
+     * \return 0 on success, -1 otherwise.
+     */
+    int sendto(const std::string& address, const std::string& subject, zmsg_t** content, uint32_t timeout = 1000);
+
+    /**
+     * \brief Called when the connection to the broker is found lost (see setReconnect()).
+     */
+    virtual void onDisconnect()
+    {
+    }
+
+    /**
+     * \brief Called once reconnected to the broker and the registrations restored (see setReconnect()).
+     */
+    virtual void onReconnect()
+    {
+    }
+
+    /**
+     * \brief Periodic callback, if enabled. It is a timer of the agent (see addTimer()).
      * \return false to stop the agent, true otherwise.
      */
     virtual bool tick()
@@ -109,7 +429,8 @@ protected:
     }
 
     /**
-     * \brief Callback for "other" messages. The callback DOESN'T take ownership of the message.
+     * \brief Callback for "other" messages, from sockets added to the poller by overriding zpoller()
+     * rather than with registerSocket(). The callback DOESN'T take ownership of the message.
      * \return false to stop the agent, true otherwise.
      */
     virtual bool handleOther(zmsg_t* /*message*/, void* /*which*/)
@@ -117,8 +438,29 @@ protected:
         return true;
     }
 
+    /**
+     * \brief Callback for mailbox messages received while draining (see setDrain()), they are dropped
+     * by default. The callback DOESN'T take ownership of the message.
+     * \return false to stop the agent, true otherwise.
+     */
+    virtual bool rejectMailbox(zmsg_t* /*message*/)
+    {
+        return true;
+    }
+
+    /**
+     * \brief true once a $TERM started the drain (see setDrain()).
+     */
+    bool draining() const
+    {
+        return m_draining;
+    }
+
     /**
      * \brief Create/get the zpoller_t* object for the agent mainloop.
+     *
+     * The default poller watches the pipe, the malamute connection and the registered sockets.
+     *
      * \return The mainloop poller object.
      */
     virtual zpoller_t* zpoller();
@@ -141,13 +483,166 @@ protected:
         return m_pipe;
     }
 
+    /**
+     * \brief Getters for the envelope of the message being handled.
+     *
+     * Use them instead of mlm_client_sender()/mlm_client_subject()... as, with priority lanes, the
+     * mlm_client_t holds the envelope of the last received message, not of the one being handled.
+     */
+    Command     command();
+    const char* sender();
+    const char* subject();
+    const char* address();
 
 private:
+    struct Delivery
+    {
+        Command     command;
+        std::string sender;
+        std::string subject;
+        std::string address;
+        zmsg_t*     message;
+    };
+
+    // socket is nullptr for the registered file descriptors
+    struct EpollEntry
+    {
+        void*     socket;
+        int       fd;
+        uint32_t  events;
+        uint32_t  revents;
+        FdHandler handler;
+        bool      ready;
+        bool      recheck; // in m_epollRecheck
+    };
+
+    struct Pattern
+    {
+        std::string    source;
+        std::regex     regex;
+        MessageHandler handler;
+    };
+
+    struct SubjectTable
+    {
+        // behind pointers: a running handler stays where it is when replaced or removed
+        std::unordered_map<std::string, std::unique_ptr<MessageHandler>> exact;
+        std::vector<std::unique_ptr<Pattern>>                            patterns;
+    };
+
+    struct StreamTable
+    {
+        std::string  stream;
+        SubjectTable subjects;
+    };
+
+    static Command  parseCommand(const char* command);
+    static uint64_t usecs();
+
+    void account(Stats::Handler& handler, uint64_t start, size_t bytes);
+    void sendStats();
+
+    int   pollTimeout();
+    void* wait(int timeout);
+    void* epollWait(int timeout);
+    void  epollAdd(void* which, std::unique_ptr<EpollEntry> entry);
+    void  epollRemove(void* which);
+    void  epollRecheck(void* which);
+    bool  serveBatch(void* which);
+    bool  lanesFull(void* which);
+    bool  handleSocket(void* which);
+    bool  removed(void* which);
+    bool  isSocket(void* which);
+    void* otherReady(void* which);
+    void  startDrain();
+    bool  drained();
+    void  checkConnection();
+    void  scheduleReconnect();
+    void  reconnect();
+    void  sendProbe();
+    bool  isProbe(Command command);
+    bool  restoreRegistrations();
+    void  setClient(mlm_client_t* client);
+    bool  receiveClient();
+    bool  foreign(Command command, zmsg_t* message);
+    bool  mirroredCopy(Command command, zmsg_t* message);
+    bool  dispatchLocal(zmsg_t* message);
+    void  unregisterLocal();
+    bool  dispatchClient(zmsg_t* message);
+    bool  dispatchQueued();
+    bool  dispatchTable(SubjectTable& table, zmsg_t* message, bool& rv);
+    void  setHandler(std::unordered_map<std::string, std::unique_ptr<MessageHandler>>& exact,
+         const std::string& subject, MessageHandler&& handler);
+
     mlm_client_t* m_client;
     zsock_t*      m_pipe;
-    int64_t       m_lastTick;
     int           m_pollerTimeout;
     zpoller_t*    m_defaultZpoller;
+    TimerWheel    m_timers;
+    TimerId       m_tickTimer = 0;
+    Stats         m_stats;
+
+    std::string                                      m_endpoint;
+    std::string                                      m_address;
+    int                                              m_connectionTimeout = 5000;
+    std::vector<std::pair<std::string, std::string>> m_consumers;
+    std::vector<std::pair<std::string, std::string>> m_workers;
+    std::string                                      m_producer;
+    TimerId                                          m_reconnectTimer   = 0;
+    int64_t                                          m_minBackoff       = 0;
+    int64_t                                          m_maxBackoff       = 0;
+    int64_t                                          m_backoff          = 0;
+    bool                                             m_reconnecting     = false;
+    int                                              m_reconnectTimeout = 500;
+    // liveness probes, see setReconnect()
+    std::string m_probeService;
+    uint64_t    m_probeSent     = 0;
+    uint64_t    m_probeReceived = 0;
+    std::minstd_rand                                 m_random;
+
+    std::unique_ptr<MlmLocalInbox> m_localInbox;
+    std::vector<uint64_t>          m_localConsumers;
+
+    int64_t m_drainPeriod = 0;
+    bool    m_draining    = false;
+
+    std::vector<std::deque<Delivery>> m_lanes;
+    std::vector<unsigned>             m_lanePassed;
+    Classifier                        m_classifier;
+    unsigned                          m_starvationLimit = 0;
+    size_t                            m_maxQueued       = 0;
+    size_t                            m_queued          = 0;
+    const Delivery*                   m_current         = nullptr;
+    Command                           m_command         = Command::Unknown;
+
+    size_t      m_shard  = 0;
+    size_t      m_shards = 1;
+    KeyFunction m_shardKey;
+
+    SubjectTable             m_mailboxHandlers;
+    std::vector<StreamTable> m_streamHandlers;
+    std::string              m_lookup;
+
+    size_t  m_batchSize  = 1;
+    int64_t m_batchSlice = 0;
+    void*   m_batchCut   = nullptr;
+
+    // the handlers stay where they are while running, even if unregistered meanwhile
+    std::unordered_map<void*, std::unique_ptr<SocketHandler>> m_sockets;
+    std::vector<std::unique_ptr<SocketHandler>>               m_retiredSockets;
+    std::vector<std::unique_ptr<MessageHandler>>              m_retiredHandlers;
+    std::vector<std::unique_ptr<Pattern>>                     m_retiredPatterns;
+    // sockets and file descriptor entries unregistered since the last wait, maybe destroyed
+    std::vector<void*> m_removed;
+    bool               m_zpollerDirty = false;
+
+    Backend                                                m_backend   = Backend::ZPoller;
+    int                                                    m_epollFd   = -1;
+    std::unordered_map<void*, std::unique_ptr<EpollEntry>> m_epollEntries;
+    std::unordered_map<int, EpollEntry*>                   m_fdEntries;
+    std::vector<std::unique_ptr<EpollEntry>>               m_retiredEntries;
+    std::deque<EpollEntry*>                                m_epollReady;
+    std::vector<EpollEntry*>                               m_epollRecheck;
 };
 
 } // namespace mlm
@@ -0,0 +1,99 @@
+/*  =========================================================================
+    fty_common_mlm_agent_group - Runtime running the shards of a malamute agent
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#pragma once
+
+#include "fty_common_mlm_agent.h"
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace mlm {
+
+/**
+ * \brief Runs several copies (shards) of an agent, each in its own thread with its own malamute connection.
+ *
+ * The factory creates the agent of each shard in the thread of the shard. To share the load:
+ *  - mailbox requests are routed by the clients: a shard connects as MlmUtils::shardName(name, shard)
+ *    and clients send to the shard given by MlmUtils::shardOf(key, shards) (see MlmSyncClient::setShards())
+ *  - streams are partitioned by the shards: each one calls MlmAgent::setStreamPartition(shard, shards)
+ *
+ * The group owns the threads: destroying it sends $TERM to every shard and waits for them.
+ */
+class MlmAgentGroup
+{
+public:
+    /**
+     * \brief Creates the agent of a shard, called in the thread of the shard.
+     *
+     * An exception (or a null agent) is logged and leaves the shard stopped, the other shards run.
+     */
+    using Factory = std::function<std::unique_ptr<MlmAgent>(zsock_t* pipe, size_t shard)>;
+
+    /**
+     * \brief Start the shards, it returns once all of them run (or failed).
+     * \param shards Number of shards
+     * \param factory Creates the agent of a shard
+     * \param name Name of the group, for the logs
+     */
+    MlmAgentGroup(size_t shards, Factory factory, const std::string& name = "agent-group");
+
+    ~MlmAgentGroup();
+
+    MlmAgentGroup(const MlmAgentGroup&) = delete;
+    MlmAgentGroup& operator=(const MlmAgentGroup&) = delete;
+
+    size_t size() const
+    {
+        return m_shards.size();
+    }
+
+    /**
+     * \brief Actor of a shard, to send it pipe commands (STATS...).
+     */
+    zactor_t* actor(size_t shard) const
+    {
+        return m_shards.at(shard).actor;
+    }
+
+    /**
+     * \brief Send $TERM to every shard and wait for them. Called by the destructor.
+     */
+    void stop();
+
+private:
+    struct Shard
+    {
+        MlmAgentGroup* group;
+        size_t         index;
+        zactor_t*      actor;
+    };
+
+    static void shardActor(zsock_t* pipe, void* args);
+
+    // attributs
+    Factory            m_factory;
+    std::string        m_name;
+    std::vector<Shard> m_shards;
+};
+
+} // namespace mlm
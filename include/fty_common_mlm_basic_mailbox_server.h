@@ -22,8 +22,13 @@
 #pragma once
 
 #include "fty_common_mlm_agent.h"
+#include "fty_common_mlm_agent_group.h"
+#include <chrono>
 #include <fty_common_sync_server.h>
+#include <list>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 
 namespace mlm {
@@ -37,6 +42,11 @@ namespace mlm {
  *  - The first frame in request or reply is a correlation Id
  *  - The following frames are a payload frames
  *
+ * Requests can be served by priority (see MlmAgent::setPriorityLanes()), the classifier
+ * then sees the correlation Id as first frame of the message. With MlmAgent::setLocalDelivery(), the
+ * requests of the clients of the same process (see MlmConnectionManager::setLocalDelivery()) are received
+ * and replied without the broker.
+ *
  * \see fty_common_mlm_sync_client.h
  */
 
@@ -45,15 +55,109 @@ class MlmBasicMailboxServer : public mlm::MlmAgent
 public:
     explicit MlmBasicMailboxServer(zsock_t* pipe, fty::SyncServer& server, const std::string& name,
         const std::string& endpoint = "ipc://@/malamute");
+    ~MlmBasicMailboxServer() override;
+
+    /**
+     * \brief Answer retried requests with the reply computed for the first one.
+     *
+     * A request with the same sender and correlation Id as a request handled less than window ms
+     * ago gets the stored reply instead of being handled again. At most capacity replies are kept,
+     * the oldest being forgotten first (0 disables the suppression).
+     *
+     * The replies are kept per server: in a MlmBasicMailboxServerGroup, each shard only knows its own.
+     * A retry sent to another shard (different shard key, round-robin) is handled again, the clients
+     * must send it to the same address. MlmSyncClient fails over to another broker with the same
+     * address, but gives each call a new correlation Id.
+     */
+    void setDuplicateSuppression(size_t capacity, int64_t window = 5000);
+
+    /**
+     * \brief Payload replied to the requests rejected while draining (see MlmAgent::setDrain()), so
+     * that clients don't wait for their timeout. Rejected requests get no reply if it is empty (default).
+     * The direct channel negotiations are always answered while draining, with no endpoint.
+     */
+    void setShutdownReply(const fty::Payload& payload);
+
+    /**
+     * \brief Hand over the replies whose payload weighs threshold bytes or more in shared memory, see
+     * MlmSharedPayload (0, the default, disables it). Large requests are always accepted. The segments of
+     * the replies never read are unlinked after ttl.
+     */
+    void setSharedMemory(size_t threshold, std::chrono::milliseconds ttl = std::chrono::seconds(60));
+
+    /**
+     * \brief Also serve requests on a direct channel, a ROUTER socket bound to endpoint ("ipc://@/name",
+     * "tcp://127.0.0.1:*"...), for the clients opting in with MlmSyncClient::setDirect().
+     *
+     * The clients learn the channel through the broker ("CHANNEL" mailbox request), their requests then skip
+     * the broker and the priority lanes. The requests received while draining are rejected like mailbox ones.
+     * An empty endpoint closes the channel.
+     *
+     * \throw std::runtime_error when endpoint can't be bound
+     */
+    void setDirectEndpoint(const std::string& endpoint);
 
 private:
     bool handleMailbox(zmsg_t* message) override;
+    bool rejectMailbox(zmsg_t* message) override;
+    bool handleDirect(zmsg_t* message);
+    void handleRequest(const std::string& subject, const std::string& uniqueSender, zmsg_t* message);
+    void rejectRequest(const std::string& uniqueSender, zmsg_t* message);
+    void sendReply(const std::string& address, const std::string& correlationId, const fty::Payload& results);
+    void purgeRecentReplies(int64_t now);
 
 private:
+    struct RecentReply
+    {
+        std::string  key;
+        int64_t      time;
+        fty::Payload results;
+    };
+
     // attributs
     fty::SyncServer& m_server;
     std::string      m_name;
     std::string      m_endpoint;
+    fty::Payload     m_shutdownReply;
+
+    size_t                    m_sharedThreshold = 0;
+    std::chrono::milliseconds m_sharedTtl{60000};
+
+    // direct channel, and route of the direct request being handled (nullptr for mailbox requests)
+    zsock_t*    m_direct = nullptr;
+    std::string m_directEndpoint;
+    zframe_t*   m_directRoute = nullptr;
+
+    // recent replies, oldest first
+    std::list<RecentReply>                                            m_recentReplies;
+    std::unordered_map<std::string, std::list<RecentReply>::iterator> m_recentIndex;
+    size_t                                                            m_recentCapacity = 0;
+    int64_t                                                           m_recentWindow   = 0;
+};
+
+/**
+ * \brief Group of basic mailbox servers sharing the load of one mailbox.
+ *
+ * The group starts one MlmBasicMailboxServer per shard, named <name>.0 to <name>.<shards-1>, each
+ * with its own malamute connection and thread. Clients spread their requests over the shards with
+ * MlmSyncClient::setShards(). The fty::SyncServer object is shared by all the shards and must be
+ * thread safe. The shards don't share their state: the duplicate suppression of a shard (see
+ * MlmBasicMailboxServer::setDuplicateSuppression()) doesn't see the requests handled by the others.
+ */
+class MlmBasicMailboxServerGroup
+{
+public:
+    explicit MlmBasicMailboxServerGroup(fty::SyncServer& server, const std::string& name, size_t shards,
+        const std::string& endpoint = "ipc://@/malamute");
+
+    size_t size() const
+    {
+        return m_group.size();
+    }
+
+private:
+    // attributs
+    MlmAgentGroup m_group;
 };
 
 } // namespace mlm
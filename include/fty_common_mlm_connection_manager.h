@@ -0,0 +1,199 @@
+/*  =========================================================================
+    fty_common_mlm_connection_manager - Broker sessions shared by the clients of a process
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <czmq.h>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace mlm {
+
+/**
+ * \brief Malamute sessions shared by the clients of the process (MlmSyncClient, MlmStreamClient).
+ *
+ * A session is a malamute connection, named after the identity the clients give (name.<pid in hexa>,
+ * the form MlmBasicMailboxServer takes the sender from). Its thread owns the connection: it sends the
+ * requests and publications of the other threads, and hands:
+ *  - the mailbox replies to the request waiting for their correlation id (first frame)
+ *  - the stream deliveries to the handlers subscribed to their stream and subject
+ * It also checks the broker every few seconds and reconnects, restoring the stream consumers, when the
+ * connection is lost or the broker restarted.
+ *
+ * So the clients using the same endpoint and identity share one connection, whatever their number of
+ * threads and requests. A session is closed once no client is attached to its identity (see attach()),
+ * no subscription uses it and no call is in progress; reset() closes them all.
+ * This class is thread safe.
+ */
+class MlmConnectionManager
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    /**
+     * \brief Handles a message delivered on a stream, called by the thread of the session.
+     *
+     * It may publish, but mustn't call unsubscribe() nor wait for a reply on the same session, the message belongs
+     * to the caller. A session released by its own handler (detach()...) can't stop its thread from it: it is
+     * closed by the next call of another thread, or by reset().
+     */
+    using StreamHandler = std::function<void(const std::string& subject, zmsg_t* message)>;
+
+    /**
+     * \brief Delivery to the agents and sessions of the process, see setLocalDelivery().
+     */
+    enum class LocalDelivery
+    {
+        Off,  // everything goes through the broker
+        Local // local destinations get the messages in memory, the streams are also published to the broker
+    };
+
+    static MlmConnectionManager& instance();
+
+    /**
+     * \brief Malamute address of the session name: <name>.<pid in hexa>.
+     */
+    static std::string address(const std::string& name);
+
+    MlmConnectionManager();
+    ~MlmConnectionManager();
+
+    MlmConnectionManager(const MlmConnectionManager&) = delete;
+    MlmConnectionManager& operator=(const MlmConnectionManager&) = delete;
+
+    /**
+     * \brief Keep the sessions of name open between the calls, until detach().
+     *
+     * MlmSyncClient and MlmStreamClient attach their identities for their lifetime. The sessions of a name
+     * nobody is attached to are closed after each call, and after their last subscription.
+     */
+    void attach(const std::string& name);
+    void detach(const std::string& name);
+
+    /**
+     * \brief Send a request to a mailbox and wait for its reply.
+     * \param endpoint, name Session to use, connected (within timeout) on first use
+     * \param address, subject Destination of the request
+     * \param correlationId First frame of the reply
+     * \param request Request, consumed
+     * \param timeout Connection and send timeout in ms
+     * \param deadline Reply deadline, Clock::time_point::max() to wait until interrupted
+     * \return The reply, correlation id included, or NULL on failure, expiry or interrupt
+     * \throw std::runtime_error when the session can't connect
+     */
+    zmsg_t* requestReply(const std::string& endpoint, const std::string& name, const std::string& address,
+        const std::string& subject, const std::string& correlationId, zmsg_t** request, uint32_t timeout,
+        Clock::time_point deadline);
+
+    /**
+     * \brief Publish a message on a stream, consumed.
+     * \throw std::runtime_error when the session can't connect or publish
+     */
+    void publish(const std::string& endpoint, const std::string& name, const std::string& stream,
+        const std::string& subject, zmsg_t** message, uint32_t timeout);
+
+    /**
+     * \brief Call handler for the messages of stream whose subject contains a match of pattern, like malamute.
+     * \return Id of the subscription, for unsubscribe()
+     * \throw std::runtime_error when the session can't connect or consume the stream
+     */
+    uint64_t subscribe(const std::string& endpoint, const std::string& name, const std::string& stream,
+        const std::string& pattern, StreamHandler handler, uint32_t timeout);
+
+    /**
+     * \brief Remove a subscription, its handler is not called anymore once it returns.
+     *
+     * The session stays consumer of the stream (malamute can't undo it), the messages are dropped.
+     */
+    void unsubscribe(uint64_t subscription);
+
+    /**
+     * \brief Bypass the broker when the destination is in the process (see MlmLocalRegistry).
+     *
+     * The sessions opened afterwards register their mailbox and stream consumers in the local registry. Their
+     * requests to a local mailbox (an agent with MlmAgent::setLocalDelivery()...) and the replies are queued in
+     * memory, and so are their publications to the local consumers. The publications still reach the broker,
+     * for its other consumers and observers, and the local consumers drop the copy it delivers. Requests are
+     * never mirrored, they would be handled twice. Off by default.
+     */
+    void setLocalDelivery(LocalDelivery mode);
+
+    /**
+     * \brief Brokers to try, in turn, for key (destination, stream) among endpoints.
+     *
+     * The order is the rendezvous hash of key (MlmUtils::rendezvousOrder()): the keys are spread over the
+     * brokers and each fails over to the same next one. The brokers reported unreachable in the last
+     * UNREACHABLE_PERIOD come last, in the same order.
+     */
+    std::vector<std::string> brokers(const std::string& key, const std::vector<std::string>& endpoints) const;
+
+    /**
+     * \brief Report endpoint as unreachable (can't connect nor send), see brokers().
+     */
+    void setUnreachable(const std::string& endpoint);
+
+    static constexpr std::chrono::seconds UNREACHABLE_PERIOD{10};
+
+    /**
+     * \brief Number of sessions open.
+     */
+    size_t sessions() const;
+
+    /**
+     * \brief Close all the sessions, the requests in progress fail.
+     *
+     * Called at the end of the process too, before czmq shuts down.
+     */
+    void reset();
+
+private:
+    class Session;
+
+    // the callers keep the session alive while using it, even if reset() meanwhile, and give it back to
+    // release(); connected on first use, out of m_mutex
+    std::shared_ptr<Session> session(const std::string& endpoint, const std::string& name, uint32_t timeout);
+    void                     release(const std::shared_ptr<Session>& session);
+    // closes sessions, except those of the calling thread which go to m_retired
+    void closeSessions(std::vector<std::shared_ptr<Session>> sessions);
+    void closeRetired();
+
+    mutable std::mutex                                                      m_mutex;
+    std::map<std::pair<std::string, std::string>, std::shared_ptr<Session>> m_sessions;
+    // sessions released by their own thread, to close from another one
+    std::vector<std::shared_ptr<Session>> m_retired;
+    // attached clients, by name
+    std::map<std::string, unsigned> m_users;
+    // session of each subscription
+    std::map<uint64_t, std::shared_ptr<Session>> m_subscriptions;
+    uint64_t                                     m_lastSubscription = 0;
+    LocalDelivery                                m_localDelivery    = LocalDelivery::Off;
+    // endpoint -> end of the unreachable period
+    std::map<std::string, Clock::time_point> m_unreachable;
+};
+
+} // namespace mlm
@@ -0,0 +1,193 @@
+/*  =========================================================================
+    fty_common_mlm_local_registry - In-process delivery between co-located clients and agents
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <czmq.h>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <regex>
+#include <shared_mutex>
+#include <string>
+#include <utility>
+
+namespace mlm {
+
+/**
+ * \brief In-memory queue receiving the local deliveries of one mailbox owner (agent, session...).
+ *
+ * The messages are queued on an inproc socket, polled by the owner thread with socket(). Each one starts
+ * with the envelope malamute would give (command, sender, subject, address), followed by the content
+ * frames, see open(). Any thread may send, the other calls belong to the owner thread.
+ */
+class MlmLocalInbox
+{
+public:
+    struct Envelope
+    {
+        std::string command; // "MAILBOX DELIVER" or "STREAM DELIVER"
+        std::string sender;
+        std::string subject;
+        std::string address; // mailbox or stream
+    };
+
+    /**
+     * \throw std::runtime_error when the sockets can't be created
+     */
+    MlmLocalInbox();
+    ~MlmLocalInbox();
+
+    MlmLocalInbox(const MlmLocalInbox&) = delete;
+    MlmLocalInbox& operator=(const MlmLocalInbox&) = delete;
+
+    /**
+     * \brief Socket to poll and receive from.
+     */
+    zsock_t* socket()
+    {
+        return m_pull;
+    }
+
+    /**
+     * \brief Queue content with envelope, without blocking.
+     * \return true on success (content consumed), false when the queue is full (content left untouched).
+     */
+    bool send(const Envelope& envelope, zmsg_t** content);
+
+    /**
+     * \brief Pop the envelope of a received message, leaving its content.
+     * \return false if the message has no envelope.
+     */
+    static bool open(zmsg_t* message, Envelope& envelope);
+
+    /**
+     * \brief Remember a stream message which couldn't be queued, the owner keeps the copy of the broker.
+     */
+    void miss(const Envelope& envelope, zmsg_t* content);
+
+    /**
+     * \brief true if the message was missed, forgotten then: its copy of the broker is the one to keep.
+     */
+    bool takeMissed(const Envelope& envelope, zmsg_t* content);
+
+private:
+    // bound of the missed messages remembered, the oldest are forgotten first
+    static constexpr size_t MAX_MISSED = 1024;
+
+    zsock_t*             m_pull;
+    zsock_t*             m_push;
+    std::mutex           m_pushMutex;
+    std::deque<uint64_t> m_missed; // digests, guarded by m_pushMutex
+};
+
+/**
+ * \brief Mailboxes and stream consumers of the process, to bypass the broker when both ends are local.
+ *
+ * MlmAgent::setLocalDelivery() and MlmConnectionManager::setLocalDelivery() register their mailbox and
+ * stream consumers here, with the inbox receiving them. A message sent to a mailbox registered for the
+ * same endpoint, or published on a stream with registered consumers, is then queued in their inbox: it
+ * is neither serialized to nor routed by the broker, but keeps the malamute semantics (envelope, one copy
+ * per consumer whose pattern is found in the subject). The inboxes must be removed before being destroyed.
+ * This class is thread safe.
+ */
+class MlmLocalRegistry
+{
+public:
+    static MlmLocalRegistry& instance();
+
+    /**
+     * \brief Deliver the messages sent to address locally.
+     *
+     * mirrored tells the consumers of the streams address publishes that it mirrors them to the broker:
+     * they drop the copies the broker delivers, see receivedLocally(). Registering an address again
+     * replaces it.
+     */
+    void addMailbox(const std::string& endpoint, const std::string& address, MlmLocalInbox* inbox, bool mirrored);
+
+    /**
+     * \brief Unregister address, if still delivered to inbox.
+     */
+    void removeMailbox(const std::string& endpoint, const std::string& address, MlmLocalInbox* inbox);
+
+    /**
+     * \brief Deliver the local messages of stream whose subject matches pattern to inbox.
+     * \return Id of the consumer, for removeConsumer()
+     * \throw std::regex_error on an invalid pattern
+     */
+    uint64_t addConsumer(
+        const std::string& endpoint, const std::string& stream, const std::string& pattern, MlmLocalInbox* inbox);
+
+    void removeConsumer(uint64_t consumer);
+
+    /**
+     * \brief Send content to a local mailbox.
+     * \return true if delivered (content consumed), false if address isn't local or its queue is full.
+     */
+    bool sendto(const std::string& endpoint, const std::string& sender, const std::string& address,
+        const std::string& subject, zmsg_t** content);
+
+    /**
+     * \brief Deliver a copy of content to the local consumers of stream, once per inbox.
+     *
+     * A full inbox misses its copy (see MlmLocalInbox::miss()): its owner keeps the copy of the broker.
+     * \return Number of copies delivered.
+     */
+    size_t publish(const std::string& endpoint, const std::string& sender, const std::string& stream,
+        const std::string& subject, zmsg_t* content);
+
+    /**
+     * \brief true if sender is local and mirrors its publications to the broker.
+     */
+    bool mirrored(const std::string& endpoint, const std::string& sender) const;
+
+    /**
+     * \brief true if the stream message the broker delivered to inbox was already queued in it, to drop.
+     *
+     * That is when sender mirrors its publications, inbox has a local consumer of stream for subject and
+     * didn't miss it. The consumers registered to the broker only (mlm_client_set_consumer()...) keep it.
+     */
+    bool receivedLocally(const std::string& endpoint, const std::string& sender, const std::string& stream,
+        const std::string& subject, zmsg_t* content, MlmLocalInbox* inbox) const;
+
+private:
+    struct Mailbox
+    {
+        MlmLocalInbox* inbox;
+        bool           mirrored;
+    };
+
+    struct Consumer
+    {
+        std::string    endpoint;
+        std::string    stream;
+        std::regex     pattern;
+        MlmLocalInbox* inbox;
+    };
+
+    mutable std::shared_mutex                              m_mutex;
+    std::map<std::pair<std::string, std::string>, Mailbox> m_mailboxes;
+    std::map<uint64_t, Consumer>                           m_consumers;
+    uint64_t                                               m_lastConsumer = 0;
+};
+
+} // namespace mlm
@@ -1,6 +1,21 @@
 #pragma once
 #include "fty_common_mlm_tntmlm.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <memory>
 #include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 namespace details {
 
@@ -8,17 +23,44 @@ template <typename ObjectType>
 class Pool
 {
 public:
+    // tells if a spare object can still be used, the others are discarded
+    using Validator = std::function<bool(ObjectType&)>;
+    // creates the objects (connected to which endpoint, with which identity...)
+    using Factory = std::function<std::unique_ptr<ObjectType>()>;
+    using Clock   = std::chrono::steady_clock;
+
+    struct Stats
+    {
+        unsigned live       = 0; // objects created and not destroyed yet, spare or in use
+        unsigned inUse      = 0;
+        unsigned peakInUse  = 0; // sampled when a get() does not find a spare object in its thread's magazine
+        uint64_t gets       = 0; // objects handed out by get()
+        uint64_t hits       = 0; // of them, spare ones: the hit rate is hits / gets
+        uint64_t created    = 0;
+        uint64_t createTime = 0; // total creation time, in us: the average is createTime / created
+        uint64_t evicted    = 0; // idle or too old, see setEviction()
+        uint64_t waits      = 0; // get() which waited for the capacity, see setCapacity()
+        uint64_t waitTime   = 0; // total time waited, in us
+        uint64_t timeouts   = 0; // get() which returned an empty Ptr
+    };
+
     class Ptr
     {
         friend class Pool;
 
         std::unique_ptr<ObjectType> m_object = nullptr;
         Pool*                       m_pool   = nullptr;
+        Clock::time_point           m_created;
 
         void doUnlink()
         {
-            if (m_pool) {
-                m_pool->put(*this);
+            if (!m_pool || !m_object) {
+                return;
+            }
+            if (!m_pool->put(*this)) {
+                // destroyed, its place is free for a waiting get()
+                m_object.reset();
+                m_pool->released();
             }
         }
 
@@ -33,8 +75,10 @@ public:
 
         Ptr(Ptr&& ptr)
             : m_object(std::move(ptr.m_object))
-            , m_pool(std::move(ptr.m_pool))
+            , m_pool(ptr.m_pool)
+            , m_created(ptr.m_created)
         {
+            ptr.m_pool = nullptr;
         }
 
         ~Ptr()
@@ -47,8 +91,10 @@ public:
         {
             if (m_object != ptr.m_object) {
                 doUnlink();
-                m_object = std::move(ptr.m_object);
-                m_pool   = std::move(ptr.m_pool);
+                m_object   = std::move(ptr.m_object);
+                m_pool     = ptr.m_pool;
+                m_created  = ptr.m_created;
+                ptr.m_pool = nullptr;
             }
             return *this;
         }
@@ -105,6 +151,10 @@ public:
 
         void release()
         {
+            if (m_pool && m_object) {
+                m_pool->magazine().returned++;
+                m_pool->released();
+            }
             m_pool = nullptr;
         }
 
@@ -120,87 +170,970 @@ public:
     };
 
 private:
-    using Container = std::vector<std::unique_ptr<ObjectType>>;
+    struct Spare
+    {
+        std::unique_ptr<ObjectType> object;
+        Clock::time_point           created;
+        Clock::time_point           lastUse;
+    };
 
-    Container          m_freePool;
-    unsigned           m_maxSpare;
-    mutable std::mutex m_mutex;
+    using Container = std::vector<Spare>;
+
+    // objects moved at once between a magazine and the shared free list
+    static constexpr size_t MagazineBatch = 4;
+
+    // per thread free list in front of the shared one, its mutex is only contended by the
+    // pool-wide operations (drop, steal...); on its own cache line, not to bounce between the threads
+    struct alignas(64) Magazine
+    {
+        std::mutex mutex;
+        Container  objects;
+        // spare slots reserved for the objects put back by the thread, see reserveSpare(): put() and
+        // get() only move one between objects and credits
+        unsigned credits = 0;
+        bool     orphan  = false; // its thread exited
+
+        // read without the mutex, by the lazy totals of spare() and stats()
+        std::atomic<unsigned> count{0}; // objects.size()
+        std::atomic<uint64_t> gets{0};
+        std::atomic<uint64_t> hits{0};
+        std::atomic<uint64_t> returned{0}; // objects put back or released by the thread
+
+        std::shared_ptr<std::atomic<unsigned>> orphans; // of its pool
+    };
+
+    // magazines of a thread, by pool id (a pool may be created at the address of a destroyed one)
+    struct ThreadMagazines
+    {
+        std::vector<std::pair<uint64_t, std::weak_ptr<Magazine>>> magazines;
+
+        ~ThreadMagazines()
+        {
+            for (auto& it : magazines) {
+                if (auto magazine = it.second.lock()) {
+                    std::lock_guard<std::mutex> lock(magazine->mutex);
+                    magazine->orphan = true;
+                    (*magazine->orphans)++;
+                }
+            }
+        }
+    };
+
+    static uint64_t newId()
+    {
+        static std::atomic<uint64_t> lastId{0};
+        return ++lastId;
+    }
+
+    Container             m_freePool;
+    std::atomic<unsigned> m_maxSpare;
+    mutable std::mutex    m_mutex;
+    Validator             m_validator;
+    Factory               m_factory;
+
+    const uint64_t                         m_id = newId();
+    std::vector<std::shared_ptr<Magazine>> m_magazines;
+    std::shared_ptr<std::atomic<unsigned>> m_orphans = std::make_shared<std::atomic<unsigned>>(0);
+    // spare slots used, bounded by m_maxSpare: objects in m_freePool, objects and credits of the magazines
+    unsigned m_reserved = 0;
+    uint64_t m_returned = 0; // Magazine::returned of the exited threads, as m_stats.gets and hits
+
+    // background maintenance, see prewarm()
+    std::thread               m_maintenance;
+    std::condition_variable   m_maintenanceCond;
+    unsigned                  m_minSpare = 0;
+    std::chrono::milliseconds m_refreshInterval{0};
+    bool                      m_stop = false;
+
+    // bound of the live objects, see setCapacity()
+    std::atomic<unsigned>     m_live{0};
+    std::atomic<unsigned>     m_maxLive{0};
+    std::atomic<unsigned>     m_waiters{0};
+    std::condition_variable   m_capacityCond;
+    std::chrono::milliseconds m_acquireTimeout{0};
+    Stats                     m_stats; // waits, waitTime, timeouts and peakInUse, guarded by m_mutex
+
+    // eviction of the spare objects, see setEviction()
+    std::atomic<std::chrono::milliseconds> m_maxIdle{std::chrono::milliseconds(0)};
+    std::atomic<std::chrono::milliseconds> m_maxAge{std::chrono::milliseconds(0)};
+
+    // counters of stats(), the ones of each get() and put() are in the magazines
+    std::atomic<uint64_t> m_created{0};
+    std::atomic<uint64_t> m_createTime{0};
+    std::atomic<uint64_t> m_evicted{0};
+
+    // magazine of the calling thread
+    Magazine& magazine()
+    {
+        static thread_local ThreadMagazines local;
+
+        for (auto it = local.magazines.begin(); it != local.magazines.end();) {
+            if (it->first == m_id) {
+                return *it->second.lock();
+            }
+            // of a destroyed pool
+            it = it->second.expired() ? local.magazines.erase(it) : it + 1;
+        }
+
+        auto magazine     = std::make_shared<Magazine>();
+        magazine->orphans = m_orphans;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_magazines.push_back(magazine);
+        }
+        local.magazines.emplace_back(m_id, magazine);
+        return *magazine;
+    }
 
     bool put(Ptr& po) // returns true, if object was put into the freePool vector
     {
-        std::lock_guard<std::mutex> lock(m_mutex);
-        if (m_maxSpare == 0 || m_freePool.size() < m_maxSpare) {
-            po.setPool(nullptr);
-            m_freePool.emplace_back(std::move(po.m_object));
+        Magazine& local = magazine();
+        local.returned++;
+
+        // the clock is only read for the eviction
+        Clock::time_point now = evicting() ? Clock::now() : Clock::time_point();
+        if (expired(po.m_created, now)) {
+            m_evicted++;
+            return false;
+        }
+        // the capacity was lowered meanwhile
+        unsigned maxLive = m_maxLive;
+        if (maxLive != 0 && m_live > maxLive) {
+            return false;
+        }
+
+        std::unique_lock<std::mutex> lock(local.mutex);
+        if (local.credits == 0) {
+            lock.unlock();
+            std::lock_guard<std::mutex> shared(m_mutex);
+            unsigned                    credits = reserveSpare(local);
+            if (credits == 0) {
+                return false;
+            }
+            lock.lock();
+            local.credits += credits;
+        }
+        local.credits--;
+        po.setPool(nullptr);
+        local.objects.push_back({std::move(po.m_object), po.m_created, now});
+        local.count = unsigned(local.objects.size());
+        if (local.objects.size() < 2 * MagazineBatch) {
+            lock.unlock();
+            // a waiting get() takes it from the magazine
+            notifyWaiters();
             return true;
         }
 
-        return false;
+        // full: the oldest objects go to the shared free list, with their slots
+        Container batch(std::make_move_iterator(local.objects.begin()),
+            std::make_move_iterator(local.objects.begin() + MagazineBatch));
+        local.objects.erase(local.objects.begin(), local.objects.begin() + MagazineBatch);
+        local.count = unsigned(local.objects.size());
+        lock.unlock();
+
+        std::lock_guard<std::mutex> shared(m_mutex);
+        for (auto& object : batch) {
+            m_freePool.emplace_back(std::move(object));
+        }
+        m_capacityCond.notify_one();
+        return true;
+    }
+
+    // reserves spare slots for the magazine of put(), 0 when there is no room; a batch while there is
+    // room for all the magazines, one at a time past that not to strand slots in idle threads; m_mutex
+    // must be locked, not the mutex of local
+    unsigned reserveSpare(Magazine& local)
+    {
+        unsigned maxSpare = m_maxSpare;
+        if (maxSpare == 0) {
+            m_reserved += MagazineBatch;
+            return MagazineBatch;
+        }
+
+        if (m_reserved >= maxSpare) {
+            // the slots of the exited threads, and the ones not used by the others
+            collectOrphans();
+            for (auto& other : m_magazines) {
+                if (m_reserved < maxSpare) {
+                    break;
+                }
+                if (other.get() == &local) {
+                    continue;
+                }
+                std::unique_lock<std::mutex> lock(other->mutex, std::try_to_lock);
+                if (lock) {
+                    m_reserved -= other->credits;
+                    other->credits = 0;
+                }
+            }
+            if (m_reserved >= maxSpare) {
+                return 0;
+            }
+        }
+
+        unsigned available = maxSpare - m_reserved;
+        unsigned credits   = available >= MagazineBatch * m_magazines.size() ? unsigned(MagazineBatch) : 1;
+        m_reserved += credits;
+        return credits;
+    }
+
+    // takes a spare object, its slot becomes a credit of local: from a batch of the shared free list, else
+    // from another magazine; m_mutex must be locked, not the mutex of local
+    Spare takeShared(Magazine& local)
+    {
+        collectOrphans();
+
+        if (!m_freePool.empty()) {
+            Spare spare = std::move(m_freePool.back());
+            m_freePool.pop_back();
+
+            std::lock_guard<std::mutex> lock(local.mutex);
+            for (size_t i = 1; i < MagazineBatch && !m_freePool.empty(); i++) {
+                local.objects.emplace_back(std::move(m_freePool.back()));
+                m_freePool.pop_back();
+            }
+            local.count = unsigned(local.objects.size());
+            local.credits++;
+            return spare;
+        }
+
+        // rather than creating a new object while others are idle, only the magazines holding some are
+        // locked
+        for (auto& other : m_magazines) {
+            if (other.get() == &local || other->count == 0) {
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(other->mutex, std::try_to_lock);
+            if (lock && !other->objects.empty()) {
+                Spare spare = std::move(other->objects.back());
+                other->objects.pop_back();
+                other->count = unsigned(other->objects.size());
+                lock.unlock();
+
+                std::lock_guard<std::mutex> mine(local.mutex);
+                local.credits++;
+                return spare;
+            }
+        }
+        return Spare();
+    }
+
+    // moves the spare objects and the counters of the magazines of the exited threads to the pool, m_mutex
+    // must be locked
+    void collectOrphans()
+    {
+        if (*m_orphans == 0) {
+            return;
+        }
+        for (auto it = m_magazines.begin(); it != m_magazines.end();) {
+            Magazine&                    magazine = **it;
+            std::unique_lock<std::mutex> lock(magazine.mutex);
+            if (!magazine.orphan) {
+                ++it;
+                continue;
+            }
+            for (auto& object : magazine.objects) {
+                m_freePool.emplace_back(std::move(object));
+            }
+            m_reserved -= magazine.credits;
+            m_stats.gets += magazine.gets;
+            m_stats.hits += magazine.hits;
+            m_returned += magazine.returned;
+            lock.unlock();
+            it = m_magazines.erase(it);
+            (*m_orphans)--;
+        }
+    }
+
+    // moves all the spare objects to the shared free list and releases the credits, m_mutex must be locked
+    void collect()
+    {
+        collectOrphans();
+        for (auto& it : m_magazines) {
+            std::lock_guard<std::mutex> lock(it->mutex);
+            for (auto& object : it->objects) {
+                m_freePool.emplace_back(std::move(object));
+            }
+            it->objects.clear();
+            it->count = 0;
+            m_reserved -= it->credits;
+            it->credits = 0;
+        }
+    }
+
+    // spare objects, m_mutex must be locked
+    unsigned spare() const
+    {
+        unsigned spare = unsigned(m_freePool.size());
+        for (auto& it : m_magazines) {
+            spare += it->count;
+        }
+        return spare;
+    }
+
+    // objects handed out and not put back yet, m_mutex must be locked
+    unsigned inUse() const
+    {
+        // the returns first: an object is got before it is put back
+        uint64_t returned = m_returned;
+        for (auto& it : m_magazines) {
+            returned += it->returned;
+        }
+        uint64_t gets = m_stats.gets;
+        for (auto& it : m_magazines) {
+            gets += it->gets;
+        }
+        return unsigned(gets - returned);
+    }
+
+    // removes spare objects down to keep and returns them for destroy(), m_mutex must be locked
+    Container trim(unsigned keep)
+    {
+        collect();
+        Container victims;
+        if (m_freePool.size() > keep) {
+            m_reserved -= unsigned(m_freePool.size() - keep);
+            victims.assign(std::make_move_iterator(m_freePool.begin() + keep),
+                std::make_move_iterator(m_freePool.end()));
+            m_freePool.erase(m_freePool.begin() + keep, m_freePool.end());
+        }
+        return victims;
+    }
+
+    // destroys the spare objects removed from the pool, m_mutex must not be locked: destroying may be
+    // slow (disconnection from the broker) and get() would wait for it
+    void destroy(Container& victims)
+    {
+        if (victims.empty()) {
+            return;
+        }
+        unsigned count = unsigned(victims.size());
+        victims.clear();
+        m_live -= count;
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_capacityCond.notify_all();
+    }
+
+    bool valid(ObjectType& object)
+    {
+        return !m_validator || m_validator(object);
+    }
+
+    bool evicting() const
+    {
+        return m_maxIdle.load().count() > 0 || m_maxAge.load().count() > 0;
+    }
+
+    bool expired(Clock::time_point created, Clock::time_point now) const
+    {
+        std::chrono::milliseconds maxAge = m_maxAge;
+        return maxAge.count() > 0 && now - created > maxAge;
+    }
+
+    // a spare object can be handed out: neither too old nor dead
+    bool usable(Spare& spare)
+    {
+        if (m_maxAge.load().count() > 0 && expired(spare.created, Clock::now())) {
+            m_evicted++;
+            return false;
+        }
+        return valid(*spare.object);
+    }
+
+    std::unique_ptr<ObjectType> create()
+    {
+        Clock::time_point           start  = Clock::now();
+        std::unique_ptr<ObjectType> object = make();
+        m_created++;
+        m_createTime +=
+            uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count());
+        return object;
+    }
+
+    std::unique_ptr<ObjectType> make()
+    {
+        if (m_factory) {
+            return m_factory();
+        }
+        if constexpr (std::is_default_constructible<ObjectType>::value) {
+            return std::make_unique<ObjectType>();
+        } else {
+            throw std::logic_error("Pool: no factory for an object not default constructible");
+        }
+    }
+
+    // counts a new object, false when the capacity is reached
+    bool reserveLive()
+    {
+        unsigned live = m_live.load();
+        do {
+            unsigned maxLive = m_maxLive;
+            if (maxLive != 0 && live >= maxLive) {
+                return false;
+            }
+        } while (!m_live.compare_exchange_weak(live, live + 1));
+        return true;
+    }
+
+    // creates an object counted by reserveLive()
+    std::unique_ptr<ObjectType> createReserved()
+    {
+        try {
+            return create();
+        } catch (...) {
+            released();
+            throw;
+        }
+    }
+
+    // an object was destroyed (or detached by Ptr::release())
+    void released()
+    {
+        m_live--;
+        notifyWaiters();
+    }
+
+    void notifyWaiters()
+    {
+        if (m_waiters > 0) {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_capacityCond.notify_one();
+        }
+    }
+
+    // fewer spare objects than prewarm() asked for, and room for more; m_mutex must be locked
+    bool shortOfSpare() const
+    {
+        return m_minSpare > 0 && spare() < m_minSpare && (m_maxSpare == 0 || m_reserved < m_maxSpare) &&
+               (m_maxLive == 0 || m_live < m_maxLive);
+    }
+
+    // removes the spare objects older than maxAge, and the ones idle for longer than maxIdle but the
+    // minSpare last used, into victims; m_mutex must be locked
+    void evict(Container& victims)
+    {
+        std::chrono::milliseconds maxIdle = m_maxIdle;
+        std::chrono::milliseconds maxAge  = m_maxAge;
+        if (maxIdle.count() == 0 && maxAge.count() == 0) {
+            return;
+        }
+
+        collect();
+        // only the minSpare last used have to be told apart from the others, first
+        size_t protect = maxIdle.count() > 0 ? std::min<size_t>(m_minSpare, m_freePool.size()) : 0;
+        if (protect > 0 && protect < m_freePool.size()) {
+            std::nth_element(m_freePool.begin(), m_freePool.begin() + long(protect) - 1, m_freePool.end(),
+                [](const Spare& a, const Spare& b) {
+                    return a.lastUse > b.lastUse;
+                });
+        }
+
+        Clock::time_point now  = Clock::now();
+        size_t            kept = 0;
+        for (size_t i = 0; i < m_freePool.size(); i++) {
+            Spare& spare = m_freePool[i];
+            bool   idle  = maxIdle.count() > 0 && i >= protect && now - spare.lastUse > maxIdle;
+            if (idle || expired(spare.created, now)) {
+                victims.emplace_back(std::move(spare));
+                m_reserved--;
+                m_evicted++;
+            } else if (kept++ != i) {
+                m_freePool[kept - 1] = std::move(spare);
+            }
+        }
+        m_freePool.erase(m_freePool.begin() + long(kept), m_freePool.end());
+    }
+
+    // how often maintain() looks at the spare objects (0: only when some are taken)
+    std::chrono::milliseconds checkInterval() const
+    {
+        std::chrono::milliseconds interval = m_refreshInterval;
+        // evicted at most half their limit late
+        for (std::chrono::milliseconds limit : {m_maxIdle.load() / 2, m_maxAge.load() / 2}) {
+            limit = std::max(limit, std::chrono::milliseconds(limit.count() > 0 ? 1 : 0));
+            if (limit.count() > 0 && (interval.count() == 0 || limit < interval)) {
+                interval = limit;
+            }
+        }
+        return interval;
+    }
+
+    void maintain()
+    {
+        const std::chrono::milliseconds interval = checkInterval();
+        // retry delay when the new objects are invalid (e.g. broker unreachable)
+        const std::chrono::milliseconds retry =
+            m_refreshInterval.count() > 0 ? m_refreshInterval : std::chrono::milliseconds(1000);
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (!m_stop) {
+            Container victims;
+            evict(victims);
+
+            // the spare objects died meanwhile (broker restart...) are replaced
+            if (m_refreshInterval.count() > 0 && m_validator) {
+                collect();
+                for (auto it = m_freePool.begin(); it != m_freePool.end();) {
+                    if (valid(*it->object)) {
+                        ++it;
+                    } else {
+                        victims.emplace_back(std::move(*it));
+                        it = m_freePool.erase(it);
+                        m_reserved--;
+                    }
+                }
+            }
+
+            if (!victims.empty()) {
+                lock.unlock();
+                destroy(victims);
+                lock.lock();
+            }
+
+            // objects are created out of the lock, not to block get()
+            bool failed = false;
+            // not beyond the capacity, the in use objects come back
+            while (!m_stop && shortOfSpare() && reserveLive()) {
+                lock.unlock();
+                std::unique_ptr<ObjectType> object;
+                try {
+                    object = create();
+                } catch (...) {
+                }
+                bool ok = object && valid(*object);
+                if (!ok) {
+                    object.reset();
+                }
+                lock.lock();
+                if (ok && (m_maxSpare == 0 || m_reserved < m_maxSpare)) {
+                    Clock::time_point now = Clock::now();
+                    m_freePool.push_back({std::move(object), now, now});
+                    m_reserved++;
+                    m_capacityCond.notify_one();
+                } else {
+                    m_live--;
+                    m_capacityCond.notify_one();
+                }
+                if (!ok) {
+                    failed = true;
+                    break;
+                }
+                if (object) {
+                    // no room for it meanwhile
+                    lock.unlock();
+                    object.reset();
+                    lock.lock();
+                }
+            }
+
+            if (failed) {
+                m_maintenanceCond.wait_for(lock, retry, [this]() {
+                    return m_stop;
+                });
+            } else if (interval.count() > 0) {
+                m_maintenanceCond.wait_for(lock, interval, [this]() {
+                    return m_stop || shortOfSpare();
+                });
+            } else {
+                m_maintenanceCond.wait(lock, [this]() {
+                    return m_stop || shortOfSpare();
+                });
+            }
+        }
+    }
+
+    void stopMaintenance()
+    {
+        if (!m_maintenance.joinable()) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_maintenanceCond.notify_all();
+        m_maintenance.join();
+        m_stop = false;
+    }
+
+    // runs maintain() when there is something to do
+    void startMaintenance()
+    {
+        if (m_minSpare > 0 || m_refreshInterval.count() > 0 || m_maxIdle.load().count() > 0 ||
+            m_maxAge.load().count() > 0) {
+            m_maintenance = std::thread([this]() {
+                maintain();
+            });
+        }
+    }
+
+    // hands out an object, the peak use is only sampled out of the magazine of the calling thread
+    Ptr lend(Magazine& local, std::unique_ptr<ObjectType>&& object, Clock::time_point created, bool sample)
+    {
+        Ptr ptr(std::move(object), this);
+        ptr.m_created = created;
+
+        local.gets++;
+        if (sample) {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stats.peakInUse = std::max(m_stats.peakInUse, inUse());
+        }
+        return ptr;
+    }
+
+    Ptr acquire(const std::chrono::milliseconds* timeout)
+    {
+        // the calling thread's magazine first, without contention
+        Magazine& local = magazine();
+        while (true) {
+            Spare    spare;
+            unsigned excess = 0;
+            {
+                std::lock_guard<std::mutex> lock(local.mutex);
+                if (!local.objects.empty()) {
+                    spare = std::move(local.objects.back());
+                    local.objects.pop_back();
+                    local.count = unsigned(local.objects.size());
+                    // its slot is kept for its return, but a few
+                    if (++local.credits > 2 * MagazineBatch) {
+                        excess        = local.credits - unsigned(MagazineBatch);
+                        local.credits = unsigned(MagazineBatch);
+                    }
+                }
+            }
+            bool shared = !spare.object;
+            if (shared) {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                spare = takeShared(local);
+                if (shortOfSpare()) {
+                    m_maintenanceCond.notify_one();
+                }
+            } else if (excess > 0) {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_reserved -= excess;
+            }
+            if (!spare.object) {
+                break;
+            }
+            // the dead and too old spare objects are discarded
+            if (usable(spare)) {
+                local.hits++;
+                return lend(local, std::move(spare.object), spare.created, shared);
+            }
+            spare.object.reset();
+            released();
+        }
+
+        // created out of the lock, creating may be slow (broker handshake)
+        if (reserveLive()) {
+            std::unique_ptr<ObjectType> object = createReserved();
+            return lend(local, std::move(object), Clock::now(), true);
+        }
+        return waitLive(local, timeout);
+    }
+
+    // the capacity is reached: waits for an object put back or destroyed
+    Ptr waitLive(Magazine& local, const std::chrono::milliseconds* timeout)
+    {
+        Clock::time_point start = Clock::now();
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        auto deadline = start + (timeout ? *timeout : m_acquireTimeout);
+        // before looking, so that put() and released() notify
+        m_waiters++;
+        m_stats.waits++;
+
+        Spare     spare;
+        Container victims; // destroyed once unlocked
+        bool      create   = false;
+        bool      timedOut = false;
+        while (true) {
+            // the magazines too: the object may have been put back in any of them
+            collect();
+            spare = takeShared(local);
+            if (spare.object) {
+                if (shortOfSpare()) {
+                    m_maintenanceCond.notify_one();
+                }
+                if (usable(spare)) {
+                    break;
+                }
+                victims.emplace_back(std::move(spare));
+                spare = Spare();
+                // counted as destroyed, not to wait for it
+                m_live--;
+                continue;
+            }
+            if (reserveLive()) {
+                create = true;
+                break;
+            }
+            if (timedOut) {
+                break;
+            }
+            // one last look once timed out
+            timedOut = m_capacityCond.wait_until(lock, deadline) == std::cv_status::timeout;
+        }
+
+        m_waiters--;
+        m_stats.waitTime +=
+            uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count());
+        bool failed = !spare.object && !create;
+        if (failed) {
+            m_stats.timeouts++;
+        }
+        lock.unlock();
+        victims.clear();
+
+        if (failed) {
+            return Ptr(nullptr, nullptr);
+        }
+
+        if (spare.object) {
+            local.hits++;
+            return lend(local, std::move(spare.object), spare.created, true);
+        }
+        std::unique_ptr<ObjectType> object = createReserved();
+        return lend(local, std::move(object), Clock::now(), true);
     }
 
 public:
-    explicit Pool(unsigned maxSpare = 0)
+    // the objects are default constructed when factory is nullptr
+    explicit Pool(unsigned maxSpare = 0, Validator validator = nullptr, Factory factory = nullptr)
         : m_maxSpare(maxSpare)
+        , m_validator(std::move(validator))
+        , m_factory(std::move(factory))
     {
     }
 
     ~Pool()
     {
-        m_freePool.clear();
+        stopMaintenance();
+        Container victims;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            victims = trim(0);
+            m_magazines.clear();
+        }
+        destroy(victims);
     }
 
-    Ptr get()
+    // keeps at least minSpare spare objects, created by a background thread so that get() doesn't
+    // pay for their creation; every refreshInterval (if not 0) the spare objects are also validated
+    // and the dead ones replaced
+    void prewarm(unsigned minSpare, std::chrono::milliseconds refreshInterval = std::chrono::milliseconds(0))
     {
-        std::lock_guard<std::mutex> lock(m_mutex);
+        stopMaintenance();
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_minSpare        = minSpare;
+            m_refreshInterval = refreshInterval;
+        }
+        startMaintenance();
+    }
 
-        if (m_freePool.empty()) {
-            return Ptr(std::make_unique<ObjectType>(), this);
-        } else {
-            auto getter = [this]() {
-                auto it = std::move(m_freePool.back());
-                m_freePool.pop_back();
-                return it;
-            };
-            return Ptr(std::move(getter()), this);
+    // the spare objects unused for longer than maxIdle (but the minSpare of prewarm()) or created
+    // longer than maxAge ago are destroyed by the background thread, 0 for no limit (the default);
+    // the objects older than maxAge are also destroyed rather than put back
+    void setEviction(std::chrono::milliseconds maxIdle, std::chrono::milliseconds maxAge = std::chrono::milliseconds(0))
+    {
+        stopMaintenance();
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            // put back while not evicting: idle from now on
+            if (!evicting()) {
+                collect();
+                for (auto& spare : m_freePool) {
+                    spare.lastUse = Clock::now();
+                }
+            }
+            m_maxIdle = maxIdle;
+            m_maxAge  = maxAge;
         }
+        startMaintenance();
     }
 
-    void drop(unsigned keep = 0)
+    // bounds the live objects, spare or in use, to maxLive (0: no bound, the default): when reached,
+    // get() waits up to timeout for one to be released and then returns an empty Ptr
+    void setCapacity(unsigned maxLive, std::chrono::milliseconds timeout = std::chrono::milliseconds(1000))
+    {
+        Container victims;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_maxLive        = maxLive;
+            m_acquireTimeout = timeout;
+            // the excess objects are destroyed as they are released
+            unsigned live = m_live;
+            if (maxLive != 0 && live > maxLive) {
+                unsigned excess = live - maxLive;
+                unsigned spare  = this->spare();
+                victims         = trim(spare > excess ? spare - excess : 0);
+            }
+            m_capacityCond.notify_all();
+        }
+        destroy(victims);
+    }
+
+    unsigned getCapacity() const
+    {
+        return m_maxLive;
+    }
+
+    Stats stats() const
     {
         std::lock_guard<std::mutex> lock(m_mutex);
-        if (m_freePool.size() > keep) {
-            m_freePool.resize(keep);
+        Stats stats      = m_stats;
+        stats.live       = m_live;
+        stats.inUse      = inUse();
+        stats.created    = m_created;
+        stats.createTime = m_createTime;
+        stats.evicted    = m_evicted;
+        // gathered from the magazines, so that get() and put() don't share counters
+        for (auto& it : m_magazines) {
+            stats.gets += it->gets;
+            stats.hits += it->hits;
         }
+        return stats;
     }
 
-    unsigned getMaximumSize() const
+    // may return an empty Ptr when the capacity is reached, see setCapacity()
+    Ptr get()
+    {
+        return acquire(nullptr);
+    }
+
+    // same, waiting up to timeout rather than the one of setCapacity()
+    Ptr get(std::chrono::milliseconds timeout)
     {
+        return acquire(&timeout);
+    }
+
+    // the spare objects kept by prewarm() are created again
+    void drop(unsigned keep = 0)
+    {
+        Container victims;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            victims = trim(keep);
+        }
+        destroy(victims);
         std::lock_guard<std::mutex> lock(m_mutex);
+        m_maintenanceCond.notify_one();
+    }
+
+    unsigned getMaximumSize() const
+    {
         return m_maxSpare;
     }
 
     unsigned size() const
     {
         std::lock_guard<std::mutex> lock(m_mutex);
-        return m_freePool.size();
+        return spare();
     }
 
     unsigned getCurrentSize() const
     {
-        std::lock_guard<std::mutex> lock(m_mutex);
-        return m_freePool.size();
+        return size();
     }
 
     void setMaximumSize(unsigned s)
+    {
+        Container victims;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_maxSpare = s;
+            if (m_reserved > s)
+                victims = trim(s);
+        }
+        destroy(victims);
+    }
+};
+
+// pools of objects by key (endpoint, identity prefix...), created on first use with the same settings
+template <typename ObjectType, typename Key = std::string>
+class KeyedPool
+{
+public:
+    using SubPool   = Pool<ObjectType>;
+    using Ptr       = typename SubPool::Ptr;
+    using Validator = typename SubPool::Validator;
+    using Factory   = std::function<std::unique_ptr<ObjectType>(const Key&)>;
+
+    // the objects are constructed from the key when factory is nullptr
+    explicit KeyedPool(unsigned maxSpare = 0, Validator validator = nullptr, Factory factory = nullptr)
+        : m_maxSpare(maxSpare)
+        , m_validator(std::move(validator))
+        , m_factory(std::move(factory))
+    {
+    }
+
+    KeyedPool(const KeyedPool&) = delete;
+    KeyedPool& operator=(const KeyedPool&) = delete;
+
+    Ptr get(const Key& key)
+    {
+        return pool(key).get();
+    }
+
+    // the pool of key, to tune it (prewarm(), setCapacity()...)
+    SubPool& pool(const Key& key)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        auto it = m_pools.find(key);
+        if (it == m_pools.end()) {
+            // the objects keep a pointer to their pool: it never moves
+            it = m_pools.emplace(key, std::make_unique<SubPool>(m_maxSpare, m_validator, factoryOf(key))).first;
+        }
+        return *it->second;
+    }
+
+    // number of keys used
+    size_t size() const
     {
         std::lock_guard<std::mutex> lock(m_mutex);
-        m_maxSpare = s;
-        if (m_freePool.size() > s)
-            m_freePool.resize(s);
+        return m_pools.size();
     }
+
+    void drop(unsigned keep = 0)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (auto& it : m_pools) {
+            it.second->drop(keep);
+        }
+    }
+
+private:
+    typename SubPool::Factory factoryOf(const Key& key) const
+    {
+        if (m_factory) {
+            return [factory = m_factory, key]() {
+                return factory(key);
+            };
+        }
+        if constexpr (std::is_constructible<ObjectType, const Key&>::value) {
+            return [key]() {
+                return std::make_unique<ObjectType>(key);
+            };
+        } else {
+            throw std::logic_error("KeyedPool: no factory for an object not constructible from its key");
+        }
+    }
+
+    const unsigned  m_maxSpare;
+    const Validator m_validator;
+    const Factory   m_factory;
+
+    mutable std::mutex                      m_mutex;
+    std::map<Key, std::unique_ptr<SubPool>> m_pools;
 };
 
 } // namespace details
 
 using MlmClientPool = details::Pool<MlmClient>;
 extern MlmClientPool mlm_pool;
+
+// clients by endpoint, for the processes talking to several brokers
+using MlmKeyedClientPool = details::KeyedPool<MlmClient>;
@@ -0,0 +1,83 @@
+/*  =========================================================================
+    fty_common_mlm_shared_payload - Large payloads handed over in shared memory
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <czmq.h>
+
+namespace mlm {
+
+/**
+ * \brief Moves the large payloads of malamute messages to POSIX shared memory, for the peers of the same host.
+ *
+ * share() writes the frames of a message, after the first skip ones (correlation id...), to a new segment
+ * and replaces them by a descriptor of three frames: "$SHM", the name of the segment and its size. Only the
+ * descriptor goes through the broker, fetch() puts the frames back.
+ *
+ * The segments are named /fty-mlm-<pid>-<n>, readable by the user of the process only. The reader of a
+ * mailbox message unlinks its segment once read. The segments of the stream messages are not reference
+ * counted, the publisher doesn't know how many subscribers malamute delivers them to: they are unlinked by
+ * the process which created them once their time to live expired, like the requests never fetched, at the
+ * latest when it exits. A subscriber fetching a notification after the time to live loses it. The segments
+ * of the processes which died without unlinking them are removed by collectOrphans(). The memory itself
+ * is released by the kernel once the last mapping is gone. The peers must all understand the descriptor
+ * and share the pid namespace.
+ */
+class MlmSharedPayload
+{
+public:
+    static constexpr const char* MARKER = "$SHM";
+
+    /**
+     * \brief Move the frames after skip to shared memory if they weigh threshold bytes or more.
+     * \param ttl Time after which the segment is unlinked if the reader didn't
+     * \return true if moved, false if too small or on failure (the message is left as it was).
+     */
+    static bool share(zmsg_t* message, size_t skip, size_t threshold, std::chrono::milliseconds ttl);
+
+    /**
+     * \brief true if the frames after skip are a descriptor: the marker, a segment name and a size.
+     */
+    static bool isShared(zmsg_t* message, size_t skip);
+
+    /**
+     * \brief Replace the descriptor after skip by the frames it describes, nothing if there is none.
+     * \param unlink Unlink the segment once read and found valid, for its only reader
+     * \return false if the segment can't be read (expired, invalid...), the descriptor is then left.
+     */
+    static bool fetch(zmsg_t* message, size_t skip, bool unlink);
+
+    /**
+     * \brief Unlink the segments created by the process whose time to live expired (all with all).
+     */
+    static void collect(bool all = false);
+
+    /**
+     * \brief Unlink the segments of the user whose creator isn't running anymore (crashed...).
+     *
+     * Done on the first share() of the process.
+     */
+    static void collectOrphans();
+};
+
+} // namespace mlm
@@ -22,11 +22,16 @@
 #pragma once
 
 #include "fty_common_client.h"
+#include <chrono>
 #include <condition_variable>
+#include <cstdint>
+#include <czmq.h>
+#include <functional>
+#include <map>
 #include <mutex>
 #include <string>
 #include <thread>
-#include <map>
+#include <vector>
 
 namespace mlm {
 using Callback = std::function<void(const std::vector<std::string>&)>;
@@ -39,6 +44,12 @@ public:
     explicit MlmStreamClient(const std::string& clientId, const std::string& stream, uint32_t timeout = 1000,
         const std::string& endPoint = "ipc://@/malamute");
 
+    // Spread the streams over several brokers, see MlmConnectionManager::brokers(). A notification goes
+    // to the next broker of its stream when one can't be connected to or can't publish it, the
+    // subscribers listen on all the brokers they can connect to, and try the others again every
+    // MlmConnectionManager::UNREACHABLE_PERIOD.
+    explicit MlmStreamClient(const std::string& clientId, const std::string& stream, uint32_t timeout,
+        const std::vector<std::string>& endPoints);
 
     ~MlmStreamClient() override;
 
@@ -49,28 +60,42 @@ public:
     uint32_t subscribe(Callback callback) override;
     void     unsubscribe(uint32_t subId) override;
 
-private:
-    // Common attributs
-    std::string m_clientId;
-    std::string m_stream;
-    uint32_t    m_timeout;
-    std::string m_endpoint;
-
-    // Specific to StreamSubscriber
-    std::thread m_listenerThread;
+    // Hand over the notifications whose payload weighs threshold bytes or more in shared memory,
+    // see MlmSharedPayload (0, the default, disables it). Large notifications are always accepted.
+    // The segments are unlinked after ttl: the subscribers must read them before.
+    // Not thread safe: call it before publishing.
+    void setSharedMemory(size_t threshold, std::chrono::milliseconds ttl = std::chrono::seconds(60));
 
-    std::mutex              m_listenerCallbackMutex;
-    std::condition_variable m_listenerStarted;
-    std::exception_ptr      m_exPtr         = nullptr;
-    bool                    m_stopRequested = false;
+private:
+    void deliver(const std::string& subject, zmsg_t* message);
+    // subscription to the stream on endpoint, throws if it can't connect
+    uint64_t listen(const std::string& endpoint);
+    // thread listening on the brokers missing from the subscription, in turn
+    void retry();
 
+    // Common attributs
+    std::string              m_clientId;
+    std::string              m_stream;
+    uint32_t                 m_timeout;
+    std::vector<std::string> m_endpoints;
+
+    // Specific to StreamPublisher
+    size_t                    m_sharedThreshold = 0;
+    std::chrono::milliseconds m_sharedTtl{60000};
+
+    // Specific to StreamSubscriber: the callbacks are called by the thread of the session
+    // <clientId>.SUB of MlmConnectionManager, shared with the other clients, one per broker
+    std::mutex               m_subscriptionMutex; // subscribe() and unsubscribe()
+    std::vector<uint64_t>    m_subscriptions;
+    std::vector<std::string> m_missing;        // brokers not listened to yet
+    uint64_t                 m_generation = 0; // incremented when the subscriptions are removed
+    bool                     m_stopping   = false;
+    std::condition_variable  m_retryCond;
+    std::thread              m_retryThread;
+
+    std::mutex                   m_listenerCallbackMutex;
     uint32_t                     m_counter = 0;
     std::map<uint32_t, Callback> m_callbacks;
-
-
-    // Private methods
-    void publishOnBus(const std::string& type, const std::vector<std::string>& payload);
-    void listener(); // function use by the thread to listen on the bus
 };
 
 } // namespace mlm
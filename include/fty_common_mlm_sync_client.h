@@ -22,6 +22,11 @@
 #pragma once
 
 #include "fty_common_client.h"
+#include <atomic>
+#include <chrono>
+#include <czmq.h>
+#include <map>
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -35,15 +40,91 @@ public:
     explicit MlmSyncClient(const std::string& clientId, const std::string& destination, uint32_t timeout = 1000,
         const std::string& endPoint = "ipc://@/malamute");
 
+    // Spread the destinations over several brokers, see MlmConnectionManager::brokers(). A request
+    // goes to the next broker of its destination when one can't be connected to or can't send it.
+    // The servers of a destination must be reachable through all its brokers.
+    explicit MlmSyncClient(const std::string& clientId, const std::string& destination, uint32_t timeout,
+        const std::vector<std::string>& endPoints);
+
+    ~MlmSyncClient() override;
+
     // methods
     std::vector<std::string> syncRequestWithReply(const std::vector<std::string>& payload) override;
 
+    // Spread the requests over the shards of a MlmBasicMailboxServerGroup named destination.
+    // Requests with the same payload frame keyFrame always reach the same shard (consistent hash),
+    // keyFrame -1 spreads them round-robin. 0 or 1 shard disables the routing.
+    // Not thread safe: call it before sending requests.
+    void setShards(size_t shards, int keyFrame = -1);
+
+    // Hand over the requests whose payload weighs threshold bytes or more in shared memory,
+    // see MlmSharedPayload (0, the default, disables it). Large replies are always accepted.
+    // The segments of the requests never read are unlinked after ttl.
+    // Not thread safe: call it before sending requests.
+    void setSharedMemory(size_t threshold, std::chrono::milliseconds ttl = std::chrono::seconds(60));
+
+    // Send the requests straight to the server, over the DEALER/ROUTER channel it advertises (see
+    // MlmBasicMailboxServer::setDirectEndpoint()). The channel is asked for through the broker before
+    // the first request to each destination, and again every retry if the server has none.
+    // A request goes through the mailbox when the channel can't take it within the timeout. Without
+    // reply within the reply timeout (60 s if none is set), the request fails and the channel is negotiated
+    // again: no broker tells a dead server there.
+    // Not thread safe: call it before sending requests.
+    void setDirect(bool direct, std::chrono::milliseconds retry = std::chrono::seconds(60));
+
+    // Time to wait for a reply, 0 (the default) to wait for the mailbox replies until interrupted.
+    // Not thread safe: call it before sending requests.
+    void setReplyTimeout(std::chrono::milliseconds timeout);
+
+    // The requests may be handled more than once: without reply within the reply timeout, a request is
+    // sent again through the next broker of its destination, the first one may have stalled. Each broker
+    // is then given the reply timeout. Off by default: a request sent isn't sent again.
+    // Not thread safe: call it before sending requests.
+    void setIdempotent(bool idempotent);
+
 private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Channel
+    {
+        std::string           endpoint; // empty until negotiated
+        Clock::time_point     retry;    // next negotiation
+        std::vector<zsock_t*> idle;     // connected sockets, one per request in flight
+    };
+
+    std::string destination(const std::vector<std::string>& payload);
+    // requestReply() on the brokers of address, in turn, each given timeout (Clock::duration::max() for none)
+    // to reply; a request without reply is sent again to the next one if idempotent
+    zmsg_t*     brokerRequest(const std::string& address, const std::string& subject, const std::string& correlationId,
+        zmsg_t** request, Clock::duration timeout, bool idempotent);
+    std::string negotiate(const std::string& destination);
+    // socket connected to the channel of destination, nullptr if none
+    zsock_t* takeChannel(const std::string& destination);
+    // gives back a socket which got its reply, the others are closed
+    void    releaseChannel(const std::string& destination, zsock_t* socket, bool reusable);
+    // reply, nullptr if not sent (request left), expired or interrupted
+    zmsg_t* directRequest(zsock_t* socket, const std::string& correlationId, zmsg_t** request);
+
     // attributs
     std::string m_clientId;
     std::string m_destination;
-    uint32_t    m_timeout;
-    std::string m_endpoint;
+    uint32_t                 m_timeout;
+    std::vector<std::string> m_endpoints;
+
+    size_t              m_shards   = 0;
+    int                 m_keyFrame = -1;
+    std::atomic<size_t> m_nextShard{0};
+
+    size_t                    m_sharedThreshold = 0;
+    std::chrono::milliseconds m_sharedTtl{60000};
+
+    std::chrono::milliseconds m_replyTimeout{0};
+    bool                      m_idempotent = false;
+
+    bool                           m_direct = false;
+    std::chrono::milliseconds      m_directRetry{60000};
+    std::mutex                     m_channelsMutex;
+    std::map<std::string, Channel> m_channels;
 };
 
 } // namespace mlm
@@ -0,0 +1,120 @@
+/*  =========================================================================
+    fty_common_mlm_timer_wheel - Hierarchical timer wheel for agent timers
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <unordered_map>
+
+namespace mlm {
+
+/**
+ * \brief Hierarchical timer wheel with a resolution of 1 ms.
+ *
+ * Timers are hashed in 8 levels of 64 slots, the slot width of a level being 64 times the one of
+ * the level below. Adding and cancelling a timer is O(1), and a timer is moved down at most once
+ * per level before it expires, so thousands of timers are cheap. The wheel doesn't read the clock
+ * itself: all the methods take the current time in ms (e.g. zclock_mono()).
+ */
+class TimerWheel
+{
+public:
+    using TimerId = uint64_t;
+
+    /**
+     * \brief Timer callback.
+     * \return false to stop the agent, true otherwise.
+     */
+    using Callback = std::function<bool()>;
+
+    explicit TimerWheel(int64_t now);
+
+    /**
+     * \brief Add a periodic timer firing every interval ms, the first time interval ms from now.
+     * \return Identifier of the timer
+     */
+    TimerId add(int64_t now, int64_t interval, Callback callback);
+
+    /**
+     * \brief Add a timer firing once, delay ms from now.
+     * \return Identifier of the timer
+     */
+    TimerId addOneShot(int64_t now, int64_t delay, Callback callback);
+
+    /**
+     * \brief Cancel a timer. Can be called from a timer callback.
+     * \return false if the timer doesn't exist (anymore).
+     */
+    bool cancel(TimerId id);
+
+    /**
+     * \brief Number of active timers.
+     */
+    size_t size() const
+    {
+        return m_timers.size();
+    }
+
+    /**
+     * \brief Time until the wheel needs to advance, to be used as poller timeout.
+     * \return Timeout in ms, -1 if there is no timer.
+     */
+    int64_t timeout(int64_t now) const;
+
+    /**
+     * \brief Fire the timers expired at now.
+     * \return false if a callback asked to stop the agent, true otherwise.
+     */
+    bool advance(int64_t now);
+
+private:
+    static constexpr unsigned LevelBits = 6;
+    static constexpr unsigned Slots     = 1 << LevelBits;
+    static constexpr unsigned Levels    = 8;
+    static constexpr unsigned Detached  = Levels;
+
+    struct Timer
+    {
+        uint64_t                     deadline;
+        int64_t                      interval;
+        Callback                     callback;
+        unsigned                     level;
+        unsigned                     slot;
+        std::list<TimerId>::iterator position;
+    };
+
+    TimerId  insert(int64_t now, int64_t delay, int64_t interval, Callback&& callback);
+    void     place(TimerId id, Timer& timer);
+    void     detach(std::list<TimerId>& ids, unsigned level, unsigned slot);
+    uint64_t nextEvent() const;
+    bool     process(uint64_t tick, uint64_t target);
+
+    int64_t                            m_origin;
+    uint64_t                           m_current = 0;
+    TimerId                            m_nextId  = 1;
+    std::unordered_map<TimerId, Timer> m_timers;
+    std::list<TimerId>                 m_slots[Levels][Slots];
+    uint64_t                           m_occupied[Levels] = {};
+};
+
+} // namespace mlm
@@ -24,26 +24,85 @@
 // Original idea of using cxxtools::Pool of mlm_client_t* connections
 // by Michal Hrusecky <michal@hrusecky.net>
 
+#include <chrono>
+#include <deque>
 #include <fty_log.h>
 #include <malamute.h>
 #include <memory>
 #include <string>
+#include <utility>
 
 class MlmClient
 {
 public:
     static const std::string ENDPOINT;
 
+    using Clock = std::chrono::steady_clock;
+
+    // outcome of the last recv(), request(), reply() or requestreply()
+    enum class Result
+    {
+        Ok,
+        Timeout,     // no reply before the deadline
+        Interrupted, // interrupted by a signal
+        SendFailed,  // the request couldn't be sent
+        Invalid      // invalid arguments
+    };
+
+    // connected to ENDPOINT as "rest." + uuid
     MlmClient();
+    // connected to endpoint as prefix + uuid
+    explicit MlmClient(const std::string& endpoint, const std::string& prefix = "rest.");
     virtual ~MlmClient();
 
     // timeout <0, 300> seconds, greater number trimmed
     // based on specified uuid returns expected message or NULL on expire/interrupt
+    // messages of the other uuids waited for (by recv() or request()) are kept for them, the others dropped
     virtual zmsg_t* recv(const std::string& uuid, uint32_t timeout);
 
     // implements request reply pattern
     // method prepends two frames
     zmsg_t* requestreply(const std::string& address, const std::string& subject, uint32_t timeout, zmsg_t** content_p);
+
+    // same as above, copyContent selects what happens to *content_p (true by default, everywhere):
+    //  - true: a copy is sent, *content_p is destroyed once sent and left untouched if the send fails
+    //    or the arguments are invalid
+    //  - false: the frames are prepended to *content_p itself, which is always consumed (nullptr)
+    zmsg_t* requestreply(const std::string& address, const std::string& subject, uint32_t timeout, zmsg_t** content_p,
+        bool copyContent);
+
+    // first half of requestreply(), for several requests in flight on the same client:
+    // sends the request and returns its uuid, to wait for its reply with reply() ("" on failure)
+    // timeout is the send timeout in ms, see mlm_client_sendto()
+    std::string request(const std::string& address, const std::string& subject, uint32_t timeout,
+        zmsg_t** content_p, bool copyContent = true);
+    // second half of requestreply(): reply of the request uuid, or NULL on expire/interrupt
+    // a reply arriving later (or while waiting for another one) is kept for the next call
+    zmsg_t* reply(const std::string& uuid, uint32_t timeout);
+
+    // millisecond resolution versions of the above, neither capped nor rounded to seconds:
+    // the reply must come before the deadline, or timeout from now
+    // the requests are sent with the send timeout of setSendTimeout()
+    zmsg_t* recv(const std::string& uuid, std::chrono::milliseconds timeout);
+    zmsg_t* reply(const std::string& uuid, std::chrono::milliseconds timeout);
+    zmsg_t* reply(const std::string& uuid, Clock::time_point deadline);
+    zmsg_t* requestreply(const std::string& address, const std::string& subject, std::chrono::milliseconds timeout,
+        zmsg_t** content_p, bool copyContent = true);
+    zmsg_t* requestreply(const std::string& address, const std::string& subject, Clock::time_point deadline,
+        zmsg_t** content_p, bool copyContent = true);
+
+    // send timeout of the requests of the std::chrono versions (1 s by default)
+    void setSendTimeout(std::chrono::milliseconds timeout)
+    {
+        _sendTimeout = timeout;
+    }
+
+    // tells why the last call returned NULL (or "")
+    Result lastResult() const
+    {
+        return _lastResult;
+    }
+
     virtual int sendto(const std::string& address, const std::string& subject, uint32_t timeout, zmsg_t** content_p);
     bool        connected()
     {
@@ -57,10 +116,37 @@ public:
     {
         return mlm_client_sender(_client);
     }
+    const std::string& endpoint() const
+    {
+        return _endpoint;
+    }
 
 private:
-    void          connect();
+    // bounds of the messages kept for the requests in flight
+    static constexpr size_t MAX_EXPECTED = 64;
+    static constexpr size_t MAX_PENDING  = 16;
+
+    static Clock::time_point deadlineOf(std::chrono::milliseconds timeout);
+    static int64_t           quitOf(Clock::time_point deadline);
+
+    void    connect();
+    zmsg_t* waitFor(const std::string& uuid, int64_t quit);
+    zmsg_t* waitReply(const std::string& uuid, int64_t quit);
+    void    expect(const std::string& uuid);
+    void    forget(const std::string& uuid);
+    void    keep(const std::string& uuid, zmsg_t* msg);
+
+    std::string   _endpoint;
+    std::string   _prefix;
     mlm_client_t* _client;
     zuuid_t*      _uuid;
     zpoller_t*    _poller;
+
+    std::chrono::milliseconds _sendTimeout{1000};
+    Result                    _lastResult = Result::Ok;
+
+    // uuids whose message is kept when received while waiting for another one, oldest first
+    std::deque<std::string> _expected;
+    // messages received for them, oldest first
+    std::deque<std::pair<std::string, zmsg_t*>> _pending;
 };
@@ -25,6 +25,7 @@
 #include <czmq.h>
 #include <map>
 #include <string>
+#include <vector>
 
 // malamute endpoint
 #define MLM_ENDPOINT "ipc://@/malamute"
@@ -42,6 +43,32 @@ zhash_t* map_to_zhash(std::map<std::string, std::string> map_to_convert);
  */
 std::string zmsg_popstring(zmsg_t* resp);
 
+/** \brief zmsg_send() keeping the message when it can't be sent (send timeout expired...), as
+ *   zmsg_send() destroys it anyway
+ *   \return 0 on success (message consumed), -1 otherwise (message left untouched)
+ */
+int zmsg_trysend(zmsg_t** message, void* socket);
+
+/** \brief name of a shard of a sharded agent: <name>.<index>
+ */
+std::string shardName(const std::string& name, size_t index);
+
+/** \brief 64 bits FNV-1a hash of data, the same in every build; pass the previous hash to hash several parts
+ */
+uint64_t fnv1a(const void* data, size_t size, uint64_t hash = 0xcbf29ce484222325ULL);
+
+/** \brief consistent hash of a key to one of the shards [0, shards)
+ *   Changing the number of shards from n to n+1 only moves 1/(n+1) of the keys. The hash (jump consistent
+ *   hash of the FNV-1a 64 of the key) doesn't depend on the build: processes built apart agree on it.
+ */
+size_t shardOf(const std::string& key, size_t shards);
+
+/** \brief nodes ordered by rendezvous (highest random weight) hash of key: the first one owns the key, the
+ *   next ones take it over in turn. Removing a node only moves the keys it owned, wherever it is in the list.
+ *   Like shardOf(), the order doesn't depend on the build.
+ */
+std::vector<std::string> rendezvousOrder(const std::string& key, const std::vector<std::string>& nodes);
+
 } // namespace MlmUtils
 
 #endif
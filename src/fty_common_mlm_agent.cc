@@ -28,23 +28,42 @@
 
 #include "fty_common_mlm_agent.h"
 #include "fty_common_mlm_guards.h"
+#include "fty_common_mlm_local_registry.h"
+#include "fty_common_mlm_utils.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cinttypes>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
 #include <fty_log.h>
 #include <stdexcept>
+#include <unistd.h>
 
 
 namespace mlm {
 MlmAgent::~MlmAgent()
 {
+    unregisterLocal();
+    for (auto& lane : m_lanes) {
+        for (auto& delivery : lane) {
+            zmsg_destroy(&delivery.message);
+        }
+    }
     mlm_client_destroy(&m_client);
     zpoller_destroy(&m_defaultZpoller);
+    if (m_epollFd != -1) {
+        close(m_epollFd);
+    }
 }
 
 MlmAgent::MlmAgent(zsock_t* pipe, const char* endpoint, const char* address, int pollerTimeout, int connectionTimeout)
     : m_client(mlm_client_new())
     , m_pipe(pipe)
-    , m_lastTick(zclock_mono())
     , m_pollerTimeout(pollerTimeout)
     , m_defaultZpoller(nullptr)
+    , m_timers(zclock_mono())
 {
 
     if (!m_client) {
@@ -59,6 +78,10 @@ MlmAgent::MlmAgent(zsock_t* pipe, const char* endpoint, const char* address, int
 void MlmAgent::connect(const char* endpoint, const char* address, int connectionTimeout)
 {
     log_debug("endpoint: %s", endpoint);
+    // kept for the reconnections
+    m_endpoint          = endpoint ? endpoint : "";
+    m_address           = address ? address : "";
+    m_connectionTimeout = connectionTimeout;
     if (mlm_client_connect(m_client, endpoint, uint32_t(connectionTimeout), address) == -1) {
         log_error("mlm_client_connect(endpoint = '%s', timeout = '%d', address = '%s') failed.", endpoint,
             connectionTimeout, address);
@@ -66,63 +89,1084 @@ void MlmAgent::connect(const char* endpoint, const char* address, int connection
     }
 }
 
+void MlmAgent::setPriorityLanes(unsigned lanes, Classifier classifier, unsigned starvationLimit, size_t maxQueued)
+{
+    if (m_queued != 0) {
+        throw std::logic_error("Can't change priority lanes while messages are queued");
+    }
+    if (lanes != 0 && !classifier) {
+        throw std::invalid_argument("Priority lanes require a classifier");
+    }
+    if (lanes != 0 && starvationLimit == 0) {
+        // the lower lanes would always go first
+        throw std::invalid_argument("Priority lanes require a starvation limit");
+    }
+    m_lanes.clear();
+    m_lanes.resize(lanes);
+    m_lanePassed.assign(lanes, 0);
+    m_classifier      = classifier;
+    m_starvationLimit = starvationLimit;
+    m_maxQueued       = maxQueued > 0 ? maxQueued : 1;
+}
+
+MlmAgent::TimerId MlmAgent::addTimer(int64_t interval, TimerWheel::Callback callback)
+{
+    return m_timers.add(zclock_mono(), interval, std::move(callback));
+}
+
+MlmAgent::TimerId MlmAgent::addOneShot(int64_t delay, TimerWheel::Callback callback)
+{
+    return m_timers.addOneShot(zclock_mono(), delay, std::move(callback));
+}
+
+bool MlmAgent::cancelTimer(TimerId id)
+{
+    return m_timers.cancel(id);
+}
+
+int MlmAgent::setConsumer(const std::string& stream, const std::string& pattern)
+{
+    auto registration = std::make_pair(stream, pattern);
+    if (std::find(m_consumers.begin(), m_consumers.end(), registration) == m_consumers.end()) {
+        m_consumers.push_back(registration);
+        if (m_localInbox) {
+            m_localConsumers.push_back(
+                MlmLocalRegistry::instance().addConsumer(m_endpoint, stream, pattern, m_localInbox.get()));
+        }
+    }
+    return mlm_client_set_consumer(m_client, stream.c_str(), pattern.c_str());
+}
+
+int MlmAgent::setProducer(const std::string& stream)
+{
+    m_producer = stream;
+    return mlm_client_set_producer(m_client, stream.c_str());
+}
+
+int MlmAgent::setWorker(const std::string& service, const std::string& pattern)
+{
+    auto registration = std::make_pair(service, pattern);
+    if (std::find(m_workers.begin(), m_workers.end(), registration) == m_workers.end()) {
+        m_workers.push_back(registration);
+    }
+    return mlm_client_set_worker(m_client, service.c_str(), pattern.c_str());
+}
+
+void MlmAgent::setLocalDelivery(bool enable)
+{
+    if (!enable) {
+        unregisterLocal();
+        return;
+    }
+    if (m_localInbox) {
+        return;
+    }
+    if (m_endpoint.empty()) {
+        throw std::logic_error("Local delivery requires a connected agent");
+    }
+
+    m_localInbox.reset(new MlmLocalInbox());
+    registerSocket(m_localInbox->socket(), [this](zmsg_t* message) {
+        return dispatchLocal(message);
+    });
+    MlmLocalRegistry& registry = MlmLocalRegistry::instance();
+    for (const auto& it : m_consumers) {
+        m_localConsumers.push_back(registry.addConsumer(m_endpoint, it.first, it.second, m_localInbox.get()));
+    }
+    if (!m_draining) {
+        registry.addMailbox(m_endpoint, m_address, m_localInbox.get(), false);
+    }
+}
+
+void MlmAgent::unregisterLocal()
+{
+    if (!m_localInbox) {
+        return;
+    }
+    MlmLocalRegistry& registry = MlmLocalRegistry::instance();
+    registry.removeMailbox(m_endpoint, m_address, m_localInbox.get());
+    for (uint64_t consumer : m_localConsumers) {
+        registry.removeConsumer(consumer);
+    }
+    m_localConsumers.clear();
+    // the messages still queued are lost, as those of a closed connection
+    unregisterSocket(m_localInbox->socket());
+    m_localInbox.reset();
+}
+
+int MlmAgent::sendto(const std::string& address, const std::string& subject, zmsg_t** content, uint32_t timeout)
+{
+    if (m_localInbox && MlmLocalRegistry::instance().sendto(m_endpoint, m_address, address, subject, content)) {
+        return 0;
+    }
+    return mlm_client_sendto(m_client, address.c_str(), subject.c_str(), nullptr, timeout, content);
+}
+
+void MlmAgent::setReconnect(int64_t checkInterval, int64_t minBackoff, int64_t maxBackoff, int connectTimeout)
+{
+    if (m_reconnectTimer != 0) {
+        cancelTimer(m_reconnectTimer);
+        m_reconnectTimer = 0;
+    }
+    m_minBackoff = minBackoff > 0 ? minBackoff : 1;
+    m_maxBackoff = std::max(maxBackoff, m_minBackoff);
+    // the agent thread doesn't serve its pipe nor its sockets while connecting
+    m_reconnectTimeout = connectTimeout > 0 ? connectTimeout : 1;
+    m_random.seed(std::minstd_rand::result_type(zclock_usecs()));
+    if (checkInterval > 0) {
+        m_reconnectTimer = addTimer(checkInterval, [this]() {
+            checkConnection();
+            return true;
+        });
+    }
+}
+
+void MlmAgent::checkConnection()
+{
+    if (m_reconnecting || m_endpoint.empty()) {
+        return;
+    }
+    if (mlm_client_connected(m_client)) {
+        // the previous probe may still be on its way, not the one before unless still to be read
+        if (m_probeReceived + 1 >= m_probeSent || (zsock_events(mlm_client_msgpipe(m_client)) & ZMQ_POLLIN)) {
+            sendProbe();
+            return;
+        }
+        log_warning("<%s> %s forgot the registrations (restarted), restoring them", m_address.c_str(),
+            m_endpoint.c_str());
+    } else {
+        log_warning("<%s> Connection to %s lost, reconnecting", m_address.c_str(), m_endpoint.c_str());
+    }
+    m_reconnecting = true;
+    m_backoff      = m_minBackoff;
+    onDisconnect();
+    scheduleReconnect();
+}
+
+void MlmAgent::scheduleReconnect()
+{
+    std::uniform_int_distribution<int64_t> jitter(m_backoff / 2, m_backoff);
+    addOneShot(jitter(m_random), [this]() {
+        reconnect();
+        return true;
+    });
+    m_backoff = std::min(m_backoff * 2, m_maxBackoff);
+}
+
+void MlmAgent::reconnect()
+{
+    // mlm_client_t may have reconnected by itself, but the broker forgot the registrations anyway
+    if (!mlm_client_connected(m_client)) {
+        mlm_client_t* client = mlm_client_new();
+        if (client == nullptr) {
+            log_error("mlm_client_new() failed.");
+            scheduleReconnect();
+            return;
+        }
+        setClient(client);
+        if (mlm_client_connect(m_client, m_endpoint.c_str(), uint32_t(m_reconnectTimeout), m_address.c_str()) == -1) {
+            log_warning("<%s> Can't reconnect to %s, next attempt in %" PRIi64 " ms at most", m_address.c_str(),
+                m_endpoint.c_str(), m_backoff);
+            scheduleReconnect();
+            return;
+        }
+    }
+    if (!restoreRegistrations()) {
+        scheduleReconnect();
+        return;
+    }
+
+    log_info("<%s> Reconnected to %s", m_address.c_str(), m_endpoint.c_str());
+    m_reconnecting = false;
+    m_stats.reconnections++;
+    onReconnect();
+}
+
+void MlmAgent::sendProbe()
+{
+    // a worker registration is forgotten by a restarted broker, the probes then stay in the service queue
+    if (m_probeService.empty()) {
+        m_probeService = "$liveness/" + m_address;
+        if (mlm_client_set_worker(m_client, m_probeService.c_str(), ".*") == -1) {
+            log_error("<%s> Can't register the liveness service", m_address.c_str());
+            m_probeService.clear();
+            return;
+        }
+    }
+    zmsg_t* probe = zmsg_new();
+    if (mlm_client_sendfor(m_client, m_probeService.c_str(), std::to_string(++m_probeSent).c_str(), nullptr, 0,
+            &probe) == -1) {
+        zmsg_destroy(&probe);
+    }
+}
+
+bool MlmAgent::isProbe(Command command)
+{
+    if (command != Command::Service || m_probeService.empty() || m_probeService != mlm_client_address(m_client)) {
+        return false;
+    }
+    m_probeReceived = std::max<uint64_t>(m_probeReceived, strtoull(mlm_client_subject(m_client), nullptr, 10));
+    return true;
+}
+
+bool MlmAgent::restoreRegistrations()
+{
+    bool rv = true;
+    if (!m_probeService.empty() && mlm_client_set_worker(m_client, m_probeService.c_str(), ".*") == -1) {
+        log_error("<%s> Can't restore the liveness service", m_address.c_str());
+        rv = false;
+    }
+    // the probes sent meanwhile may never come back
+    m_probeReceived = m_probeSent;
+    if (!m_producer.empty() && mlm_client_set_producer(m_client, m_producer.c_str()) == -1) {
+        log_error("<%s> Can't restore producer of %s", m_address.c_str(), m_producer.c_str());
+        rv = false;
+    }
+    for (const auto& it : m_consumers) {
+        if (mlm_client_set_consumer(m_client, it.first.c_str(), it.second.c_str()) == -1) {
+            log_error("<%s> Can't restore consumer of %s", m_address.c_str(), it.first.c_str());
+            rv = false;
+        }
+    }
+    for (const auto& it : m_workers) {
+        if (mlm_client_set_worker(m_client, it.first.c_str(), it.second.c_str()) == -1) {
+            log_error("<%s> Can't restore worker of %s", m_address.c_str(), it.first.c_str());
+            rv = false;
+        }
+    }
+    return rv;
+}
+
+void MlmAgent::setClient(mlm_client_t* client)
+{
+    // the connection socket changes, so does the poller
+    void* msgpipe = mlm_client_msgpipe(m_client);
+    m_removed.push_back(msgpipe);
+    if (m_backend == Backend::Epoll) {
+        epollRemove(msgpipe);
+    }
+    if (m_batchCut == msgpipe) {
+        m_batchCut = nullptr;
+    }
+    mlm_client_destroy(&m_client);
+
+    m_client         = client;
+    msgpipe        = mlm_client_msgpipe(m_client);
+    m_zpollerDirty = true;
+    if (m_backend == Backend::Epoll) {
+        epollAdd(msgpipe,
+            std::unique_ptr<EpollEntry>(new EpollEntry{msgpipe, zsock_fd(msgpipe), EPOLLIN, 0, {}, false, false}));
+    }
+}
+
+int MlmAgent::pollTimeout()
+{
+    // don't block while queued messages are waiting for dispatch
+    if (m_queued > 0 || m_pollerTimeout == 0) {
+        return 0;
+    }
+
+    // wake up for the nearest timer
+    int64_t timeout = m_timers.timeout(zclock_mono());
+    return timeout > INT_MAX ? INT_MAX : int(timeout);
+}
 
 void MlmAgent::mainloop()
 {
     zsock_signal(m_pipe, 0);
     log_debug("actor ready");
 
+    // Handle periodic callback hook
+    if (m_pollerTimeout > 0 && m_tickTimer == 0) {
+        m_tickTimer = addTimer(m_pollerTimeout, [this]() {
+            return tick();
+        });
+    }
+
     while (!zsys_interrupted) {
-        void* which = zpoller_wait(zpoller(), m_pollerTimeout);
-
-        // Handle periodic callback hook
-        if (m_pollerTimeout > 0) {
-            int64_t curClock = zclock_mono();
-            if (m_lastTick + m_pollerTimeout < curClock) {
-                if (!tick()) {
-                    break;
-                }
-                m_lastTick = curClock;
-            }
+        uint64_t start   = usecs();
+        void*    which = wait(pollTimeout());
+        m_removed.clear();
+        m_stats.iterations++;
+
+        int64_t  now       = zclock_mono();
+        uint64_t timerTime = usecs();
+        bool     due       = m_timers.timeout(now) == 0;
+        m_stats.pollTime += timerTime - start;
+        if (!m_timers.advance(now)) {
+            break;
+        }
+        if (due) {
+            account(m_stats.timers, timerTime, 0);
         }
 
-        if (which == m_pipe) {
-            ZmsgGuard message(zmsg_recv(m_pipe));
-            if (message == nullptr) {
-                log_debug("interrupted");
+        // handlers unregistered during the previous iteration aren't running anymore
+        m_retiredSockets.clear();
+        m_retiredHandlers.clear();
+        m_retiredPatterns.clear();
+        m_retiredEntries.clear();
+
+        // the socket whose batch was cut lets the other ready sockets go first
+        if (which != nullptr && which == m_batchCut) {
+            void* other = otherReady(which);
+            if (other != nullptr && !serveBatch(other)) {
                 break;
             }
-            if (!handlePipe(message.get())) {
-                break;
+        }
+
+        // a timer or handler may have unregistered (and destroyed) the socket
+        if (which != nullptr && !removed(which) && !serveBatch(which)) {
+            break;
+        }
+
+        for (size_t count = 0; count < m_batchSize && m_queued > 0; count++) {
+            if (!dispatchQueued()) {
+                return;
             }
-        } else if (which == mlm_client_msgpipe(m_client)) {
-            ZmsgGuard message(mlm_client_recv(m_client));
-            if (message == nullptr) {
-                log_debug("interrupted");
-                break;
-            } else if (streq(mlm_client_command(m_client), "MAILBOX DELIVER")) {
-                if (!handleMailbox(message.get())) {
-                    break;
-                }
-            } else if (streq(mlm_client_command(m_client), "STREAM DELIVER")) {
-                if (!handleStream(message.get())) {
-                    break;
-                }
-            } else {
-                log_warning("Unknown malamute pattern: '%s'. Message subject: '%s', sender: '%s'.",
-                    mlm_client_command(m_client), mlm_client_subject(m_client), mlm_client_sender(m_client));
+        }
+
+        if (m_draining && drained()) {
+            log_info("<%s> Drained", m_address.c_str());
+            break;
+        }
+    }
+}
+
+void MlmAgent::setDrain(int64_t gracePeriod)
+{
+    m_drainPeriod = gracePeriod;
+}
+
+void MlmAgent::startDrain()
+{
+    log_info("<%s> Draining for %" PRIi64 " ms at most", m_address.c_str(), m_drainPeriod);
+    m_draining = true;
+    // the local senders go through the broker, which rejects their requests
+    if (m_localInbox) {
+        MlmLocalRegistry::instance().removeMailbox(m_endpoint, m_address, m_localInbox.get());
+    }
+    addOneShot(m_drainPeriod, [this]() {
+        log_warning("<%s> Drain grace period expired, %zu messages left", m_address.c_str(), m_queued);
+        return false;
+    });
+}
+
+bool MlmAgent::drained()
+{
+    epollRecheck(mlm_client_msgpipe(m_client));
+    if (m_localInbox) {
+        epollRecheck(m_localInbox->socket());
+    }
+    return m_queued == 0 && !(zsock_events(mlm_client_msgpipe(m_client)) & ZMQ_POLLIN) &&
+           !(m_localInbox && (zsock_events(m_localInbox->socket()) & ZMQ_POLLIN));
+}
+
+void MlmAgent::setBatch(size_t maxMessages, int64_t timeSlice)
+{
+    m_batchSize  = maxMessages > 0 ? maxMessages : 1;
+    m_batchSlice = timeSlice;
+    m_batchCut   = nullptr;
+}
+
+bool MlmAgent::lanesFull(void* which)
+{
+    return !m_lanes.empty() && m_queued >= m_maxQueued && which == mlm_client_msgpipe(m_client);
+}
+
+bool MlmAgent::serveBatch(void* which)
+{
+    // a file descriptor handler consumes all its events at once
+    if (m_batchSize == 1 || !isSocket(which)) {
+        return handleSocket(which);
+    }
+
+    int64_t sliceEnd = m_batchSlice > 0 ? zclock_mono() + m_batchSlice : 0;
+    size_t  count    = 0;
+    while (true) {
+        if (!handleSocket(which)) {
+            return false;
+        }
+        // unregistered (and maybe destroyed) by its handler
+        if (removed(which)) {
+            return true;
+        }
+        bool more = zsock_events(which) & ZMQ_POLLIN;
+        if (!more) {
+            m_batchCut = nullptr;
+            return true;
+        }
+        // the lanes are full: the queued messages must be dispatched first
+        if (++count >= m_batchSize || lanesFull(which) || (sliceEnd != 0 && zclock_mono() >= sliceEnd)) {
+            m_batchCut = which;
+            return true;
+        }
+        // never delay $TERM by more than one message
+        if (which != m_pipe && (zsock_events(m_pipe) & ZMQ_POLLIN)) {
+            m_batchCut = which;
+            return handleSocket(m_pipe);
+        }
+    }
+}
+
+bool MlmAgent::handleSocket(void* which)
+{
+    if (m_backend == Backend::Epoll) {
+        auto it = m_epollEntries.find(which);
+        if (it != m_epollEntries.end() && it->second->socket == nullptr) {
+            EpollEntry& entry = *it->second;
+            uint64_t    start = usecs();
+            bool        rv    = entry.handler(entry.fd, entry.revents);
+            account(m_stats.fds, start, 0);
+            return rv;
+        }
+    }
+
+    epollRecheck(which);
+    if (which == mlm_client_msgpipe(m_client)) {
+        return receiveClient();
+    }
+
+    ZmsgGuard message(zmsg_recv(which));
+    if (message == nullptr) {
+        log_debug("interrupted");
+        return false;
+    }
+
+    uint64_t start = usecs();
+    size_t   bytes = zmsg_content_size(message);
+    bool     rv    = true;
+    if (which == m_pipe) {
+        zframe_t* first = zmsg_first(message);
+        if (first != nullptr && zframe_streq(first, "STATS")) {
+            sendStats();
+        } else if (first != nullptr && zframe_streq(first, "$TERM") && m_drainPeriod > 0 && !m_draining) {
+            startDrain();
+        } else {
+            rv = handlePipe(message.get());
+        }
+        account(m_stats.pipe, start, bytes);
+        return rv;
+    }
+
+    // accounted as mailbox and stream messages
+    if (m_localInbox && which == m_localInbox->socket()) {
+        return dispatchLocal(message.get());
+    }
+
+    auto it = m_sockets.find(which);
+    if (it != m_sockets.end()) {
+        // the handler may unregister its socket, it is only retired then
+        SocketHandler& handler = *it->second;
+        rv                     = handler(message.get());
+    } else {
+        rv = handleOther(message.get(), which);
+    }
+    account(m_stats.sockets, start, bytes);
+    return rv;
+}
+
+uint64_t MlmAgent::usecs()
+{
+    return uint64_t(
+        std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch())
+            .count());
+}
+
+void MlmAgent::account(Stats::Handler& handler, uint64_t start, size_t bytes)
+{
+    uint64_t time = usecs() - start;
+    handler.messages++;
+    handler.bytes += bytes;
+    handler.time += time;
+    if (time > m_stats.maxHandlerTime) {
+        m_stats.maxHandlerTime = time;
+    }
+}
+
+void MlmAgent::sendStats()
+{
+    zmsg_t* reply = zmsg_new();
+    zmsg_addstr(reply, "STATS");
+    auto add = [reply](const char* name, uint64_t value) {
+        zmsg_addstr(reply, name);
+        zmsg_addstr(reply, std::to_string(value).c_str());
+    };
+    auto addHandler = [&add](const std::string& name, const Stats::Handler& handler) {
+        add((name + ".messages").c_str(), handler.messages);
+        add((name + ".bytes").c_str(), handler.bytes);
+        add((name + ".time").c_str(), handler.time);
+    };
+
+    add("iterations", m_stats.iterations);
+    add("pollTime", m_stats.pollTime);
+    add("maxHandlerTime", m_stats.maxHandlerTime);
+    add("foreignStream", m_stats.foreignStream);
+    add("reconnections", m_stats.reconnections);
+    addHandler("pipe", m_stats.pipe);
+    addHandler("mailbox", m_stats.mailbox);
+    addHandler("stream", m_stats.stream);
+    addHandler("sockets", m_stats.sockets);
+    addHandler("fds", m_stats.fds);
+    addHandler("timers", m_stats.timers);
+    zmsg_send(&reply, m_pipe);
+}
+
+bool MlmAgent::removed(void* which)
+{
+    return std::find(m_removed.begin(), m_removed.end(), which) != m_removed.end();
+}
+
+bool MlmAgent::isSocket(void* which)
+{
+    auto it = m_epollEntries.find(which);
+    return it == m_epollEntries.end() || it->second->socket != nullptr;
+}
+
+void* MlmAgent::otherReady(void* which)
+{
+    if (which != m_pipe && (zsock_events(m_pipe) & ZMQ_POLLIN)) {
+        return m_pipe;
+    }
+    if (which != mlm_client_msgpipe(m_client) && (zsock_events(mlm_client_msgpipe(m_client)) & ZMQ_POLLIN)) {
+        return mlm_client_msgpipe(m_client);
+    }
+    for (const auto& it : m_sockets) {
+        if (it.first != which && (zsock_events(it.first) & ZMQ_POLLIN)) {
+            return it.first;
+        }
+    }
+    return nullptr;
+}
+
+void MlmAgent::registerSocket(void* socket, SocketHandler handler)
+{
+    if (socket == nullptr || !handler) {
+        throw std::invalid_argument("Can't register a socket without handler");
+    }
+    if (socket == m_pipe || socket == mlm_client_msgpipe(m_client)) {
+        throw std::invalid_argument("Socket is already handled by the agent");
+    }
+
+    auto it = m_sockets.find(socket);
+    if (it != m_sockets.end()) {
+        m_retiredSockets.push_back(std::move(it->second));
+        it->second.reset(new SocketHandler(std::move(handler)));
+        return;
+    }
+    m_sockets.emplace(socket, std::unique_ptr<SocketHandler>(new SocketHandler(std::move(handler))));
+    m_zpollerDirty = true;
+    if (m_backend == Backend::Epoll) {
+        epollAdd(socket,
+            std::unique_ptr<EpollEntry>(new EpollEntry{socket, zsock_fd(socket), EPOLLIN, 0, {}, false, false}));
+    }
+}
+
+bool MlmAgent::unregisterSocket(void* socket)
+{
+    auto it = m_sockets.find(socket);
+    if (it == m_sockets.end()) {
+        return false;
+    }
+
+    // the handler may be the one running
+    m_retiredSockets.push_back(std::move(it->second));
+    m_sockets.erase(it);
+    m_removed.push_back(socket);
+    if (m_batchCut == socket) {
+        m_batchCut = nullptr;
+    }
+    m_zpollerDirty = true;
+    if (m_backend == Backend::Epoll) {
+        epollRemove(socket);
+    }
+    return true;
+}
+
+void MlmAgent::setBackend(Backend backend)
+{
+    if (backend == m_backend) {
+        return;
+    }
+    if (backend == Backend::ZPoller) {
+        if (!m_fdEntries.empty()) {
+            throw std::logic_error("File descriptors require the epoll backend");
+        }
+        m_epollReady.clear();
+        m_epollRecheck.clear();
+        m_epollEntries.clear();
+        close(m_epollFd);
+        m_epollFd = -1;
+        m_backend = backend;
+        return;
+    }
+
+    m_epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (m_epollFd == -1) {
+        log_error("epoll_create1() failed: %s", strerror(errno));
+        throw std::runtime_error("Can't create epoll instance");
+    }
+    m_backend = backend;
+
+    std::vector<void*> sockets = {m_pipe, mlm_client_msgpipe(m_client)};
+    for (const auto& it : m_sockets) {
+        sockets.push_back(it.first);
+    }
+    for (void* socket : sockets) {
+        epollAdd(socket,
+            std::unique_ptr<EpollEntry>(new EpollEntry{socket, zsock_fd(socket), EPOLLIN, 0, {}, false, false}));
+    }
+}
+
+void MlmAgent::registerFd(int fd, FdHandler handler, uint32_t events)
+{
+    if (m_backend != Backend::Epoll) {
+        throw std::logic_error("File descriptors require the epoll backend");
+    }
+    if (fd < 0 || !handler) {
+        throw std::invalid_argument("Can't register a file descriptor without handler");
+    }
+
+    unregisterFd(fd);
+    std::unique_ptr<EpollEntry> entry(new EpollEntry{nullptr, fd, events, 0, std::move(handler), false, false});
+    EpollEntry*                 which = entry.get();
+    epollAdd(which, std::move(entry));
+    m_fdEntries[fd] = which;
+}
+
+bool MlmAgent::unregisterFd(int fd)
+{
+    auto it = m_fdEntries.find(fd);
+    if (it == m_fdEntries.end()) {
+        return false;
+    }
+
+    m_removed.push_back(it->second);
+    epollRemove(it->second);
+    m_fdEntries.erase(it);
+    return true;
+}
+
+void MlmAgent::epollAdd(void* which, std::unique_ptr<EpollEntry> entry)
+{
+    epoll_event event;
+    event.events   = entry->events;
+    event.data.ptr = entry.get();
+    if (epoll_ctl(m_epollFd, EPOLL_CTL_ADD, entry->fd, &event) == -1) {
+        log_error("epoll_ctl(EPOLL_CTL_ADD, fd = %d) failed: %s", entry->fd, strerror(errno));
+        throw std::runtime_error("Can't watch file descriptor");
+    }
+    // a socket already read before may have messages its descriptor won't signal
+    if (entry->socket != nullptr) {
+        entry->recheck = true;
+        m_epollRecheck.push_back(entry.get());
+    }
+    m_epollEntries[which] = std::move(entry);
+}
+
+void MlmAgent::epollRemove(void* which)
+{
+    auto it = m_epollEntries.find(which);
+    if (it == m_epollEntries.end()) {
+        return;
+    }
+
+    EpollEntry* entry = it->second.get();
+    // may fail if the descriptor is already closed, it's then out of the set anyway
+    epoll_ctl(m_epollFd, EPOLL_CTL_DEL, entry->fd, nullptr);
+    if (entry->ready) {
+        m_epollReady.erase(std::find(m_epollReady.begin(), m_epollReady.end(), entry));
+    }
+    if (entry->recheck) {
+        m_epollRecheck.erase(std::find(m_epollRecheck.begin(), m_epollRecheck.end(), entry));
+    }
+    // the handler may be the one running
+    m_retiredEntries.push_back(std::move(it->second));
+    m_epollEntries.erase(it);
+}
+
+void MlmAgent::epollRecheck(void* which)
+{
+    if (m_backend != Backend::Epoll) {
+        return;
+    }
+    auto it = m_epollEntries.find(which);
+    if (it != m_epollEntries.end() && it->second->socket != nullptr && !it->second->recheck) {
+        it->second->recheck = true;
+        m_epollRecheck.push_back(it->second.get());
+    }
+}
+
+void* MlmAgent::wait(int timeout)
+{
+    if (m_backend == Backend::Epoll) {
+        return epollWait(timeout);
+    }
+    return zpoller_wait(zpoller(), timeout);
+}
+
+void* MlmAgent::epollWait(int timeout)
+{
+    if (m_epollReady.empty()) {
+        // the ZMQ_FD of a socket only signals changes, which a send, a receive or a readiness check on
+        // the socket may have consumed: ask the sockets used since the last wait before blocking
+        for (EpollEntry* entry : m_epollRecheck) {
+            entry->recheck = false;
+            if (!entry->ready && (zsock_events(entry->socket) & ZMQ_POLLIN)) {
+                entry->ready = true;
+                m_epollReady.push_back(entry);
             }
-        } else if (which != nullptr) {
-            ZmsgGuard message(zmsg_recv(which));
-            if (message == nullptr) {
-                log_debug("interrupted");
-                break;
+        }
+        m_epollRecheck.clear();
+
+        epoll_event events[64];
+        int         count = epoll_wait(m_epollFd, events, 64, m_epollReady.empty() ? timeout : 0);
+        if (count == -1 && errno != EINTR) {
+            log_error("epoll_wait() failed: %s", strerror(errno));
+        }
+
+        for (int index = 0; index < count; index++) {
+            EpollEntry* entry = static_cast<EpollEntry*>(events[index].data.ptr);
+            entry->revents    = events[index].events;
+            if (entry->ready || (entry->socket != nullptr && !(zsock_events(entry->socket) & ZMQ_POLLIN))) {
+                continue;
             }
-            if (!handleOther(message.get(), which)) {
-                break;
+            entry->ready = true;
+            m_epollReady.push_back(entry);
+        }
+
+        if (m_epollReady.empty()) {
+            return nullptr;
+        }
+    }
+
+    EpollEntry* entry = m_epollReady.front();
+    m_epollReady.pop_front();
+    entry->ready = false;
+    return entry->socket != nullptr ? entry->socket : entry;
+}
+
+bool MlmAgent::receiveClient()
+{
+    if (m_lanes.empty()) {
+        ZmsgGuard message(mlm_client_recv(m_client));
+        if (message == nullptr) {
+            log_debug("interrupted");
+            return false;
+        }
+        m_command = parseCommand(mlm_client_command(m_client));
+        if (isProbe(m_command) || mirroredCopy(m_command, message.get()) || foreign(m_command, message.get())) {
+            return true;
+        }
+        return dispatchClient(message.get());
+    }
+
+    // queue everything already pending on the connection, so that the lanes can reorder it; once they are
+    // full, the messages wait in the connection
+    while (m_queued < m_maxQueued && (zsock_events(mlm_client_msgpipe(m_client)) & ZMQ_POLLIN)) {
+        zmsg_t* message = mlm_client_recv(m_client);
+        if (message == nullptr) {
+            log_debug("interrupted");
+            return false;
+        }
+        Command command = parseCommand(mlm_client_command(m_client));
+        if (isProbe(command) || mirroredCopy(command, message) || foreign(command, message)) {
+            zmsg_destroy(&message);
+            continue;
+        }
+        // requests received while draining are rejected, not queued
+        if (m_draining && command == Command::Mailbox) {
+            ZmsgGuard guard(message);
+            m_command = command;
+            if (!dispatchClient(message)) {
+                return false;
             }
+            continue;
+        }
+        unsigned lane = m_classifier(mlm_client_subject(m_client), message);
+        if (lane >= m_lanes.size()) {
+            lane = unsigned(m_lanes.size() - 1);
         }
+        m_lanes[lane].push_back({command, mlm_client_sender(m_client), mlm_client_subject(m_client),
+            mlm_client_address(m_client), message});
+        m_queued++;
+    }
+
+    return true;
+}
+
+void MlmAgent::setStreamPartition(size_t shard, size_t shards, KeyFunction key)
+{
+    if (shards > 1 && shard >= shards) {
+        throw std::invalid_argument("Shard index out of range");
     }
+    m_shard    = shards > 1 ? shard : 0;
+    m_shards   = shards > 1 ? shards : 1;
+    m_shardKey = std::move(key);
+}
+
+bool MlmAgent::foreign(Command command, zmsg_t* message)
+{
+    if (m_shards == 1 || command != Command::Stream) {
+        return false;
+    }
+    const char* subject = this->subject();
+    if (MlmUtils::shardOf(m_shardKey ? m_shardKey(subject, message) : std::string(subject), m_shards) == m_shard) {
+        return false;
+    }
+    m_stats.foreignStream++;
+    return true;
+}
+
+bool MlmAgent::mirroredCopy(Command command, zmsg_t* message)
+{
+    // already received from the local publisher, for the streams consumed with setConsumer()
+    return m_localInbox && command == Command::Stream &&
+           MlmLocalRegistry::instance().receivedLocally(m_endpoint, mlm_client_sender(m_client),
+               mlm_client_address(m_client), mlm_client_subject(m_client), message, m_localInbox.get());
+}
+
+bool MlmAgent::dispatchLocal(zmsg_t* message)
+{
+    MlmLocalInbox::Envelope envelope;
+    if (!MlmLocalInbox::open(message, envelope)) {
+        log_warning("<%s> Dropping a local message without envelope", m_address.c_str());
+        return true;
+    }
+
+    Delivery delivery{parseCommand(envelope.command.c_str()), std::move(envelope.sender), std::move(envelope.subject),
+        std::move(envelope.address), nullptr};
+    bool rv   = true;
+    m_current = &delivery;
+    if (foreign(delivery.command, message)) {
+        m_current = nullptr;
+        return true;
+    }
+    // requests received while draining are rejected, not queued
+    if (m_draining && delivery.command == Command::Mailbox) {
+        uint64_t start = usecs();
+        size_t   bytes = zmsg_content_size(message);
+        rv             = rejectMailbox(message);
+        account(m_stats.mailbox, start, bytes);
+        m_current = nullptr;
+        return rv;
+    }
+    if (m_lanes.empty()) {
+        rv        = dispatchClient(message);
+        m_current = nullptr;
+        return rv;
+    }
+
+    unsigned lane = m_classifier(subject(), message);
+    if (lane >= m_lanes.size()) {
+        lane = unsigned(m_lanes.size() - 1);
+    }
+    m_current = nullptr;
+
+    // unlike the connection, the inbox can't hold the message while the lanes are full
+    while (rv && m_queued >= m_maxQueued) {
+        rv = dispatchQueued();
+    }
+    delivery.message = zmsg_new();
+    for (zframe_t* frame = zmsg_pop(message); frame != nullptr; frame = zmsg_pop(message)) {
+        zmsg_append(delivery.message, &frame);
+    }
+    m_lanes[lane].push_back(std::move(delivery));
+    m_queued++;
+    return rv;
+}
+
+bool MlmAgent::dispatchQueued()
+{
+    // highest priority non-empty lane, unless a lower one was passed over too many times
+    size_t lane = 0;
+    while (m_lanes[lane].empty()) {
+        lane++;
+    }
+    for (size_t starving = lane + 1; starving < m_lanes.size(); starving++) {
+        if (!m_lanes[starving].empty() && m_lanePassed[starving] >= m_starvationLimit) {
+            lane = starving;
+            break;
+        }
+    }
+    for (size_t other = 0; other < m_lanes.size(); other++) {
+        if (other != lane && !m_lanes[other].empty()) {
+            m_lanePassed[other]++;
+        }
+    }
+    m_lanePassed[lane] = 0;
+
+    Delivery delivery = std::move(m_lanes[lane].front());
+    m_lanes[lane].pop_front();
+    m_queued--;
+
+    ZmsgGuard message(delivery.message);
+    m_current = &delivery;
+    bool rv   = dispatchClient(message.get());
+    m_current = nullptr;
+    return rv;
+}
+
+bool MlmAgent::dispatchClient(zmsg_t* message)
+{
+    uint64_t start = usecs();
+    size_t   bytes = zmsg_content_size(message);
+    bool     rv    = true;
+    switch (command()) {
+        case Command::Mailbox:
+            if (m_draining && m_current == nullptr) {
+                rv = rejectMailbox(message);
+            } else if (!dispatchTable(m_mailboxHandlers, message, rv)) {
+                rv = handleMailbox(message);
+            }
+            account(m_stats.mailbox, start, bytes);
+            return rv;
+        case Command::Stream: {
+            auto it = std::find_if(m_streamHandlers.begin(), m_streamHandlers.end(), [this](const StreamTable& table) {
+                return table.stream == address();
+            });
+            if (it == m_streamHandlers.end() || !dispatchTable(it->subjects, message, rv)) {
+                rv = handleStream(message);
+            }
+            account(m_stats.stream, start, bytes);
+            return rv;
+        }
+        default:
+            break;
+    }
+
+    log_warning("Unknown malamute pattern: '%s'. Message subject: '%s', sender: '%s'.", mlm_client_command(m_client),
+        subject(), sender());
+    return true;
+}
+
+bool MlmAgent::dispatchTable(SubjectTable& table, zmsg_t* message, bool& rv)
+{
+    if (!table.exact.empty()) {
+        // reuse the buffer, the lookup doesn't allocate once it is large enough
+        m_lookup.assign(subject());
+        auto it = table.exact.find(m_lookup);
+        if (it != table.exact.end()) {
+            // retired, not destroyed, if it removes itself
+            MessageHandler& handler = *it->second;
+            rv                      = handler(message);
+            return true;
+        }
+    }
+    for (auto& pattern : table.patterns) {
+        if (std::regex_search(subject(), pattern->regex)) {
+            // the pattern is retired, not destroyed, if its handler removes it
+            MessageHandler& handler = pattern->handler;
+            rv                      = handler(message);
+            return true;
+        }
+    }
+    return false;
+}
+
+MlmAgent::Command MlmAgent::parseCommand(const char* command)
+{
+    if (command == nullptr) {
+        return Command::Unknown;
+    }
+    switch (command[0]) {
+        case 'M':
+            return streq(command, "MAILBOX DELIVER") ? Command::Mailbox : Command::Unknown;
+        case 'S':
+            if (streq(command, "STREAM DELIVER")) {
+                return Command::Stream;
+            }
+            return streq(command, "SERVICE DELIVER") ? Command::Service : Command::Unknown;
+        default:
+            return Command::Unknown;
+    }
+}
+
+static bool isPattern(const std::string& subject)
+{
+    return subject.find_first_of(".^$|()[]{}*+?\\") != std::string::npos;
+}
+
+void MlmAgent::setHandler(std::unordered_map<std::string, std::unique_ptr<MessageHandler>>& exact,
+    const std::string& subject, MessageHandler&& handler)
+{
+    auto it = exact.find(subject);
+    if (it != exact.end()) {
+        // the handler may be the one running
+        m_retiredHandlers.push_back(std::move(it->second));
+        if (handler) {
+            it->second.reset(new MessageHandler(std::move(handler)));
+        } else {
+            exact.erase(it);
+        }
+    } else if (handler) {
+        exact.emplace(subject, std::unique_ptr<MessageHandler>(new MessageHandler(std::move(handler))));
+    }
+}
+
+void MlmAgent::onMailbox(const std::string& subject, MessageHandler handler)
+{
+    setHandler(m_mailboxHandlers.exact, subject, std::move(handler));
+}
+
+void MlmAgent::onStream(const std::string& stream, const std::string& subjectPattern, MessageHandler handler)
+{
+    auto table = std::find_if(m_streamHandlers.begin(), m_streamHandlers.end(), [&](const StreamTable& it) {
+        return it.stream == stream;
+    });
+    if (table == m_streamHandlers.end()) {
+        if (!handler) {
+            return;
+        }
+        m_streamHandlers.push_back({stream, {}});
+        table = m_streamHandlers.end() - 1;
+    }
+    SubjectTable& subjects = table->subjects;
+
+    if (!isPattern(subjectPattern)) {
+        setHandler(subjects.exact, subjectPattern, std::move(handler));
+    } else {
+        auto it = std::find_if(
+            subjects.patterns.begin(), subjects.patterns.end(), [&](const std::unique_ptr<Pattern>& p) {
+                return p->source == subjectPattern;
+            });
+        if (it != subjects.patterns.end()) {
+            // the handler may be the one running: replaced by a new pattern, keeping the compiled regex
+            std::unique_ptr<Pattern> retired = std::move(*it);
+            if (handler) {
+                it->reset(new Pattern{retired->source, retired->regex, std::move(handler)});
+            } else {
+                subjects.patterns.erase(it);
+            }
+            m_retiredPatterns.push_back(std::move(retired));
+        } else if (handler) {
+            // throws std::regex_error on an invalid pattern
+            subjects.patterns.emplace_back(new Pattern{subjectPattern, std::regex(subjectPattern), std::move(handler)});
+        }
+    }
+
+    if (subjects.exact.empty() && subjects.patterns.empty()) {
+        m_streamHandlers.erase(table);
+    }
+}
+
+MlmAgent::Command MlmAgent::command()
+{
+    return m_current ? m_current->command : m_command;
+}
+
+const char* MlmAgent::sender()
+{
+    return m_current ? m_current->sender.c_str() : mlm_client_sender(m_client);
+}
+
+const char* MlmAgent::subject()
+{
+    return m_current ? m_current->subject.c_str() : mlm_client_subject(m_client);
+}
+
+const char* MlmAgent::address()
+{
+    return m_current ? m_current->address.c_str() : mlm_client_address(m_client);
 }
 
 bool MlmAgent::handlePipe(zmsg_t* message)
@@ -139,8 +1183,15 @@ bool MlmAgent::handlePipe(zmsg_t* message)
 
 zpoller_t* MlmAgent::zpoller(void)
 {
+    if (m_zpollerDirty) {
+        zpoller_destroy(&m_defaultZpoller);
+        m_zpollerDirty = false;
+    }
     if (!m_defaultZpoller) {
         m_defaultZpoller = zpoller_new(m_pipe, mlm_client_msgpipe(m_client), nullptr);
+        for (const auto& it : m_sockets) {
+            zpoller_add(m_defaultZpoller, it.first);
+        }
     }
     return m_defaultZpoller;
 }
@@ -0,0 +1,96 @@
+/*  =========================================================================
+    fty_common_mlm_agent_group - Runtime running the shards of a malamute agent
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    fty_common_mlm_agent_group - Runtime running the shards of a malamute agent
+@discuss
+@end
+*/
+
+#include "fty_common_mlm_agent_group.h"
+#include "fty_common_mlm_guards.h"
+#include <fty_log.h>
+#include <stdexcept>
+
+namespace mlm {
+
+MlmAgentGroup::MlmAgentGroup(size_t shards, Factory factory, const std::string& name)
+    : m_factory(std::move(factory))
+    , m_name(name)
+{
+    if (!m_factory) {
+        throw std::invalid_argument("Can't create an agent group without factory");
+    }
+
+    // the actors keep a pointer on their shard
+    m_shards.reserve(shards);
+    for (size_t index = 0; index < shards; index++) {
+        m_shards.push_back({this, index, nullptr});
+        m_shards.back().actor = zactor_new(shardActor, &m_shards.back());
+    }
+}
+
+MlmAgentGroup::~MlmAgentGroup()
+{
+    stop();
+}
+
+void MlmAgentGroup::stop()
+{
+    // send all the $TERM first, so that the shards stop in parallel
+    for (Shard& shard : m_shards) {
+        if (shard.actor != nullptr) {
+            zstr_send(shard.actor, "$TERM");
+        }
+    }
+    for (Shard& shard : m_shards) {
+        zactor_destroy(&shard.actor);
+    }
+}
+
+void MlmAgentGroup::shardActor(zsock_t* pipe, void* args)
+{
+    Shard*             shard = static_cast<Shard*>(args);
+    const std::string& name  = shard->group->m_name;
+
+    try {
+        std::unique_ptr<MlmAgent> agent = shard->group->m_factory(pipe, shard->index);
+        if (agent) {
+            agent->mainloop();
+            return;
+        }
+        log_error("<%s> No agent for shard %zu", name.c_str(), shard->index);
+    } catch (std::exception& e) {
+        log_error("<%s> Can't start shard %zu: %s", name.c_str(), shard->index, e.what());
+    }
+
+    // unblock zactor_new() then wait for stop()
+    zsock_signal(pipe, 0);
+    while (!zsys_interrupted) {
+        ZstrGuard command(zstr_recv(pipe));
+        if (command == nullptr || streq(command, "$TERM")) {
+            break;
+        }
+    }
+}
+
+} // namespace mlm
@@ -28,6 +28,8 @@
 
 #include "fty_common_mlm_basic_mailbox_server.h"
 #include "fty_common_mlm_guards.h"
+#include "fty_common_mlm_shared_payload.h"
+#include "fty_common_mlm_utils.h"
 #include <fty_log.h>
 #include <stdexcept>
 
@@ -47,20 +49,150 @@ MlmBasicMailboxServer::MlmBasicMailboxServer(
     connect(m_endpoint.c_str(), m_name.c_str());
 }
 
+MlmBasicMailboxServer::~MlmBasicMailboxServer()
+{
+    setDirectEndpoint("");
+}
+
+void MlmBasicMailboxServer::setDirectEndpoint(const std::string& endpoint)
+{
+    if (m_direct != nullptr) {
+        unregisterSocket(m_direct);
+        zsock_destroy(&m_direct);
+        m_directEndpoint.clear();
+    }
+    if (endpoint.empty()) {
+        return;
+    }
+
+    m_direct = zsock_new_router(nullptr);
+    if (m_direct == nullptr || zsock_bind(m_direct, "%s", endpoint.c_str()) == -1) {
+        zsock_destroy(&m_direct);
+        log_error("<%s> Can't bind the direct channel %s", m_name.c_str(), endpoint.c_str());
+        throw std::runtime_error("Can't bind direct channel");
+    }
+    // the endpoint actually bound, for the wildcards
+    m_directEndpoint = zsock_endpoint(m_direct);
+    registerSocket(m_direct, [this](zmsg_t* message) {
+        return handleDirect(message);
+    });
+    log_info("<%s> Serving requests on %s", m_name.c_str(), m_directEndpoint.c_str());
+}
+
+void MlmBasicMailboxServer::setDuplicateSuppression(size_t capacity, int64_t window)
+{
+    m_recentCapacity = capacity;
+    m_recentWindow   = window;
+    purgeRecentReplies(zclock_mono());
+}
+
+void MlmBasicMailboxServer::setShutdownReply(const fty::Payload& payload)
+{
+    m_shutdownReply = payload;
+}
+
+void MlmBasicMailboxServer::setSharedMemory(size_t threshold, std::chrono::milliseconds ttl)
+{
+    m_sharedThreshold = threshold;
+    m_sharedTtl       = ttl;
+}
+
+void MlmBasicMailboxServer::purgeRecentReplies(int64_t now)
+{
+    // same window for all the entries: the oldest ones expire first
+    while (!m_recentReplies.empty() &&
+           (m_recentReplies.size() > m_recentCapacity || m_recentReplies.front().time + m_recentWindow <= now)) {
+        m_recentIndex.erase(m_recentReplies.front().key);
+        m_recentReplies.pop_front();
+    }
+}
+
+void MlmBasicMailboxServer::sendReply(
+    const std::string& address, const std::string& correlationId, const Payload& results)
+{
+    // send the result if it's not empty
+    if (results.empty()) {
+        return;
+    }
+
+    zmsg_t* reply = zmsg_new();
+
+    zmsg_addstr(reply, correlationId.c_str());
+
+    for (const std::string& result : results) {
+        zmsg_addstr(reply, result.c_str());
+    }
+
+    MlmSharedPayload::share(reply, 1, m_sharedThreshold, m_sharedTtl);
+
+    if (m_directRoute != nullptr) {
+        zframe_t* route = zframe_dup(m_directRoute);
+        zmsg_prepend(reply, &route);
+        if (zmsg_send(&reply, m_direct) != 0) {
+            log_error("<%s> failed to send direct reply to %s ", m_name.c_str(), address.c_str());
+        }
+        return;
+    }
+
+    int rv = sendto(address, "REPLY", &reply);
+    if (rv != 0) {
+        log_error("<%s> s_handle_mailbox: failed to send reply to %s ", m_name.c_str(), address.c_str());
+    }
+}
+
 bool MlmBasicMailboxServer::handleMailbox(zmsg_t* message)
+{
+    handleRequest(subject(), sender(), message);
+    return true;
+}
+
+bool MlmBasicMailboxServer::handleDirect(zmsg_t* message)
+{
+    // [route][unique sender][correlation id][payload...]
+    zframe_t* route = zmsg_pop(message);
+    ZstrGuard uniqueSender(zmsg_popstr(message));
+    if (route == nullptr || uniqueSender == nullptr) {
+        log_warning("<%s> Received a direct request without sender, ignoring", m_name.c_str());
+        zframe_destroy(&route);
+        return true;
+    }
+
+    m_directRoute = route;
+    if (draining()) {
+        rejectRequest(uniqueSender.get(), message);
+    } else {
+        handleRequest("REQUEST", uniqueSender.get(), message);
+    }
+    m_directRoute = nullptr;
+    zframe_destroy(&route);
+    return true;
+}
+
+void MlmBasicMailboxServer::handleRequest(const Subject& subject, const Sender& uniqueSender, zmsg_t* message)
 {
     std::string correlationId;
 
     // try to address the request
     try {
-        Subject subject(mlm_client_subject(client()));
-        Sender  uniqueSender(mlm_client_sender(client()));
+        // a client opting in for the direct channel: its endpoint, empty if none
+        if (subject == "CHANNEL") {
+            ZstrGuard channelId(zmsg_popstr(message));
+            if (channelId != nullptr) {
+                sendReply(uniqueSender, channelId.get(), {m_directEndpoint});
+            }
+            return;
+        }
 
         // ignore none "REQUEST" message
         if (subject != "REQUEST") {
             log_warning("<%s> Received mailbox message with subject '%s' from '%s', ignoring", m_name.c_str(),
                 subject.c_str(), uniqueSender.c_str());
-            return true;
+            return;
+        }
+
+        // a large payload comes as a descriptor, this server is its only reader
+        if (!MlmSharedPayload::fetch(message, 1, true)) {
+            throw std::runtime_error("<" + m_name + "> Shared memory of the request is unreadable");
         }
 
         // Get number of frame all the frame
@@ -97,27 +229,34 @@ bool MlmBasicMailboxServer::handleMailbox(zmsg_t* message)
             throw std::runtime_error("<" + m_name + "> Correlation id frame is empty");
         }
 
+        // a retry of a request already handled gets the same reply
+        std::string key;
+        if (m_recentCapacity > 0) {
+            purgeRecentReplies(zclock_mono());
+
+            key = uniqueSender + '\n' + correlationId;
+
+            auto recent = m_recentIndex.find(key);
+            if (recent != m_recentIndex.end()) {
+                log_debug("<%s> Duplicate request '%s' from '%s', replaying the reply", m_name.c_str(),
+                    correlationId.c_str(), uniqueSender.c_str());
+                sendReply(uniqueSender, correlationId, recent->second->results);
+                return;
+            }
+        }
+
         // extract the sender from unique sender id: <Sender>.[thread id in hexa]
         Sender sender = uniqueSender.substr(0, (uniqueSender.size() - (sizeof(pid_t) * 2) - 1));
 
         // Execute the request
         Payload results = m_server.handleRequest(sender, payload);
 
-        // send the result if it's not empty
-        if (!results.empty()) {
-            zmsg_t* reply = zmsg_new();
-
-            zmsg_addstr(reply, correlationId.c_str());
+        sendReply(uniqueSender, correlationId, results);
 
-            for (const std::string& result : results) {
-                zmsg_addstr(reply, result.c_str());
-            }
-
-            int rv = mlm_client_sendto(client(), mlm_client_sender(client()), "REPLY", nullptr, 1000, &reply);
-            if (rv != 0) {
-                log_error(
-                    "<%s> s_handle_mailbox: failed to send reply to %s ", m_name.c_str(), mlm_client_sender(client()));
-            }
+        if (m_recentCapacity > 0) {
+            m_recentReplies.push_back({key, zclock_mono(), std::move(results)});
+            m_recentIndex[key] = std::prev(m_recentReplies.end());
+            purgeRecentReplies(zclock_mono());
         }
 
     } catch (std::exception& e) {
@@ -126,10 +265,47 @@ bool MlmBasicMailboxServer::handleMailbox(zmsg_t* message)
     {
         log_error("<%s> Unexpected error: unknown", m_name.c_str());
     }
+}
 
+bool MlmBasicMailboxServer::rejectMailbox(zmsg_t* message)
+{
+    if (streq(subject(), "REQUEST")) {
+        rejectRequest(sender(), message);
+    } else if (streq(subject(), "CHANNEL")) {
+        // no direct channel anymore: the client goes on with the mailbox without waiting for its timeout
+        ZstrGuard channelId(zmsg_popstr(message));
+        if (channelId != nullptr) {
+            sendReply(sender(), channelId.get(), {""});
+        }
+    }
     return true;
 }
 
+void MlmBasicMailboxServer::rejectRequest(const Sender& uniqueSender, zmsg_t* message)
+{
+    if (m_shutdownReply.empty()) {
+        return;
+    }
+
+    ZstrGuard correlationId(zmsg_popstr(message));
+    if (correlationId != nullptr && *correlationId != '\0') {
+        log_debug("<%s> Rejecting request '%s' from '%s', shutting down", m_name.c_str(), correlationId.get(),
+            uniqueSender.c_str());
+        sendReply(uniqueSender, correlationId.get(), m_shutdownReply);
+    }
+}
+
+MlmBasicMailboxServerGroup::MlmBasicMailboxServerGroup(
+    fty::SyncServer& server, const std::string& name, size_t shards, const std::string& endpoint)
+    : m_group(shards,
+          [&server, name, endpoint](zsock_t* pipe, size_t shard) {
+              return std::unique_ptr<MlmAgent>(
+                  new MlmBasicMailboxServer(pipe, server, MlmUtils::shardName(name, shard), endpoint));
+          },
+          name)
+{
+}
+
 } // namespace mlm
 
 #if 0
@@ -0,0 +1,952 @@
+/*  =========================================================================
+    fty_common_mlm_connection_manager - Broker sessions shared by the clients of a process
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    fty_common_mlm_connection_manager - Broker sessions shared by the clients of a process
+@discuss
+@end
+*/
+
+#include "fty_common_mlm_connection_manager.h"
+#include "fty_common_mlm_guards.h"
+#include "fty_common_mlm_local_registry.h"
+#include "fty_common_mlm_utils.h"
+#include <algorithm>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <fty_log.h>
+#include <iomanip>
+#include <malamute.h>
+#include <regex>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace mlm {
+
+class MlmConnectionManager::Session
+{
+public:
+    Session(const std::string& endpoint, const std::string& name, uint32_t timeout, LocalDelivery local);
+    ~Session();
+
+    Session(const Session&) = delete;
+    Session& operator=(const Session&) = delete;
+
+    // connects the session, or waits for the user connecting it
+    // throw std::runtime_error when it can't connect
+    void start();
+
+    zmsg_t* requestReply(const std::string& address, const std::string& subject, const std::string& correlationId,
+        zmsg_t** request, uint32_t timeout, Clock::time_point deadline);
+    void    publish(const std::string& stream, const std::string& subject, zmsg_t** message);
+    void    subscribe(uint64_t id, const std::string& stream, const std::string& pattern, StreamHandler handler);
+    void    unsubscribe(uint64_t id);
+
+    // stops receiving, the requests waiting fail; not from the thread of the session, see onDispatcher()
+    void close();
+
+    // true if called by the thread of the session (a handler), which can't wait for itself to stop
+    bool onDispatcher() const
+    {
+        return std::this_thread::get_id() == m_dispatcherThread;
+    }
+
+    const std::string& endpoint() const
+    {
+        return m_endpoint;
+    }
+
+    const std::string& name() const
+    {
+        return m_name;
+    }
+
+    // calls in progress and subscriptions, guarded by the m_mutex of the manager
+    unsigned uses = 0;
+
+private:
+    // liveness probes and reconnections of the dispatcher, in ms
+    static constexpr int64_t CHECK_INTERVAL = 2000;
+
+    struct Waiter
+    {
+        std::condition_variable cond;
+        zmsg_t*                 reply = nullptr;
+    };
+
+    struct Subscription
+    {
+        std::string   stream;
+        std::regex    pattern;
+        StreamHandler handler;
+    };
+
+    // call on m_client, run by the dispatcher for the other threads
+    struct Command
+    {
+        enum class Type
+        {
+            Send,
+            Publish,
+            Consume
+        };
+
+        Type        type;
+        std::string address; // mailbox or stream
+        std::string subject; // pattern of Consume
+        zmsg_t**    message = nullptr;
+        uint32_t    timeout = 0;
+
+        std::condition_variable cond;
+        bool                    done = false;
+        int                     rv   = -1;
+        std::string             error;
+    };
+
+    // queues command for the dispatcher and waits for it, the message is consumed
+    int  execute(Command& command);
+    void run(Command& command);
+    void runCommands();
+
+    static void dispatcher(zsock_t* pipe, void* args);
+    void        receive();
+    void        dispatch(const std::string& command, const std::string& sender, const std::string& subject,
+               const std::string& address, zmsg_t* message);
+    // hands a reply to its request, false (message not taken) if none waits for it
+    bool deliverReply(zmsg_t* message);
+
+    // the broker went away (restart...) or forgot the registrations, see sendProbe()
+    void checkConnection();
+    bool ensureConnected();
+    bool reconnect();
+    void sendProbe();
+
+    std::string     m_endpoint;
+    std::string     m_name;
+    std::string     m_address;
+    uint32_t        m_timeout;
+    zactor_t*       m_dispatcher = nullptr;
+    std::thread::id m_dispatcherThread;
+
+    // deliveries of the local registry, unless Off
+    LocalDelivery                  m_local;
+    std::unique_ptr<MlmLocalInbox> m_inbox;
+
+    enum class State
+    {
+        Idle,
+        Starting,
+        Started,
+        Failed
+    };
+    std::mutex              m_startMutex;
+    std::condition_variable m_startCond;
+    State                   m_state = State::Idle;
+    std::string             m_startError;
+
+    // owned by the dispatcher once started
+    mlm_client_t*                                 m_client = nullptr;
+    zpoller_t*                                    m_poller = nullptr;
+    std::string                                   m_producer;
+    std::set<std::pair<std::string, std::string>> m_consumed;
+    std::vector<uint64_t>                         m_localConsumers;
+    std::string                                   m_probeService;
+    uint64_t                                      m_probeSent     = 0;
+    uint64_t                                      m_probeReceived = 0;
+
+    // commands of the other threads, the dispatcher is woken up through its pipe
+    std::mutex           m_commandsMutex;
+    std::deque<Command*> m_commands;
+    bool                 m_stopped = false;
+
+    // requests waiting for their reply, by correlation id
+    std::mutex                     m_waitersMutex;
+    std::map<std::string, Waiter*> m_waiters;
+    bool                           m_closed = false;
+
+    std::mutex                       m_subscriptionsMutex;
+    std::map<uint64_t, Subscription> m_subscriptions;
+};
+
+MlmConnectionManager::Session::Session(
+    const std::string& endpoint, const std::string& name, uint32_t timeout, LocalDelivery local)
+    : m_endpoint(endpoint)
+    , m_name(name)
+    , m_timeout(timeout)
+    , m_local(local)
+{
+    m_address = MlmConnectionManager::address(name);
+}
+
+MlmConnectionManager::Session::~Session()
+{
+    close();
+}
+
+void MlmConnectionManager::Session::start()
+{
+    std::unique_lock<std::mutex> lock(m_startMutex);
+    if (m_state == State::Idle) {
+        // connected by the first user, out of the locks: it may take up to the timeout
+        m_state = State::Starting;
+        lock.unlock();
+
+        m_client = mlm_client_new();
+        if (m_client == nullptr) {
+            m_startError = "Malamute error: NULL client pointer";
+        } else if (mlm_client_connect(m_client, m_endpoint.c_str(), m_timeout, m_address.c_str()) != 0) {
+            mlm_client_destroy(&m_client);
+            m_startError = "Malamute error: Error connecting to endpoint <" + m_endpoint + ">";
+        } else if (m_local != LocalDelivery::Off) {
+            try {
+                m_inbox.reset(new MlmLocalInbox());
+            } catch (const std::exception& e) {
+                mlm_client_destroy(&m_client);
+                m_startError = e.what();
+            }
+        }
+
+        if (m_client != nullptr) {
+            // the client belongs to the dispatcher from now on
+            m_dispatcher = zactor_new(dispatcher, this);
+            if (m_inbox) {
+                // the streams are mirrored: their local consumers drop the copies of the broker
+                MlmLocalRegistry::instance().addMailbox(m_endpoint, m_address, m_inbox.get(), true);
+            }
+        }
+
+        lock.lock();
+        m_state = m_startError.empty() ? State::Started : State::Failed;
+        m_startCond.notify_all();
+    } else {
+        m_startCond.wait(lock, [this]() {
+            return m_state != State::Starting;
+        });
+    }
+
+    if (m_state == State::Failed) {
+        throw std::runtime_error(m_startError);
+    }
+}
+
+void MlmConnectionManager::Session::close()
+{
+    if (onDispatcher()) {
+        // zactor_destroy() would wait for this very thread
+        log_error("<%s> Session closed by its own thread, ignored", m_address.c_str());
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_commandsMutex);
+        m_stopped = true;
+    }
+    // the commands queued meanwhile fail
+    zactor_destroy(&m_dispatcher);
+
+    if (m_inbox) {
+        MlmLocalRegistry& registry = MlmLocalRegistry::instance();
+        registry.removeMailbox(m_endpoint, m_address, m_inbox.get());
+        for (uint64_t consumer : m_localConsumers) {
+            registry.removeConsumer(consumer);
+        }
+        m_localConsumers.clear();
+    }
+
+    std::lock_guard<std::mutex> lock(m_waitersMutex);
+    m_closed = true;
+    for (auto& it : m_waiters) {
+        it.second->cond.notify_one();
+    }
+}
+
+zmsg_t* MlmConnectionManager::Session::requestReply(const std::string& address, const std::string& subject,
+    const std::string& correlationId, zmsg_t** request, uint32_t timeout, Clock::time_point deadline)
+{
+    // waiting before sending: the reply may come before the send returns
+    Waiter waiter;
+    {
+        std::lock_guard<std::mutex> lock(m_waitersMutex);
+        if (m_closed) {
+            zmsg_destroy(request);
+            return nullptr;
+        }
+        m_waiters[correlationId] = &waiter;
+    }
+
+    int rv = 0;
+    if (!m_inbox || !MlmLocalRegistry::instance().sendto(m_endpoint, m_address, address, subject, request)) {
+        Command command;
+        command.type    = Command::Type::Send;
+        command.address = address;
+        command.subject = subject;
+        command.message = request;
+        command.timeout = timeout;
+        rv              = execute(command);
+    }
+
+    std::unique_lock<std::mutex> lock(m_waitersMutex);
+    if (rv != 0) {
+        log_error("<%s> Failed to send request '%s' to '%s'", m_address.c_str(), correlationId.c_str(),
+            address.c_str());
+    } else {
+        while (waiter.reply == nullptr && !m_closed && !zsys_interrupted) {
+            Clock::time_point now = Clock::now();
+            if (now >= deadline) {
+                break;
+            }
+            // zsys_interrupted is checked every second
+            waiter.cond.wait_for(lock, std::min<Clock::duration>(deadline - now, std::chrono::seconds(1)));
+        }
+    }
+    m_waiters.erase(correlationId);
+    return waiter.reply;
+}
+
+void MlmConnectionManager::Session::publish(const std::string& stream, const std::string& subject, zmsg_t** message)
+{
+    if (m_inbox) {
+        // the broker gets it as well, for its consumers out of the process
+        MlmLocalRegistry::instance().publish(m_endpoint, m_address, stream, subject, *message);
+    }
+
+    Command command;
+    command.type    = Command::Type::Publish;
+    command.address = stream;
+    command.subject = subject;
+    command.message = message;
+    if (execute(command) != 0) {
+        throw std::runtime_error(command.error);
+    }
+}
+
+void MlmConnectionManager::Session::subscribe(
+    uint64_t id, const std::string& stream, const std::string& pattern, StreamHandler handler)
+{
+    // before consuming, not to miss the first messages
+    {
+        std::lock_guard<std::mutex> lock(m_subscriptionsMutex);
+        m_subscriptions.emplace(id, Subscription{stream, std::regex(pattern), std::move(handler)});
+    }
+
+    Command command;
+    command.type    = Command::Type::Consume;
+    command.address = stream;
+    command.subject = pattern;
+    if (execute(command) != 0) {
+        unsubscribe(id);
+        throw std::runtime_error(command.error);
+    }
+}
+
+void MlmConnectionManager::Session::unsubscribe(uint64_t id)
+{
+    // waits for the handler if it is running
+    std::lock_guard<std::mutex> lock(m_subscriptionsMutex);
+    m_subscriptions.erase(id);
+}
+
+int MlmConnectionManager::Session::execute(Command& command)
+{
+    // from a handler of the session: the dispatcher is busy running it
+    if (std::this_thread::get_id() == m_dispatcherThread) {
+        run(command);
+        return command.rv;
+    }
+
+    std::unique_lock<std::mutex> lock(m_commandsMutex);
+    if (m_stopped) {
+        if (command.message != nullptr) {
+            zmsg_destroy(command.message);
+        }
+        command.error = "Malamute error: Session <" + m_address + "> closed";
+        return -1;
+    }
+    m_commands.push_back(&command);
+    // the dispatcher takes all the commands queued at once
+    if (m_commands.size() == 1) {
+        zstr_send(m_dispatcher, "COMMAND");
+    }
+    command.cond.wait(lock, [&command]() {
+        return command.done;
+    });
+    return command.rv;
+}
+
+void MlmConnectionManager::Session::run(Command& command)
+{
+    if (!ensureConnected()) {
+        if (command.message != nullptr) {
+            zmsg_destroy(command.message);
+        }
+        command.error = "Malamute error: Error connecting to endpoint <" + m_endpoint + ">";
+        return;
+    }
+
+    switch (command.type) {
+        case Command::Type::Send:
+            command.rv = mlm_client_sendto(m_client, command.address.c_str(), command.subject.c_str(), nullptr,
+                command.timeout, command.message);
+            break;
+
+        case Command::Type::Publish:
+            // a session produces a stream at once
+            if (m_producer != command.address) {
+                if (mlm_client_set_producer(m_client, command.address.c_str()) != 0) {
+                    command.error =
+                        "Malamute error: Impossible to become publisher of stream <" + command.address + ">";
+                    break;
+                }
+                m_producer = command.address;
+            }
+            command.rv = mlm_client_send(m_client, command.subject.c_str(), command.message);
+            if (command.rv != 0) {
+                command.error = "Malamute error: Impossible to publish on stream <" + command.address + ">";
+            }
+            break;
+
+        case Command::Type::Consume:
+            if (m_consumed.count({command.address, command.subject}) != 0) {
+                command.rv = 0;
+                break;
+            }
+            command.rv = mlm_client_set_consumer(m_client, command.address.c_str(), command.subject.c_str());
+            if (command.rv != 0) {
+                command.error = "Malamute error: Impossible to become consumer of stream <" + command.address + ">";
+                break;
+            }
+            m_consumed.emplace(command.address, command.subject);
+            if (m_inbox) {
+                m_localConsumers.push_back(MlmLocalRegistry::instance().addConsumer(
+                    m_endpoint, command.address, command.subject, m_inbox.get()));
+            }
+            break;
+    }
+
+    if (command.message != nullptr) {
+        zmsg_destroy(command.message);
+    }
+}
+
+void MlmConnectionManager::Session::runCommands()
+{
+    std::deque<Command*> commands;
+    {
+        std::lock_guard<std::mutex> lock(m_commandsMutex);
+        commands.swap(m_commands);
+    }
+    for (Command* command : commands) {
+        run(*command);
+        // notified under the lock: the caller owns the command and returns as soon as it sees it done
+        std::lock_guard<std::mutex> lock(m_commandsMutex);
+        command->done = true;
+        command->cond.notify_one();
+    }
+}
+
+void MlmConnectionManager::Session::dispatcher(zsock_t* pipe, void* args)
+{
+    Session* session            = static_cast<Session*>(args);
+    session->m_dispatcherThread = std::this_thread::get_id();
+
+    ZpollerGuard poller(zpoller_new(pipe, mlm_client_msgpipe(session->m_client), nullptr));
+    if (session->m_inbox) {
+        zpoller_add(poller, session->m_inbox->socket());
+    }
+    session->m_poller = poller;
+
+    zsock_signal(pipe, 0);
+    int64_t nextCheck = zclock_mono() + CHECK_INTERVAL;
+    while (!zsys_interrupted) {
+        void* which = zpoller_wait(poller, int(std::max<int64_t>(nextCheck - zclock_mono(), 0)));
+        if (which == pipe) {
+            ZstrGuard command(zstr_recv(pipe));
+            if (command == nullptr || streq(command, "$TERM")) {
+                break;
+            }
+            session->runCommands();
+        } else if (session->m_inbox && which == session->m_inbox->socket()) {
+            zmsg_t*                 message = zmsg_recv(which);
+            MlmLocalInbox::Envelope envelope;
+            if (message != nullptr && MlmLocalInbox::open(message, envelope)) {
+                session->dispatch(envelope.command, envelope.sender, envelope.subject, envelope.address, message);
+            } else {
+                zmsg_destroy(&message);
+            }
+        } else if (which != nullptr) {
+            session->receive();
+        } else if (zpoller_terminated(poller)) {
+            break;
+        }
+
+        // also for the sessions which only consume streams, nothing else would notice
+        if (zclock_mono() >= nextCheck) {
+            session->checkConnection();
+            nextCheck = zclock_mono() + CHECK_INTERVAL;
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(session->m_commandsMutex);
+        session->m_stopped = true;
+        for (Command* command : session->m_commands) {
+            if (command->message != nullptr) {
+                zmsg_destroy(command->message);
+            }
+            command->error = "Malamute error: Session <" + session->m_address + "> closed";
+            command->done  = true;
+            command->cond.notify_one();
+        }
+        session->m_commands.clear();
+    }
+    session->m_poller = nullptr;
+    mlm_client_destroy(&session->m_client);
+}
+
+void MlmConnectionManager::Session::receive()
+{
+    zmsg_t* message = mlm_client_recv(m_client);
+    if (message == nullptr) {
+        return;
+    }
+    const char* command = mlm_client_command(m_client);
+
+    if (streq(command, "SERVICE DELIVER") && !m_probeService.empty() &&
+        m_probeService == mlm_client_address(m_client)) {
+        m_probeReceived = std::max<uint64_t>(m_probeReceived, strtoull(mlm_client_subject(m_client), nullptr, 10));
+        zmsg_destroy(&message);
+        return;
+    }
+    // already received from the local publisher
+    if (m_inbox && streq(command, "STREAM DELIVER") &&
+        MlmLocalRegistry::instance().receivedLocally(m_endpoint, mlm_client_sender(m_client),
+            mlm_client_address(m_client), mlm_client_subject(m_client), message, m_inbox.get())) {
+        zmsg_destroy(&message);
+        return;
+    }
+    dispatch(command, mlm_client_sender(m_client), mlm_client_subject(m_client), mlm_client_address(m_client),
+        message);
+}
+
+void MlmConnectionManager::Session::checkConnection()
+{
+    if (mlm_client_connected(m_client)) {
+        // the previous probe may still be on its way, not the one before unless still to be read
+        if (m_probeReceived + 1 >= m_probeSent || (zsock_events(mlm_client_msgpipe(m_client)) & ZMQ_POLLIN)) {
+            sendProbe();
+            return;
+        }
+        log_warning("<%s> <%s> forgot the registrations (restarted), restoring them", m_address.c_str(),
+            m_endpoint.c_str());
+    } else {
+        log_warning("<%s> Connection to <%s> lost, reconnecting", m_address.c_str(), m_endpoint.c_str());
+    }
+    reconnect();
+}
+
+bool MlmConnectionManager::Session::ensureConnected()
+{
+    if (mlm_client_connected(m_client)) {
+        return true;
+    }
+    log_warning("<%s> Connection to <%s> lost, reconnecting", m_address.c_str(), m_endpoint.c_str());
+    return reconnect();
+}
+
+bool MlmConnectionManager::Session::reconnect()
+{
+    // mlm_client_t may have reconnected by itself, but the broker forgot the registrations anyway
+    if (!mlm_client_connected(m_client)) {
+        mlm_client_t* client = mlm_client_new();
+        if (client == nullptr) {
+            log_error("mlm_client_new() failed.");
+            return false;
+        }
+        zpoller_remove(m_poller, mlm_client_msgpipe(m_client));
+        mlm_client_destroy(&m_client);
+        m_client = client;
+        zpoller_add(m_poller, mlm_client_msgpipe(m_client));
+
+        if (mlm_client_connect(m_client, m_endpoint.c_str(), m_timeout, m_address.c_str()) != 0) {
+            log_error("<%s> Error connecting to endpoint <%s>", m_address.c_str(), m_endpoint.c_str());
+            return false;
+        }
+    }
+
+    // restored by the next publication
+    m_producer.clear();
+    bool rv = true;
+    for (const auto& it : m_consumed) {
+        if (mlm_client_set_consumer(m_client, it.first.c_str(), it.second.c_str()) != 0) {
+            log_error("<%s> Impossible to consume stream <%s> again", m_address.c_str(), it.first.c_str());
+            rv = false;
+        }
+    }
+    if (!m_probeService.empty() && mlm_client_set_worker(m_client, m_probeService.c_str(), ".*") != 0) {
+        log_error("<%s> Can't restore the liveness service", m_address.c_str());
+        rv = false;
+    }
+    // the probes sent meanwhile may never come back
+    m_probeReceived = m_probeSent;
+    if (rv) {
+        log_info("<%s> Reconnected to <%s>", m_address.c_str(), m_endpoint.c_str());
+    }
+    return rv;
+}
+
+void MlmConnectionManager::Session::sendProbe()
+{
+    // a worker registration is forgotten by a restarted broker, the probes then stay in the service queue
+    if (m_probeService.empty()) {
+        m_probeService = "$liveness/" + m_address;
+        if (mlm_client_set_worker(m_client, m_probeService.c_str(), ".*") != 0) {
+            log_error("<%s> Can't register the liveness service", m_address.c_str());
+            m_probeService.clear();
+            return;
+        }
+    }
+    zmsg_t* probe = zmsg_new();
+    if (mlm_client_sendfor(m_client, m_probeService.c_str(), std::to_string(++m_probeSent).c_str(), nullptr, 0,
+            &probe) != 0) {
+        zmsg_destroy(&probe);
+    }
+}
+
+void MlmConnectionManager::Session::dispatch(const std::string& command, const std::string& sender,
+    const std::string& subject, const std::string& address, zmsg_t* message)
+{
+    if (command == "MAILBOX DELIVER") {
+        if (!deliverReply(message)) {
+            // expired, or not a reply
+            log_debug(
+                "<%s> Dropping mailbox message '%s' from '%s'", m_address.c_str(), subject.c_str(), sender.c_str());
+            zmsg_destroy(&message);
+        }
+        return;
+    }
+
+    ZmsgGuard msg(message);
+    if (command == "STREAM DELIVER") {
+        const std::string& stream = address;
+
+        std::lock_guard<std::mutex> lock(m_subscriptionsMutex);
+        for (auto& it : m_subscriptions) {
+            Subscription& subscription = it.second;
+            if (subscription.stream != stream || !std::regex_search(subject, subscription.pattern)) {
+                continue;
+            }
+            try {
+                subscription.handler(subject, msg);
+            } catch (std::exception& e) { // Show Must Go On => Log errors and continue
+                log_error("<%s> Error in the handler of stream '%s': %s", m_address.c_str(), stream.c_str(), e.what());
+            } catch (...) {
+                log_error("<%s> Error in the handler of stream '%s': unknown", m_address.c_str(), stream.c_str());
+            }
+        }
+    }
+}
+
+bool MlmConnectionManager::Session::deliverReply(zmsg_t* message)
+{
+    zframe_t* frame = zmsg_first(message);
+    if (frame == nullptr) {
+        return false;
+    }
+    std::string correlationId(reinterpret_cast<const char*>(zframe_data(frame)), zframe_size(frame));
+
+    std::lock_guard<std::mutex> lock(m_waitersMutex);
+    auto                        it = m_waiters.find(correlationId);
+    if (it == m_waiters.end() || it->second->reply != nullptr) {
+        return false;
+    }
+    it->second->reply = message;
+    it->second->cond.notify_one();
+    return true;
+}
+
+std::string MlmConnectionManager::address(const std::string& name)
+{
+    // unique in the process: <name>.[pid in hexa]
+    std::stringstream ss;
+    ss << name << "." << std::setfill('0') << std::setw(sizeof(pid_t) * 2) << std::hex << getpid();
+    return ss.str();
+}
+
+MlmConnectionManager& MlmConnectionManager::instance()
+{
+    static MlmConnectionManager manager;
+    return manager;
+}
+
+MlmConnectionManager::MlmConnectionManager()
+{
+    // czmq shuts down at exit after the sessions left are closed, see reset()
+    zsys_init();
+}
+
+MlmConnectionManager::~MlmConnectionManager()
+{
+    reset();
+}
+
+std::shared_ptr<MlmConnectionManager::Session> MlmConnectionManager::session(
+    const std::string& endpoint, const std::string& name, uint32_t timeout)
+{
+    auto                     key = std::make_pair(endpoint, name);
+    std::shared_ptr<Session> s;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto                        it = m_sessions.find(key);
+        if (it == m_sessions.end()) {
+            it = m_sessions.emplace(key, std::make_shared<Session>(endpoint, name, timeout, m_localDelivery)).first;
+        }
+        s = it->second;
+        s->uses++;
+    }
+
+    closeRetired();
+
+    // connected out of the lock, the users of the other sessions don't wait for it
+    try {
+        s->start();
+    } catch (...) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        s->uses--;
+        auto it = m_sessions.find(key);
+        if (it != m_sessions.end() && it->second == s) {
+            m_sessions.erase(it);
+        }
+        throw;
+    }
+    return s;
+}
+
+void MlmConnectionManager::release(const std::shared_ptr<Session>& s)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (--s->uses > 0 || m_users.count(s->name()) != 0) {
+            return;
+        }
+        auto it = m_sessions.find({s->endpoint(), s->name()});
+        // closed by reset() meanwhile
+        if (it == m_sessions.end() || it->second != s) {
+            return;
+        }
+        m_sessions.erase(it);
+    }
+    closeSessions({s});
+}
+
+void MlmConnectionManager::closeSessions(std::vector<std::shared_ptr<Session>> sessions)
+{
+    for (auto& s : sessions) {
+        if (s->onDispatcher()) {
+            // released by one of its handlers: closed by the next call of another thread
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_retired.push_back(s);
+        } else {
+            s->close();
+        }
+    }
+}
+
+void MlmConnectionManager::closeRetired()
+{
+    std::vector<std::shared_ptr<Session>> retired;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_retired.empty()) {
+            return;
+        }
+        retired.swap(m_retired);
+    }
+    // those of the calling thread are put back
+    closeSessions(std::move(retired));
+}
+
+void MlmConnectionManager::attach(const std::string& name)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_users[name]++;
+}
+
+void MlmConnectionManager::detach(const std::string& name)
+{
+    std::vector<std::shared_ptr<Session>> idle;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto                        user = m_users.find(name);
+        if (user == m_users.end() || --user->second > 0) {
+            return;
+        }
+        m_users.erase(user);
+
+        for (auto it = m_sessions.begin(); it != m_sessions.end();) {
+            if (it->first.second == name && it->second->uses == 0) {
+                idle.push_back(it->second);
+                it = m_sessions.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    closeSessions(std::move(idle));
+    closeRetired();
+}
+
+zmsg_t* MlmConnectionManager::requestReply(const std::string& endpoint, const std::string& name,
+    const std::string& address, const std::string& subject, const std::string& correlationId, zmsg_t** request,
+    uint32_t timeout, Clock::time_point deadline)
+{
+    std::shared_ptr<Session> s;
+    try {
+        s = session(endpoint, name, timeout);
+    } catch (...) {
+        zmsg_destroy(request);
+        throw;
+    }
+    zmsg_t* reply = s->requestReply(address, subject, correlationId, request, timeout, deadline);
+    release(s);
+    return reply;
+}
+
+void MlmConnectionManager::publish(const std::string& endpoint, const std::string& name, const std::string& stream,
+    const std::string& subject, zmsg_t** message, uint32_t timeout)
+{
+    std::shared_ptr<Session> s;
+    try {
+        s = session(endpoint, name, timeout);
+    } catch (...) {
+        zmsg_destroy(message);
+        throw;
+    }
+    try {
+        s->publish(stream, subject, message);
+    } catch (...) {
+        release(s);
+        throw;
+    }
+    release(s);
+}
+
+uint64_t MlmConnectionManager::subscribe(const std::string& endpoint, const std::string& name,
+    const std::string& stream, const std::string& pattern, StreamHandler handler, uint32_t timeout)
+{
+    // used by the subscription until unsubscribe()
+    std::shared_ptr<Session> s = session(endpoint, name, timeout);
+
+    uint64_t id;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        id                  = ++m_lastSubscription;
+        m_subscriptions[id] = s;
+    }
+
+    try {
+        s->subscribe(id, stream, pattern, std::move(handler));
+    } catch (...) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_subscriptions.erase(id);
+        }
+        release(s);
+        throw;
+    }
+    return id;
+}
+
+void MlmConnectionManager::unsubscribe(uint64_t subscription)
+{
+    std::shared_ptr<Session> s;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto                        it = m_subscriptions.find(subscription);
+        if (it == m_subscriptions.end()) {
+            return;
+        }
+        s = it->second;
+        m_subscriptions.erase(it);
+    }
+    s->unsubscribe(subscription);
+    release(s);
+}
+
+void MlmConnectionManager::setLocalDelivery(LocalDelivery mode)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_localDelivery = mode;
+}
+
+std::vector<std::string> MlmConnectionManager::brokers(
+    const std::string& key, const std::vector<std::string>& endpoints) const
+{
+    std::vector<std::string> ordered = MlmUtils::rendezvousOrder(key, endpoints);
+    if (ordered.size() <= 1) {
+        return ordered;
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Clock::time_point           now = Clock::now();
+    std::stable_partition(ordered.begin(), ordered.end(), [&](const std::string& endpoint) {
+        auto it = m_unreachable.find(endpoint);
+        return it == m_unreachable.end() || it->second <= now;
+    });
+    return ordered;
+}
+
+void MlmConnectionManager::setUnreachable(const std::string& endpoint)
+{
+    log_warning("Broker <%s> unreachable, failing over", endpoint.c_str());
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_unreachable[endpoint] = Clock::now() + UNREACHABLE_PERIOD;
+}
+
+size_t MlmConnectionManager::sessions() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_sessions.size();
+}
+
+void MlmConnectionManager::reset()
+{
+    std::vector<std::shared_ptr<Session>> sessions;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (auto& it : m_sessions) {
+            sessions.push_back(it.second);
+        }
+        sessions.insert(sessions.end(), m_retired.begin(), m_retired.end());
+        m_sessions.clear();
+        m_retired.clear();
+        m_subscriptions.clear();
+        m_unreachable.clear();
+    }
+    // destroyed by their last user
+    closeSessions(std::move(sessions));
+}
+
+} // namespace mlm
@@ -0,0 +1,250 @@
+/*  =========================================================================
+    fty_common_mlm_local_registry - In-process delivery between co-located clients and agents
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    fty_common_mlm_local_registry - In-process delivery between co-located clients and agents
+@discuss
+@end
+*/
+
+#include "fty_common_mlm_local_registry.h"
+#include "fty_common_mlm_utils.h"
+#include <algorithm>
+#include <atomic>
+#include <fty_log.h>
+#include <stdexcept>
+#include <unistd.h>
+#include <vector>
+
+namespace mlm {
+
+// identifies a stream message among the missed ones
+static uint64_t digest(const MlmLocalInbox::Envelope& envelope, zmsg_t* content)
+{
+    uint64_t hash = MlmUtils::fnv1a(nullptr, 0);
+    for (const std::string* field : {&envelope.sender, &envelope.subject, &envelope.address}) {
+        size_t size = field->size();
+        hash        = MlmUtils::fnv1a(&size, sizeof(size), hash);
+        hash        = MlmUtils::fnv1a(field->data(), size, hash);
+    }
+    for (zframe_t* frame = zmsg_first(content); frame != nullptr; frame = zmsg_next(content)) {
+        size_t size = zframe_size(frame);
+        hash        = MlmUtils::fnv1a(&size, sizeof(size), hash);
+        hash        = MlmUtils::fnv1a(zframe_data(frame), size, hash);
+    }
+    return hash;
+}
+
+MlmLocalInbox::MlmLocalInbox()
+    : m_pull(nullptr)
+    , m_push(nullptr)
+{
+    static std::atomic<uint64_t> lastInbox{0};
+    std::string endpoint = "inproc://mlm-local-" + std::to_string(getpid()) + "-" + std::to_string(++lastInbox);
+
+    m_pull = zsock_new_pull(("@" + endpoint).c_str());
+    if (m_pull != nullptr) {
+        m_push = zsock_new_push((">" + endpoint).c_str());
+    }
+    if (m_push == nullptr) {
+        zsock_destroy(&m_pull);
+        log_error("Can't create the local inbox %s", endpoint.c_str());
+        throw std::runtime_error("Can't create local inbox");
+    }
+    // a full queue makes the senders go through the broker rather than wait
+    zsock_set_sndtimeo(m_push, 0);
+}
+
+MlmLocalInbox::~MlmLocalInbox()
+{
+    zsock_destroy(&m_push);
+    zsock_destroy(&m_pull);
+}
+
+bool MlmLocalInbox::send(const Envelope& envelope, zmsg_t** content)
+{
+    zmsg_pushstr(*content, envelope.address.c_str());
+    zmsg_pushstr(*content, envelope.subject.c_str());
+    zmsg_pushstr(*content, envelope.sender.c_str());
+    zmsg_pushstr(*content, envelope.command.c_str());
+
+    std::lock_guard<std::mutex> lock(m_pushMutex);
+    if (MlmUtils::zmsg_trysend(content, m_push) == 0) {
+        return true;
+    }
+    // not queued, give the content back as it was
+    for (int i = 0; i < 4; i++) {
+        zframe_t* frame = zmsg_pop(*content);
+        zframe_destroy(&frame);
+    }
+    return false;
+}
+
+bool MlmLocalInbox::open(zmsg_t* message, Envelope& envelope)
+{
+    if (zmsg_size(message) < 4) {
+        return false;
+    }
+    std::string* fields[] = {&envelope.command, &envelope.sender, &envelope.subject, &envelope.address};
+    for (std::string* field : fields) {
+        zframe_t* frame = zmsg_pop(message);
+        field->assign(reinterpret_cast<const char*>(zframe_data(frame)), zframe_size(frame));
+        zframe_destroy(&frame);
+    }
+    return true;
+}
+
+void MlmLocalInbox::miss(const Envelope& envelope, zmsg_t* content)
+{
+    uint64_t                    hash = digest(envelope, content);
+    std::lock_guard<std::mutex> lock(m_pushMutex);
+    if (m_missed.size() >= MAX_MISSED) {
+        m_missed.pop_front();
+    }
+    m_missed.push_back(hash);
+}
+
+bool MlmLocalInbox::takeMissed(const Envelope& envelope, zmsg_t* content)
+{
+    uint64_t                    hash = digest(envelope, content);
+    std::lock_guard<std::mutex> lock(m_pushMutex);
+    auto                        it = std::find(m_missed.begin(), m_missed.end(), hash);
+    if (it == m_missed.end()) {
+        return false;
+    }
+    m_missed.erase(it);
+    return true;
+}
+
+MlmLocalRegistry& MlmLocalRegistry::instance()
+{
+    static MlmLocalRegistry registry;
+    return registry;
+}
+
+void MlmLocalRegistry::addMailbox(
+    const std::string& endpoint, const std::string& address, MlmLocalInbox* inbox, bool mirrored)
+{
+    std::unique_lock<std::shared_mutex> lock(m_mutex);
+    m_mailboxes[std::make_pair(endpoint, address)] = Mailbox{inbox, mirrored};
+}
+
+void MlmLocalRegistry::removeMailbox(const std::string& endpoint, const std::string& address, MlmLocalInbox* inbox)
+{
+    std::unique_lock<std::shared_mutex> lock(m_mutex);
+    auto                                it = m_mailboxes.find(std::make_pair(endpoint, address));
+    if (it != m_mailboxes.end() && it->second.inbox == inbox) {
+        m_mailboxes.erase(it);
+    }
+}
+
+uint64_t MlmLocalRegistry::addConsumer(
+    const std::string& endpoint, const std::string& stream, const std::string& pattern, MlmLocalInbox* inbox)
+{
+    std::regex regex(pattern);
+
+    std::unique_lock<std::shared_mutex> lock(m_mutex);
+    uint64_t                            id = ++m_lastConsumer;
+    m_consumers.emplace(id, Consumer{endpoint, stream, std::move(regex), inbox});
+    return id;
+}
+
+void MlmLocalRegistry::removeConsumer(uint64_t consumer)
+{
+    std::unique_lock<std::shared_mutex> lock(m_mutex);
+    m_consumers.erase(consumer);
+}
+
+bool MlmLocalRegistry::sendto(const std::string& endpoint, const std::string& sender, const std::string& address,
+    const std::string& subject, zmsg_t** content)
+{
+    // the inboxes can't be removed, and so destroyed, while sending to them
+    std::shared_lock<std::shared_mutex> lock(m_mutex);
+    auto                                it = m_mailboxes.find(std::make_pair(endpoint, address));
+    if (it == m_mailboxes.end()) {
+        return false;
+    }
+    if (!it->second.inbox->send({"MAILBOX DELIVER", sender, subject, address}, content)) {
+        log_debug("Local mailbox %s is full, going through the broker", address.c_str());
+        return false;
+    }
+    return true;
+}
+
+size_t MlmLocalRegistry::publish(const std::string& endpoint, const std::string& sender, const std::string& stream,
+    const std::string& subject, zmsg_t* content)
+{
+    std::shared_lock<std::shared_mutex> lock(m_mutex);
+    if (m_consumers.empty()) {
+        return 0;
+    }
+
+    // an inbox consuming the stream with several matching patterns gets one copy, as with malamute
+    std::vector<MlmLocalInbox*> served;
+    size_t                      delivered = 0;
+    MlmLocalInbox::Envelope     envelope{"STREAM DELIVER", sender, subject, stream};
+    for (const auto& it : m_consumers) {
+        const Consumer& consumer = it.second;
+        if (consumer.stream != stream || consumer.endpoint != endpoint ||
+            std::find(served.begin(), served.end(), consumer.inbox) != served.end() ||
+            !std::regex_search(subject, consumer.pattern)) {
+            continue;
+        }
+        served.push_back(consumer.inbox);
+        zmsg_t* copy = zmsg_dup(content);
+        if (consumer.inbox->send(envelope, &copy)) {
+            delivered++;
+        } else {
+            // the inbox keeps the copy of the broker instead
+            log_warning("Local consumer of stream %s is full, '%s' goes through the broker", stream.c_str(),
+                subject.c_str());
+            consumer.inbox->miss(envelope, copy);
+            zmsg_destroy(&copy);
+        }
+    }
+    return delivered;
+}
+
+bool MlmLocalRegistry::mirrored(const std::string& endpoint, const std::string& sender) const
+{
+    std::shared_lock<std::shared_mutex> lock(m_mutex);
+    auto                                it = m_mailboxes.find(std::make_pair(endpoint, sender));
+    return it != m_mailboxes.end() && it->second.mirrored;
+}
+
+bool MlmLocalRegistry::receivedLocally(const std::string& endpoint, const std::string& sender,
+    const std::string& stream, const std::string& subject, zmsg_t* content, MlmLocalInbox* inbox) const
+{
+    std::shared_lock<std::shared_mutex> lock(m_mutex);
+    auto                                mailbox = m_mailboxes.find(std::make_pair(endpoint, sender));
+    if (mailbox == m_mailboxes.end() || !mailbox->second.mirrored) {
+        return false;
+    }
+    bool consumed = std::any_of(m_consumers.begin(), m_consumers.end(), [&](const auto& it) {
+        const Consumer& consumer = it.second;
+        return consumer.inbox == inbox && consumer.endpoint == endpoint && consumer.stream == stream &&
+               std::regex_search(subject, consumer.pattern);
+    });
+    return consumed && !inbox->takeMissed({"STREAM DELIVER", sender, subject, stream}, content);
+}
+
+} // namespace mlm
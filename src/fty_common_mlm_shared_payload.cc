@@ -0,0 +1,322 @@
+/*  =========================================================================
+    fty_common_mlm_shared_payload - Large payloads handed over in shared memory
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    fty_common_mlm_shared_payload - Large payloads handed over in shared memory
+@discuss
+@end
+*/
+
+#include "fty_common_mlm_shared_payload.h"
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fty_log.h>
+#include <map>
+#include <mutex>
+#include <signal.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace mlm {
+
+namespace {
+
+    // segment layout: magic, number of frames, then the size (uint64_t) and the data of each frame
+    const uint32_t MAGIC = 0x53594654; // "FTYS"
+
+    // names of the segments: /fty-mlm-<pid of the creator>-<number>
+    const char   PREFIX[]    = "fty-mlm-";
+    const size_t PREFIX_SIZE = sizeof(PREFIX) - 1;
+    const char   SHM_DIR[]   = "/dev/shm/";
+
+    using Clock = std::chrono::steady_clock;
+
+    // segments created by the process and not unlinked yet, by expiry
+    class Segments
+    {
+    public:
+        ~Segments()
+        {
+            collect(true);
+        }
+
+        void add(const std::string& name, Clock::time_point expiry)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_segments.emplace(expiry, name);
+        }
+
+        void collect(bool all)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            Clock::time_point           now = Clock::now();
+            // the readers may have unlinked them already
+            while (!m_segments.empty() && (all || m_segments.begin()->first <= now)) {
+                shm_unlink(m_segments.begin()->second.c_str());
+                m_segments.erase(m_segments.begin());
+            }
+        }
+
+    private:
+        std::mutex                                    m_mutex;
+        std::multimap<Clock::time_point, std::string> m_segments;
+    };
+
+    Segments& segments()
+    {
+        static Segments instance;
+        return instance;
+    }
+
+    bool isNumber(const std::string& str, size_t pos, size_t end)
+    {
+        if (pos >= end || end - pos > 19) {
+            return false;
+        }
+        for (size_t i = pos; i < end; i++) {
+            if (str[i] < '0' || str[i] > '9') {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // true if name (without the leading '/') is the name of a segment, pid of its creator
+    bool parseName(const std::string& name, pid_t& pid)
+    {
+        if (name.compare(0, PREFIX_SIZE, PREFIX) != 0) {
+            return false;
+        }
+        size_t dash = name.find('-', PREFIX_SIZE);
+        if (dash == std::string::npos || !isNumber(name, PREFIX_SIZE, dash) ||
+            !isNumber(name, dash + 1, name.size())) {
+            return false;
+        }
+        pid = pid_t(strtol(name.c_str() + PREFIX_SIZE, nullptr, 10));
+        return pid > 0;
+    }
+
+    std::string frameString(zframe_t* frame)
+    {
+        return std::string(reinterpret_cast<const char*>(zframe_data(frame)), zframe_size(frame));
+    }
+
+    // frame at index, nullptr if none
+    zframe_t* frameAt(zmsg_t* message, size_t index)
+    {
+        zframe_t* frame = zmsg_first(message);
+        for (size_t i = 0; i < index && frame != nullptr; i++) {
+            frame = zmsg_next(message);
+        }
+        return frame;
+    }
+
+    // removes the frames after skip
+    void truncate(zmsg_t* message, size_t skip)
+    {
+        while (zmsg_size(message) > skip) {
+            zframe_t* frame = zmsg_last(message);
+            zmsg_remove(message, frame);
+            zframe_destroy(&frame);
+        }
+    }
+
+} // namespace
+
+bool MlmSharedPayload::share(zmsg_t* message, size_t skip, size_t threshold, std::chrono::milliseconds ttl)
+{
+    if (threshold == 0 || zmsg_size(message) <= skip) {
+        return false;
+    }
+
+    size_t    frames = 0;
+    size_t    size   = 2 * sizeof(uint32_t);
+    zframe_t* frame  = frameAt(message, skip);
+    for (; frame != nullptr; frame = zmsg_next(message)) {
+        frames++;
+        size += sizeof(uint64_t) + zframe_size(frame);
+    }
+    if (size < threshold) {
+        return false;
+    }
+
+    static std::once_flag orphans;
+    std::call_once(orphans, collectOrphans);
+    segments().collect(false);
+
+    static std::atomic<uint64_t> lastSegment{0};
+    std::string name = std::string("/") + PREFIX + std::to_string(getpid()) + "-" + std::to_string(++lastSegment);
+
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR);
+    if (fd == -1) {
+        log_error("Can't create shared memory segment %s: %s", name.c_str(), strerror(errno));
+        return false;
+    }
+    void* data = MAP_FAILED;
+    if (ftruncate(fd, off_t(size)) == 0) {
+        data = mmap(nullptr, size, PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED) {
+        log_error("Can't map shared memory segment %s of %zu bytes: %s", name.c_str(), size, strerror(errno));
+        shm_unlink(name.c_str());
+        return false;
+    }
+
+    uint8_t* out       = static_cast<uint8_t*>(data);
+    uint32_t header[2] = {MAGIC, uint32_t(frames)};
+    memcpy(out, header, sizeof(header));
+    out += sizeof(header);
+    for (frame = frameAt(message, skip); frame != nullptr; frame = zmsg_next(message)) {
+        uint64_t frameSize = zframe_size(frame);
+        memcpy(out, &frameSize, sizeof(frameSize));
+        out += sizeof(frameSize);
+        memcpy(out, zframe_data(frame), frameSize);
+        out += frameSize;
+    }
+    munmap(data, size);
+    segments().add(name, Clock::now() + ttl);
+
+    truncate(message, skip);
+    zmsg_addstr(message, MARKER);
+    zmsg_addstr(message, name.c_str());
+    zmsg_addstr(message, std::to_string(size).c_str());
+    return true;
+}
+
+bool MlmSharedPayload::isShared(zmsg_t* message, size_t skip)
+{
+    if (zmsg_size(message) != skip + 3) {
+        return false;
+    }
+    // a payload of the same shape isn't taken for a descriptor: the name and size must be valid too
+    zframe_t* marker = frameAt(message, skip);
+    if (marker == nullptr || !zframe_streq(marker, MARKER)) {
+        return false;
+    }
+    std::string name = frameString(zmsg_next(message));
+    std::string size = frameString(zmsg_next(message));
+    pid_t       pid;
+    return name.size() > 1 && name[0] == '/' && parseName(name.substr(1), pid) && isNumber(size, 0, size.size());
+}
+
+bool MlmSharedPayload::fetch(zmsg_t* message, size_t skip, bool unlink)
+{
+    if (!isShared(message, skip)) {
+        return true;
+    }
+    std::string name = frameString(frameAt(message, skip + 1));
+    size_t      size = size_t(strtoull(frameString(zmsg_next(message)).c_str(), nullptr, 10));
+
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd == -1) {
+        log_error("Can't open shared memory segment %s: %s", name.c_str(), strerror(errno));
+        return false;
+    }
+    struct stat status;
+    void*       data = MAP_FAILED;
+    if (fstat(fd, &status) == 0 && size_t(status.st_size) == size && size >= 2 * sizeof(uint32_t)) {
+        data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED) {
+        log_error("Can't map shared memory segment %s of %zu bytes", name.c_str(), size);
+        return false;
+    }
+
+    // decoded aside, the message is only changed once the segment is found valid
+    const uint8_t* in  = static_cast<const uint8_t*>(data);
+    const uint8_t* end = in + size;
+    uint32_t       header[2];
+    memcpy(header, in, sizeof(header));
+    in += sizeof(header);
+
+    zmsg_t* frames = zmsg_new();
+    bool    valid  = header[0] == MAGIC;
+    for (uint32_t i = 0; valid && i < header[1]; i++) {
+        uint64_t frameSize;
+        if (size_t(end - in) < sizeof(frameSize)) {
+            valid = false;
+            break;
+        }
+        memcpy(&frameSize, in, sizeof(frameSize));
+        in += sizeof(frameSize);
+        if (uint64_t(end - in) < frameSize) {
+            valid = false;
+            break;
+        }
+        zmsg_addmem(frames, in, size_t(frameSize));
+        in += frameSize;
+    }
+    munmap(data, size);
+
+    if (!valid) {
+        log_error("Invalid shared memory segment %s", name.c_str());
+        zmsg_destroy(&frames);
+        return false;
+    }
+    if (unlink) {
+        shm_unlink(name.c_str());
+    }
+
+    truncate(message, skip);
+    for (zframe_t* frame = zmsg_pop(frames); frame != nullptr; frame = zmsg_pop(frames)) {
+        zmsg_append(message, &frame);
+    }
+    zmsg_destroy(&frames);
+    return true;
+}
+
+void MlmSharedPayload::collect(bool all)
+{
+    segments().collect(all);
+}
+
+void MlmSharedPayload::collectOrphans()
+{
+    DIR* dir = opendir(SHM_DIR);
+    if (dir == nullptr) {
+        log_debug("Can't list the shared memory segments: %s", strerror(errno));
+        return;
+    }
+    for (struct dirent* entry = readdir(dir); entry != nullptr; entry = readdir(dir)) {
+        std::string name = entry->d_name;
+        pid_t       pid;
+        struct stat status;
+        if (!parseName(name, pid) || pid == getpid() || kill(pid, 0) == 0 || errno != ESRCH ||
+            stat((SHM_DIR + name).c_str(), &status) != 0 || status.st_uid != geteuid()) {
+            continue;
+        }
+        log_debug("Unlinking shared memory segment /%s of dead process %d", name.c_str(), int(pid));
+        shm_unlink(("/" + name).c_str());
+    }
+    closedir(dir);
+}
+
+} // namespace mlm
@@ -27,21 +27,13 @@
 */
 
 #include "fty_common_mlm_stream_client.h"
-#include <gnu/libc-version.h>
-#include <sys/types.h>
-#include <unistd.h>
-
-// gettid() is available since glibc 2.30
-#if ((__GLIBC__ < 2) || (__GLIBC__ == 2 && __GLIBC_MINOR__ < 30))
-#include <sys/syscall.h>
-#define gettid() pid_t(syscall(SYS_gettid))
-#endif
-
+#include "fty_common_mlm_connection_manager.h"
+#include "fty_common_mlm_shared_payload.h"
+#include <algorithm>
 #include <czmq.h>
 #include <fty_common_mlm.h>
-#include <iomanip>
-#include <malamute.h>
-#include <sstream>
+#include <fty_log.h>
+#include <stdexcept>
 
 namespace mlm {
 MlmStreamClient::MlmStreamClient(
@@ -49,194 +41,212 @@ MlmStreamClient::MlmStreamClient(
     : m_clientId(clientId)
     , m_stream(stream)
     , m_timeout(timeout)
-    , m_endpoint(endPoint)
+    , m_endpoints{endPoint}
 {
-    (void)m_timeout;
+    // its publishing session stays open between the notifications, the subscriptions keep theirs
+    MlmConnectionManager::instance().attach(m_clientId + ".PUB." + m_stream);
+}
+
+MlmStreamClient::MlmStreamClient(const std::string& clientId, const std::string& stream, uint32_t timeout,
+    const std::vector<std::string>& endPoints)
+    : m_clientId(clientId)
+    , m_stream(stream)
+    , m_timeout(timeout)
+    , m_endpoints(endPoints)
+{
+    if (m_endpoints.empty()) {
+        throw std::invalid_argument("MlmStreamClient: no broker endpoint");
+    }
+    MlmConnectionManager::instance().attach(m_clientId + ".PUB." + m_stream);
 }
 
 MlmStreamClient::~MlmStreamClient()
 {
-    // stop the thread
-    if (!m_callbacks.empty()) {
-        m_stopRequested = true;
-        publishOnBus("SYNC", {});
-        m_listenerThread.join();
+    if (m_retryThread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(m_subscriptionMutex);
+            m_stopping = true;
+        }
+        m_retryCond.notify_one();
+        m_retryThread.join();
+    }
+
+    // stop the callbacks
+    for (uint64_t subscription : m_subscriptions) {
+        MlmConnectionManager::instance().unsubscribe(subscription);
     }
+    MlmConnectionManager::instance().detach(m_clientId + ".PUB." + m_stream);
 }
 
 
-void MlmStreamClient::publish(const std::vector<std::string>& payload)
+void MlmStreamClient::setSharedMemory(size_t threshold, std::chrono::milliseconds ttl)
 {
-    publishOnBus("MESSAGE", payload);
+    m_sharedThreshold = threshold;
+    m_sharedTtl       = ttl;
 }
 
-void MlmStreamClient::publishOnBus(const std::string& type, const std::vector<std::string>& payload)
+void MlmStreamClient::publish(const std::vector<std::string>& payload)
 {
-    // std::cerr << "Publish on Bus <" << messageType << ">:" << payload << std::endl;
-
-    mlm_client_t* client = mlm_client_new();
-
-    if (client == nullptr) {
-        mlm_client_destroy(&client);
-        throw std::runtime_error("Malamute error: NULL client pointer");
+    zmsg_t* notification = zmsg_new();
+    for (const std::string& frame : payload) {
+        zmsg_addstr(notification, frame.c_str());
     }
-
-    // create a unique sender id: <m_cliendId>.PUB.<m_stream>[thread id in hexa]
-    pid_t threadId = gettid();
-
-    std::stringstream ss;
-    ss << m_clientId << ".PUB." << m_stream << "." << std::setfill('0') << std::setw(sizeof(pid_t) * 2) << std::hex
-       << threadId;
-
-    std::string uniqueId = ss.str();
-
-    int rc = mlm_client_connect(client, m_endpoint.c_str(), 1000, uniqueId.c_str());
-
-    if (rc != 0) {
-        mlm_client_destroy(&client);
-        throw std::runtime_error("Malamute error: Error connecting to endpoint <" + m_endpoint + ">");
+    MlmSharedPayload::share(notification, 0, m_sharedThreshold, m_sharedTtl);
+
+    // through the session <m_clientId>.PUB.<m_stream>, shared with the other publishers of the process
+    MlmConnectionManager&    manager = MlmConnectionManager::instance();
+    std::vector<std::string> brokers = manager.brokers(m_stream, m_endpoints);
+    for (size_t i = 0; i + 1 < brokers.size(); i++) {
+        zmsg_t* copy = zmsg_dup(notification);
+        try {
+            manager.publish(brokers[i], m_clientId + ".PUB." + m_stream, m_stream, "MESSAGE", &copy, m_timeout);
+            zmsg_destroy(&notification);
+            return;
+        } catch (const std::exception& e) {
+            log_debug("%s", e.what());
+            manager.setUnreachable(brokers[i]);
+        }
     }
+    // the last broker gets the notification itself, errors included
+    manager.publish(brokers.back(), m_clientId + ".PUB." + m_stream, m_stream, "MESSAGE", &notification, m_timeout);
+}
 
-    rc = mlm_client_set_producer(client, m_stream.c_str());
-    if (rc != 0) {
-        mlm_client_destroy(&client);
-        throw std::runtime_error("Malamute error: Impossible to become publisher of stream <" + m_stream + ">");
+void MlmStreamClient::deliver(const std::string& subject, zmsg_t* msg)
+{
+    // sent by the former versions of this class to stop their listener
+    if (subject == "SYNC") {
+        return;
     }
 
-    zmsg_t* notification = zmsg_new();
-    for (const std::string& frame : payload) {
-        zmsg_addstr(notification, frame.c_str());
+    // a large payload comes as a descriptor, read by all the subscribers of the session
+    ZmsgGuard shared;
+    if (MlmSharedPayload::isShared(msg, 0)) {
+        shared = zmsg_dup(msg);
+        if (!MlmSharedPayload::fetch(shared, 0, false)) {
+            return;
+        }
+        msg = shared;
     }
 
-    rc = mlm_client_send(client, type.c_str(), &notification);
-
-    if (rc != 0) {
-        zmsg_destroy(&notification);
-        mlm_client_destroy(&client);
-        throw std::runtime_error("Malamute error: Impossible to publish on stream <" + m_stream + ">");
+    // collect all the frame
+    std::vector<std::string> payload;
+    for (zframe_t* frame = zmsg_first(msg); frame != nullptr; frame = zmsg_next(msg)) {
+        payload.emplace_back(reinterpret_cast<const char*>(zframe_data(frame)), zframe_size(frame));
     }
 
-    mlm_client_destroy(&client);
+    // process the callbacks
+    std::unique_lock<std::mutex> callbackLock(m_listenerCallbackMutex);
+    for (const auto& item : m_callbacks) {
+        try {
+            item.second(payload);
+        } catch (...) // Show Must Go On => Log errors and continue
+        {
+            // log_error("Error during processing callback [%i]: unknown error", item.first);
+        }
+    }
 }
 
 uint32_t MlmStreamClient::subscribe(Callback callback)
 {
-    m_stopRequested = false;
-    m_counter++;
-
-    std::unique_lock<std::mutex> lock(m_listenerCallbackMutex);
-    m_callbacks[m_counter] = callback;
-
-    // There is no subscriber - we create one
-    if (!m_listenerThread.joinable()) {
-        // start
-        m_exPtr          = nullptr;
-        m_listenerThread = std::thread(std::bind(&MlmStreamClient::listener, this));
-
-        m_listenerStarted.wait(lock);
+    std::unique_lock<std::mutex> lock(m_subscriptionMutex);
+    {
+        std::unique_lock<std::mutex> callbackLock(m_listenerCallbackMutex);
+        m_counter++;
+        m_callbacks[m_counter] = callback;
+    }
 
-        // check that startup worked properly
-        if (m_exPtr) {
-            std::rethrow_exception(m_exPtr);
+    // There is no subscription - we create one on each broker, the publishers use any of them
+    if (m_subscriptions.empty()) {
+        std::string error;
+        for (const std::string& endpoint : m_endpoints) {
+            try {
+                m_subscriptions.push_back(listen(endpoint));
+            } catch (const std::exception& e) {
+                log_error("Can't listen to stream <%s> on <%s>: %s", m_stream.c_str(), endpoint.c_str(), e.what());
+                error = e.what();
+                m_missing.push_back(endpoint);
+            }
+        }
+        if (m_subscriptions.empty()) {
+            m_missing.clear();
+            std::unique_lock<std::mutex> callbackLock(m_listenerCallbackMutex);
+            m_callbacks.erase(m_counter);
+            throw std::runtime_error(error);
+        }
+        // the publishers may use the missing brokers once they are back
+        if (!m_missing.empty() && !m_retryThread.joinable()) {
+            m_retryThread = std::thread(&MlmStreamClient::retry, this);
         }
     }
 
     return m_counter;
 }
 
-void MlmStreamClient::unsubscribe(uint32_t subId)
+uint64_t MlmStreamClient::listen(const std::string& endpoint)
 {
-    if (m_callbacks.count(subId) > 0) {
-        { // lock only to remove from the thread
-            std::unique_lock<std::mutex> lock(m_listenerCallbackMutex);
-            m_callbacks.erase(subId);
-        }
-
-
-        if (m_callbacks.empty()) {
-            m_stopRequested = true;
-            publishOnBus("SYNC", {});
-            m_listenerThread.join();
-        }
-    }
+    return MlmConnectionManager::instance().subscribe(
+        endpoint, m_clientId + ".SUB", m_stream, ".*",
+        [this](const std::string& subject, zmsg_t* msg) {
+            deliver(subject, msg);
+        },
+        m_timeout);
 }
 
-void MlmStreamClient::listener()
+void MlmStreamClient::retry()
 {
-    mlm_client_t* client = mlm_client_new();
-
-    try {
-        if (client == nullptr) {
-            throw std::runtime_error("Malamute error: NULL client pointer");
+    MlmConnectionManager&        manager = MlmConnectionManager::instance();
+    std::unique_lock<std::mutex> lock(m_subscriptionMutex);
+    while (!m_stopping) {
+        m_retryCond.wait_for(lock, MlmConnectionManager::UNREACHABLE_PERIOD);
+        if (m_stopping || m_missing.empty()) {
+            continue;
         }
 
-        // create a unique id: <m_clientId>-SECW_NOTIFICATIONS.[thread id in hexa]
-        pid_t threadId = gettid();
-
-        std::stringstream ss;
-        ss << m_clientId << ".SUB." << m_stream << "." << std::setfill('0') << std::setw(sizeof(pid_t) * 2) << std::hex
-           << threadId;
-
-        std::string uniqueId = ss.str();
-
-        int rc = mlm_client_connect(client, m_endpoint.c_str(), 1000, uniqueId.c_str());
-
-        if (rc != 0) {
-            throw std::runtime_error("Malamute error: Error connecting to endpoint <" + m_endpoint + ">");
-        }
-
-        rc = mlm_client_set_consumer(client, m_stream.c_str(), ".*");
-        if (rc != 0) {
-            throw std::runtime_error("Malamute error: Impossible to become consumer of stream <" + m_stream + ">");
+        // connected out of the lock: it may take up to the timeout per broker
+        std::vector<std::string> missing    = m_missing;
+        uint64_t                 generation = m_generation;
+        lock.unlock();
+        std::vector<std::pair<std::string, uint64_t>> added;
+        for (const std::string& endpoint : missing) {
+            try {
+                added.emplace_back(endpoint, listen(endpoint));
+            } catch (const std::exception& e) {
+                log_debug("Can't listen to stream <%s> on <%s> yet: %s", m_stream.c_str(), endpoint.c_str(),
+                    e.what());
+            }
         }
+        lock.lock();
 
-        zpoller_t* poller = zpoller_new(mlm_client_msgpipe(client), NULL);
-
-        m_listenerStarted.notify_all();
-
-        while (!zsys_interrupted) {
-            void* which = zpoller_wait(poller, -1);
-            if (which == mlm_client_msgpipe(client)) {
-                ZmsgGuard msg(mlm_client_recv(client));
-
-                // check if we need to leave the loop
-                if (m_stopRequested) {
-                    break;
-                }
-
-
-                // collect all the frame
-                size_t numberOfFrame = zmsg_size(msg);
-
-                std::vector<std::string> payload;
-                for (size_t index = 0; index < numberOfFrame; index++) {
-                    ZstrGuard frame(zmsg_popstr(msg));
-                    payload.push_back(frame.get());
-                }
-
-                // process the callbacks
-                std::unique_lock<std::mutex> lock(m_listenerCallbackMutex);
-                for (const auto& item : m_callbacks) {
-                    try {
-                        item.second(payload);
-                    } catch (...) // Show Must Go On => Log errors and continue
-                    {
-                        // log_error("Error during processing callback [%i]: unknown error", item.first);
-                    }
-                }
+        for (const auto& it : added) {
+            // unsubscribed meanwhile
+            if (generation != m_generation) {
+                manager.unsubscribe(it.second);
+                continue;
             }
+            log_info("Listening to stream <%s> on <%s>", m_stream.c_str(), it.first.c_str());
+            m_subscriptions.push_back(it.second);
+            m_missing.erase(std::find(m_missing.begin(), m_missing.end(), it.first));
         }
+    }
+}
 
-        zpoller_destroy(&poller);
-
-    } catch (...) // Transfer the error to the main thread (only at startup)
+void MlmStreamClient::unsubscribe(uint32_t subId)
+{
+    std::unique_lock<std::mutex> lock(m_subscriptionMutex);
     {
-        // log_error("Error during starting the listener thread");
-        m_exPtr = std::current_exception();
-        m_listenerStarted.notify_all();
+        std::unique_lock<std::mutex> callbackLock(m_listenerCallbackMutex);
+        if (m_callbacks.erase(subId) == 0 || !m_callbacks.empty()) {
+            return;
+        }
     }
 
-    mlm_client_destroy(&client);
+    // out of m_listenerCallbackMutex: waits for the callbacks in progress
+    for (uint64_t subscription : m_subscriptions) {
+        MlmConnectionManager::instance().unsubscribe(subscription);
+    }
+    m_subscriptions.clear();
+    m_missing.clear();
+    m_generation++;
 }
 
 } // namespace mlm
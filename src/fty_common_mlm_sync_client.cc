@@ -27,57 +27,254 @@
 */
 
 #include "fty_common_mlm_sync_client.h"
-#include <gnu/libc-version.h>
-#include <sys/types.h>
-#include <unistd.h>
-
-// gettid() is available since glibc 2.30
-#if ((__GLIBC__ < 2) || (__GLIBC__ == 2 && __GLIBC_MINOR__ < 30))
-#include <sys/syscall.h>
-#define gettid() pid_t(syscall(SYS_gettid))
-#endif
-
+#include "fty_common_mlm_connection_manager.h"
+#include "fty_common_mlm_shared_payload.h"
+#include <algorithm>
 #include <czmq.h>
 #include <fty_common_mlm.h>
-#include <iomanip>
-#include <malamute.h>
-#include <sstream>
+#include <fty_log.h>
 
 namespace mlm {
+
+// reply timeout of the direct channels when none is set
+static const std::chrono::milliseconds DIRECT_REPLY_TIMEOUT = std::chrono::seconds(60);
+
 MlmSyncClient::MlmSyncClient(
     const std::string& clientId, const std::string& destination, uint32_t timeout, const std::string& endPoint)
     : m_clientId(clientId)
     , m_destination(destination)
     , m_timeout(timeout)
-    , m_endpoint(endPoint)
+    , m_endpoints{endPoint}
 {
+    // its session stays open between the requests
+    MlmConnectionManager::instance().attach(m_clientId);
 }
 
+MlmSyncClient::MlmSyncClient(const std::string& clientId, const std::string& destination, uint32_t timeout,
+    const std::vector<std::string>& endPoints)
+    : m_clientId(clientId)
+    , m_destination(destination)
+    , m_timeout(timeout)
+    , m_endpoints(endPoints)
+{
+    if (m_endpoints.empty()) {
+        throw std::invalid_argument("MlmSyncClient: no broker endpoint");
+    }
+    MlmConnectionManager::instance().attach(m_clientId);
+}
 
-std::vector<std::string> MlmSyncClient::syncRequestWithReply(const std::vector<std::string>& payload)
+MlmSyncClient::~MlmSyncClient()
+{
+    MlmConnectionManager::instance().detach(m_clientId);
+    for (auto& it : m_channels) {
+        for (zsock_t* socket : it.second.idle) {
+            zsock_destroy(&socket);
+        }
+    }
+}
+
+void MlmSyncClient::setShards(size_t shards, int keyFrame)
 {
-    mlm_client_t* client = mlm_client_new();
+    m_shards   = shards;
+    m_keyFrame = keyFrame;
+}
+
+void MlmSyncClient::setSharedMemory(size_t threshold, std::chrono::milliseconds ttl)
+{
+    m_sharedThreshold = threshold;
+    m_sharedTtl       = ttl;
+}
 
-    if (client == nullptr) {
-        mlm_client_destroy(&client);
-        throw std::runtime_error("Malamute error: NULL client pointer");
+void MlmSyncClient::setDirect(bool direct, std::chrono::milliseconds retry)
+{
+    m_direct      = direct;
+    m_directRetry = retry;
+}
+
+void MlmSyncClient::setReplyTimeout(std::chrono::milliseconds timeout)
+{
+    m_replyTimeout = timeout;
+}
+
+void MlmSyncClient::setIdempotent(bool idempotent)
+{
+    m_idempotent = idempotent;
+}
+
+std::string MlmSyncClient::destination(const std::vector<std::string>& payload)
+{
+    if (m_shards <= 1) {
+        return m_destination;
     }
 
-    // create a unique sender id: <clientId>.[thread id in hexa]
-    pid_t threadId = gettid();
+    size_t shard;
+    if (m_keyFrame >= 0 && size_t(m_keyFrame) < payload.size()) {
+        shard = MlmUtils::shardOf(payload[size_t(m_keyFrame)], m_shards);
+    } else {
+        shard = m_nextShard++ % m_shards;
+    }
+    return MlmUtils::shardName(m_destination, shard);
+}
 
-    std::stringstream ss;
-    ss << m_clientId << "." << std::setfill('0') << std::setw(sizeof(pid_t) * 2) << std::hex << threadId;
+zmsg_t* MlmSyncClient::brokerRequest(const std::string& address, const std::string& subject,
+    const std::string& correlationId, zmsg_t** request, Clock::duration timeout, bool idempotent)
+{
+    MlmConnectionManager&    manager = MlmConnectionManager::instance();
+    std::vector<std::string> brokers = manager.brokers(address, m_endpoints);
 
-    std::string uniqueId = ss.str();
+    for (size_t i = 0; i < brokers.size(); i++) {
+        Clock::time_point deadline =
+            timeout == Clock::duration::max() ? Clock::time_point::max() : Clock::now() + timeout;
 
-    int rc = mlm_client_connect(client, m_endpoint.c_str(), m_timeout, uniqueId.c_str());
+        // the last broker gets the request itself, errors included
+        if (i + 1 == brokers.size()) {
+            return manager.requestReply(
+                brokers[i], m_clientId, address, subject, correlationId, request, m_timeout, deadline);
+        }
 
-    if (rc != 0) {
-        mlm_client_destroy(&client);
-        throw std::runtime_error("Malamute error: Error connecting to endpoint <" + m_endpoint + ">");
+        zmsg_t* copy = zmsg_dup(*request);
+        zmsg_t* reply;
+        try {
+            reply = manager.requestReply(
+                brokers[i], m_clientId, address, subject, correlationId, &copy, m_timeout, deadline);
+        } catch (const std::exception& e) {
+            log_debug("%s", e.what());
+            manager.setUnreachable(brokers[i]);
+            continue;
+        }
+        // once sent, the request is only sent again if it can be handled twice
+        if (reply != nullptr || zsys_interrupted || (Clock::now() >= deadline && !idempotent)) {
+            zmsg_destroy(request);
+            return reply;
+        }
+        log_warning("No reply from <%s> through <%s>, trying the next broker", address.c_str(), brokers[i].c_str());
+        manager.setUnreachable(brokers[i]);
     }
+    return nullptr;
+}
 
+std::string MlmSyncClient::negotiate(const std::string& destination)
+{
+    zmsg_t*    request = zmsg_new();
+    ZuuidGuard zuuid(zuuid_new());
+    zmsg_addstr(request, zuuid_str_canonical(zuuid));
+
+    // [correlation id][endpoint], empty endpoint if the server has no channel, no reply from the older servers
+    // asking twice is harmless: a stalled broker is skipped
+    ZmsgGuard reply(brokerRequest(
+        destination, "CHANNEL", zuuid_str_canonical(zuuid), &request, std::chrono::milliseconds(m_timeout), true));
+    if (reply == nullptr || zmsg_size(reply) != 2) {
+        return "";
+    }
+    ZstrGuard correlationId(zmsg_popstr(reply));
+    ZstrGuard endpoint(zmsg_popstr(reply));
+    return endpoint != nullptr ? endpoint.get() : "";
+}
+
+zsock_t* MlmSyncClient::takeChannel(const std::string& destination)
+{
+    std::unique_lock<std::mutex> lock(m_channelsMutex);
+    Channel&                     channel = m_channels[destination];
+
+    if (channel.endpoint.empty()) {
+        if (Clock::now() < channel.retry) {
+            return nullptr;
+        }
+        // the other requests go through the mailbox meanwhile
+        channel.retry = Clock::now() + m_directRetry;
+        lock.unlock();
+        std::string endpoint = negotiate(destination);
+        lock.lock();
+        if (endpoint.empty()) {
+            log_debug("No direct channel to %s, using its mailbox", destination.c_str());
+            return nullptr;
+        }
+        log_debug("Direct channel to %s on %s", destination.c_str(), endpoint.c_str());
+        channel.endpoint = endpoint;
+    }
+
+    if (!channel.idle.empty()) {
+        zsock_t* socket = channel.idle.back();
+        channel.idle.pop_back();
+        return socket;
+    }
+
+    zsock_t* socket = zsock_new_dealer(nullptr);
+    if (socket == nullptr) {
+        return nullptr;
+    }
+    // no queueing towards a server which isn't there, the request then goes through the mailbox
+    zsock_set_immediate(socket, 1);
+    zsock_set_sndtimeo(socket, int(m_timeout));
+    zsock_set_linger(socket, 0);
+    if (zsock_connect(socket, "%s", channel.endpoint.c_str()) == -1) {
+        log_error("Can't connect the direct channel %s", channel.endpoint.c_str());
+        zsock_destroy(&socket);
+        channel.endpoint.clear();
+    }
+    return socket;
+}
+
+void MlmSyncClient::releaseChannel(const std::string& destination, zsock_t* socket, bool reusable)
+{
+    std::lock_guard<std::mutex> lock(m_channelsMutex);
+    Channel&                    channel = m_channels[destination];
+    if (reusable && !channel.endpoint.empty()) {
+        channel.idle.push_back(socket);
+        return;
+    }
+    zsock_destroy(&socket);
+    if (!reusable) {
+        // negotiated again at the next request
+        channel.endpoint.clear();
+        for (zsock_t* idle : channel.idle) {
+            zsock_destroy(&idle);
+        }
+        channel.idle.clear();
+    }
+}
+
+zmsg_t* MlmSyncClient::directRequest(zsock_t* socket, const std::string& correlationId, zmsg_t** request)
+{
+    // [unique sender][correlation id][payload...], the channel routes the reply
+    zmsg_pushstr(*request, MlmConnectionManager::address(m_clientId).c_str());
+    if (MlmUtils::zmsg_trysend(request, socket) != 0) {
+        zframe_t* sender = zmsg_pop(*request);
+        zframe_destroy(&sender);
+        return nullptr;
+    }
+
+    // the server may be gone for good: no broker tells it here
+    Clock::time_point deadline =
+        Clock::now() + (m_replyTimeout.count() > 0 ? m_replyTimeout : DIRECT_REPLY_TIMEOUT);
+    ZpollerGuard poller(zpoller_new(socket, NULL));
+    while (!zsys_interrupted) {
+        Clock::time_point now = Clock::now();
+        if (now >= deadline) {
+            log_error("No reply to request '%s' on the direct channel", correlationId.c_str());
+            break;
+        }
+        // zsys_interrupted is checked every second
+        auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count();
+        if (zpoller_wait(poller, int(std::min<int64_t>(wait + 1, 1000))) == nullptr) {
+            continue;
+        }
+        zmsg_t* reply = zmsg_recv(socket);
+        if (reply == nullptr) {
+            break;
+        }
+        // late reply to a previous request of the socket
+        zframe_t* id = zmsg_first(reply);
+        if (id != nullptr && zframe_streq(id, correlationId.c_str())) {
+            return reply;
+        }
+        zmsg_destroy(&reply);
+    }
+    return nullptr;
+}
+
+std::vector<std::string> MlmSyncClient::syncRequestWithReply(const std::vector<std::string>& payload)
+{
     // Prepare the request:
     zmsg_t*    request = zmsg_new();
     ZuuidGuard zuuid(zuuid_new());
@@ -89,24 +286,44 @@ std::vector<std::string> MlmSyncClient::syncRequestWithReply(const std::vector<s
         zmsg_addstr(request, frame.c_str());
     }
 
+    // a large payload goes through the broker as a descriptor
+    MlmSharedPayload::share(request, 1, m_sharedThreshold, m_sharedTtl);
+
     if (zsys_interrupted) {
         zmsg_destroy(&request);
-        mlm_client_destroy(&client);
         throw std::runtime_error("Malamute error: zsys_interrupted");
     }
 
-    // send the message
-    mlm_client_sendto(client, m_destination.c_str(), "REQUEST", nullptr, m_timeout, &request);
+    std::string address = destination(payload);
+    ZmsgGuard   recv;
+
+    // straight to the server when it has a channel
+    zsock_t* channel = m_direct ? takeChannel(address) : nullptr;
+    if (channel != nullptr) {
+        recv = directRequest(channel, zuuid_str_canonical(zuuid), &request);
+        releaseChannel(address, channel, recv != nullptr);
+        if (request != nullptr) {
+            log_warning("Direct channel to %s unavailable, using its mailbox", address.c_str());
+        }
+    }
+
+    // send the message through the session shared by the clients named m_clientId, and get the reply
+    if (recv == nullptr && request != nullptr) {
+        Clock::duration timeout = m_replyTimeout.count() > 0 ? Clock::duration(m_replyTimeout) : Clock::duration::max();
+        recv = brokerRequest(address, "REQUEST", zuuid_str_canonical(zuuid), &request, timeout, m_idempotent);
+    }
 
     if (zsys_interrupted) {
-        zmsg_destroy(&request);
-        mlm_client_destroy(&client);
         throw std::runtime_error("Malamute error: zsys_interrupted");
     }
 
-    // Get the reply
-    ZmsgGuard recv(mlm_client_recv(client));
-    mlm_client_destroy(&client);
+    if (recv == nullptr) {
+        throw std::runtime_error("Malamute error: Impossible to send the request to <" + m_destination + ">");
+    }
+
+    if (!MlmSharedPayload::fetch(recv, 1, true)) {
+        throw std::runtime_error("Malamute error: Shared memory of the reply is unreadable");
+    }
 
     // Get number of frame all the frame
     size_t numberOfFrame = zmsg_size(recv);
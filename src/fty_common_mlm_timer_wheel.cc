@@ -0,0 +1,250 @@
+/*  =========================================================================
+    fty_common_mlm_timer_wheel - Hierarchical timer wheel for agent timers
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    fty_common_mlm_timer_wheel - Hierarchical timer wheel for agent timers
+@discuss
+    Ticks are counted in ms since the creation of the wheel. A timer is kept at the lowest level
+    whose slot index is the only digit (in base 64) of its deadline differing from the current tick,
+    so its slot always lies ahead of the current position of the level. When the current tick
+    reaches the start of that slot, the timer is moved to a lower level, down to level 0 where it
+    expires. The wheel only visits ticks where a non-empty slot starts, long idle periods cost
+    nothing.
+@end
+*/
+
+#include "fty_common_mlm_timer_wheel.h"
+#include <stdexcept>
+
+namespace mlm {
+
+// ~4400 years, keeps the deadlines in the 8 levels
+static const int64_t MaxDelay = int64_t(1) << 47;
+
+TimerWheel::TimerWheel(int64_t now)
+    : m_origin(now)
+{
+}
+
+TimerWheel::TimerId TimerWheel::add(int64_t now, int64_t interval, Callback callback)
+{
+    if (interval <= 0) {
+        throw std::invalid_argument("Timer interval must be positive");
+    }
+    return insert(now, interval, interval, std::move(callback));
+}
+
+TimerWheel::TimerId TimerWheel::addOneShot(int64_t now, int64_t delay, Callback callback)
+{
+    return insert(now, delay, 0, std::move(callback));
+}
+
+TimerWheel::TimerId TimerWheel::insert(int64_t now, int64_t delay, int64_t interval, Callback&& callback)
+{
+    if (!callback) {
+        throw std::invalid_argument("Timer callback is empty");
+    }
+    if (delay > MaxDelay || interval > MaxDelay) {
+        throw std::invalid_argument("Timer delay is too long");
+    }
+
+    // the current tick has already been processed, fire at the next one at the earliest
+    int64_t  elapsed  = now - m_origin;
+    uint64_t deadline = elapsed > 0 ? uint64_t(elapsed) : 0;
+    deadline += delay > 0 ? uint64_t(delay) : 0;
+    if (deadline <= m_current) {
+        deadline = m_current + 1;
+    }
+
+    TimerId id    = m_nextId++;
+    Timer&  timer = m_timers[id];
+    timer.deadline = deadline;
+    timer.interval = interval;
+    timer.callback = std::move(callback);
+    place(id, timer);
+    return id;
+}
+
+void TimerWheel::place(TimerId id, Timer& timer)
+{
+    unsigned level = 0;
+    while (level < Levels - 1 &&
+           (timer.deadline >> (LevelBits * (level + 1))) != (m_current >> (LevelBits * (level + 1)))) {
+        level++;
+    }
+
+    timer.level    = level;
+    timer.slot     = unsigned(timer.deadline >> (LevelBits * level)) & (Slots - 1);
+    auto& ids      = m_slots[level][timer.slot];
+    timer.position = ids.insert(ids.end(), id);
+    m_occupied[level] |= uint64_t(1) << timer.slot;
+}
+
+bool TimerWheel::cancel(TimerId id)
+{
+    auto it = m_timers.find(id);
+    if (it == m_timers.end()) {
+        return false;
+    }
+
+    Timer& timer = it->second;
+    if (timer.level != Detached) {
+        auto& ids = m_slots[timer.level][timer.slot];
+        ids.erase(timer.position);
+        if (ids.empty()) {
+            m_occupied[timer.level] &= ~(uint64_t(1) << timer.slot);
+        }
+    }
+    m_timers.erase(it);
+    return true;
+}
+
+void TimerWheel::detach(std::list<TimerId>& ids, unsigned level, unsigned slot)
+{
+    ids.swap(m_slots[level][slot]);
+    m_occupied[level] &= ~(uint64_t(1) << slot);
+    for (TimerId id : ids) {
+        m_timers[id].level = Detached;
+    }
+}
+
+uint64_t TimerWheel::nextEvent() const
+{
+    uint64_t next = UINT64_MAX;
+    for (unsigned level = 0; level < Levels; level++) {
+        unsigned shift   = LevelBits * level;
+        unsigned current = unsigned(m_current >> shift) & (Slots - 1);
+        uint64_t ahead   = current == Slots - 1 ? 0 : m_occupied[level] & (~uint64_t(0) << (current + 1));
+        if (ahead == 0) {
+            continue;
+        }
+
+        // start of the first non-empty slot ahead in this level
+        uint64_t base  = (m_current >> (shift + LevelBits)) << (shift + LevelBits);
+        uint64_t start = base | (uint64_t(__builtin_ctzll(ahead)) << shift);
+        if (start < next) {
+            next = start;
+        }
+    }
+    return next;
+}
+
+int64_t TimerWheel::timeout(int64_t now) const
+{
+    uint64_t next = nextEvent();
+    if (next == UINT64_MAX) {
+        return -1;
+    }
+
+    int64_t elapsed = now - m_origin;
+    return int64_t(next) > elapsed ? int64_t(next) - elapsed : 0;
+}
+
+bool TimerWheel::advance(int64_t now)
+{
+    if (now - m_origin <= int64_t(m_current)) {
+        return true;
+    }
+
+    uint64_t target = uint64_t(now - m_origin);
+    while (true) {
+        uint64_t next = nextEvent();
+        if (next > target) {
+            m_current = target;
+            return true;
+        }
+        if (!process(next, target)) {
+            return false;
+        }
+    }
+}
+
+bool TimerWheel::process(uint64_t tick, uint64_t target)
+{
+    m_current = tick;
+
+    // move down the timers of the slots starting now, highest level first
+    for (unsigned level = Levels - 1; level > 0; level--) {
+        unsigned shift = LevelBits * level;
+        if ((tick & ((uint64_t(1) << shift) - 1)) != 0) {
+            continue;
+        }
+        unsigned slot = unsigned(tick >> shift) & (Slots - 1);
+        if (m_slots[level][slot].empty()) {
+            continue;
+        }
+
+        std::list<TimerId> ids;
+        detach(ids, level, slot);
+        for (TimerId id : ids) {
+            place(id, m_timers[id]);
+        }
+    }
+
+    // fire the timers expiring now
+    unsigned slot = unsigned(tick) & (Slots - 1);
+    if (m_slots[0][slot].empty()) {
+        return true;
+    }
+
+    std::list<TimerId> ids;
+    detach(ids, 0, slot);
+
+    bool rv = true;
+    for (TimerId id : ids) {
+        // cancelled by a previous callback
+        auto it = m_timers.find(id);
+        if (it == m_timers.end()) {
+            continue;
+        }
+
+        // stop requested: keep the remaining timers for the next call
+        if (!rv) {
+            it->second.deadline = tick + 1;
+            place(id, it->second);
+            continue;
+        }
+
+        if (it->second.interval == 0) {
+            Callback callback = std::move(it->second.callback);
+            m_timers.erase(it);
+            rv = callback();
+            continue;
+        }
+
+        // periodic timer: skip the periods missed while the caller was busy
+        Timer& timer = it->second;
+        timer.deadline += uint64_t(timer.interval);
+        if (timer.deadline <= target) {
+            uint64_t missed = (target - timer.deadline) / uint64_t(timer.interval) + 1;
+            timer.deadline += missed * uint64_t(timer.interval);
+        }
+        place(id, timer);
+
+        // the callback may cancel its own timer
+        Callback callback = timer.callback;
+        rv                = callback();
+    }
+    return rv;
+}
+
+} // namespace mlm
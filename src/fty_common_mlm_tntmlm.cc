@@ -29,12 +29,24 @@
 #include "fty_common_mlm_tntmlm.h"
 #include "fty_common_mlm_utils.h"
 #include "fty_common_mlm_pool.h"
+#include <algorithm>
+#include <climits>
 
-MlmClientPool mlm_pool{20};
+// spare clients disconnected from the broker are discarded
+MlmClientPool mlm_pool{20, [](MlmClient& client) {
+                           return client.connected();
+                       }};
 
 const std::string MlmClient::ENDPOINT = MLM_ENDPOINT;
 
 MlmClient::MlmClient()
+    : MlmClient(ENDPOINT)
+{
+}
+
+MlmClient::MlmClient(const std::string& endpoint, const std::string& prefix)
+    : _endpoint(endpoint)
+    , _prefix(prefix)
 {
     _client = mlm_client_new();
     _uuid   = zuuid_new();
@@ -44,6 +56,9 @@ MlmClient::MlmClient()
 
 MlmClient::~MlmClient()
 {
+    for (auto& it : _pending) {
+        zmsg_destroy(&it.second);
+    }
     zuuid_destroy(&_uuid);
     zpoller_destroy(&_poller);
     mlm_client_destroy(&_client);
@@ -62,35 +77,119 @@ zmsg_t* MlmClient::recv(const std::string& uuid, uint32_t timeout)
         wait = 300;
     }
 
-    uint64_t start          = static_cast<uint64_t>(zclock_mono());
-    uint64_t poller_timeout = wait * 1000;
+    return waitFor(uuid, zclock_mono() + int64_t(wait * 1000));
+}
+
+zmsg_t* MlmClient::recv(const std::string& uuid, std::chrono::milliseconds timeout)
+{
+    if (!connected()) {
+        connect();
+    }
+    return waitFor(uuid, quitOf(deadlineOf(timeout)));
+}
+
+MlmClient::Clock::time_point MlmClient::deadlineOf(std::chrono::milliseconds timeout)
+{
+    // saturated: Clock::now() + milliseconds::max() overflows
+    Clock::time_point now = Clock::now();
+    if (timeout.count() <= 0) {
+        return now;
+    }
+    if (timeout >= std::chrono::duration_cast<std::chrono::milliseconds>(Clock::time_point::max() - now)) {
+        return Clock::time_point::max();
+    }
+    return now + timeout;
+}
+
+int64_t MlmClient::quitOf(Clock::time_point deadline)
+{
+    // the deadline in zclock_mono() time, rounded up not to wake up too early, saturated
+    auto    left  = std::chrono::ceil<std::chrono::milliseconds>(deadline - Clock::now());
+    int64_t mono  = zclock_mono();
+    int64_t count = std::max(int64_t(left.count()), int64_t(0));
+    return count > INT64_MAX - mono ? INT64_MAX : mono + count;
+}
+
+zmsg_t* MlmClient::waitFor(const std::string& uuid, int64_t quit)
+{
+    // already received while waiting for another message
+    for (auto it = _pending.begin(); it != _pending.end(); ++it) {
+        if (it->first == uuid) {
+            zmsg_t* msg = it->second;
+            _pending.erase(it);
+            forget(uuid);
+            _lastResult = Result::Ok;
+            return msg;
+        }
+    }
+
+    // a late message is kept until asked for
+    expect(uuid);
 
     while (true) {
-        void* which = zpoller_wait(_poller, int(poller_timeout));
+        // waits longer than INT_MAX ms are done in several times
+        int64_t poller_timeout = std::min(std::max(quit - zclock_mono(), int64_t(0)), int64_t(INT_MAX));
+        void*   which          = zpoller_wait(_poller, int(poller_timeout));
+        if (which == nullptr && zpoller_expired(_poller) && zclock_mono() < quit) {
+            continue;
+        }
         if (which == nullptr) {
-            log_warning("zpoller_wait (timeout = '%" PRIu64
+            log_warning("zpoller_wait (timeout = '%" PRIi64
                         "') returned NULL. zpoller_expired == '%s', zpoller_terminated == '%s'",
                 poller_timeout, zpoller_expired(_poller) ? "true" : "false",
                 zpoller_terminated(_poller) ? "true" : "false");
+            // the uuid stays expected: a late message is kept for the next call
+            _lastResult = zpoller_terminated(_poller) ? Result::Interrupted : Result::Timeout;
             return nullptr;
         }
-        uint64_t timestamp = static_cast<uint64_t>(zclock_mono());
-        if (timestamp - start >= poller_timeout) {
-            poller_timeout = 0;
-        } else {
-            poller_timeout = poller_timeout - (timestamp - start);
-        }
         zmsg_t* msg = mlm_client_recv(_client);
         if (!msg)
             continue;
-        char* uuid_recv = zmsg_popstr(msg);
-        if (uuid_recv && uuid.compare(uuid_recv) == 0) {
-            zstr_free(&uuid_recv);
+        char* msg_uuid = zmsg_popstr(msg);
+        if (msg_uuid && uuid.compare(msg_uuid) == 0) {
+            zstr_free(&msg_uuid);
+            forget(uuid);
+            _lastResult = Result::Ok;
             return msg;
         }
-        zstr_free(&uuid_recv);
-        zmsg_destroy(&msg);
+        if (msg_uuid && std::find(_expected.begin(), _expected.end(), msg_uuid) != _expected.end()) {
+            // the message of another request in flight
+            keep(msg_uuid, msg);
+        } else {
+            log_info("Discarting unexpected/invalid message from %s (topic %s)", sender(), this->subject());
+            zmsg_destroy(&msg);
+        }
+        zstr_free(&msg_uuid);
+    }
+}
+
+void MlmClient::expect(const std::string& uuid)
+{
+    if (std::find(_expected.begin(), _expected.end(), uuid) != _expected.end()) {
+        return;
+    }
+    if (_expected.size() >= MAX_EXPECTED) {
+        _expected.pop_front();
+    }
+    _expected.push_back(uuid);
+}
+
+void MlmClient::forget(const std::string& uuid)
+{
+    auto it = std::find(_expected.begin(), _expected.end(), uuid);
+    if (it != _expected.end()) {
+        _expected.erase(it);
+    }
+}
+
+void MlmClient::keep(const std::string& uuid, zmsg_t* msg)
+{
+    if (_pending.size() >= MAX_PENDING) {
+        log_info("Too many pending replies, dropping the oldest one");
+        zmsg_destroy(&_pending.front().second);
+        _pending.pop_front();
     }
+    _pending.emplace_back(uuid, msg);
 }
 
 int MlmClient::sendto(const std::string& address, const std::string& subject, uint32_t timeout, zmsg_t** content_p)
@@ -104,76 +203,130 @@ int MlmClient::sendto(const std::string& address, const std::string& subject, ui
 zmsg_t* MlmClient::requestreply(
     const std::string& address, const std::string& subject, uint32_t timeout, zmsg_t** content_p)
 {
-    if (!content_p || !*content_p || address.empty())
+    return requestreply(address, subject, timeout, content_p, true);
+}
+
+zmsg_t* MlmClient::requestreply(
+    const std::string& address, const std::string& subject, uint32_t timeout, zmsg_t** content_p, bool copyContent)
+{
+    if (timeout > 300)
+        timeout = 300;
+    int64_t quit = zclock_mono() + timeout * 1000;
+
+    std::string uid = request(address, subject, timeout, content_p, copyContent);
+    if (uid.empty()) {
         return nullptr;
+    }
+    return waitReply(uid, quit);
+}
+
+std::string MlmClient::request(
+    const std::string& address, const std::string& subject, uint32_t timeout, zmsg_t** content_p, bool copyContent)
+{
+    if (!content_p || !*content_p || address.empty()) {
+        // consumed whatever happens when not copied
+        if (content_p && !copyContent) {
+            zmsg_destroy(content_p);
+        }
+        _lastResult = Result::Invalid;
+        return "";
+    }
 
     if (!connected()) {
         connect();
     }
+
+    // prepend REQ/uuid to message and send it, copying it only on demand
+    zmsg_t* msg = *content_p;
+    if (copyContent) {
+        msg = zmsg_dup(*content_p);
+    } else {
+        *content_p = nullptr;
+    }
+
+    zuuid_t*    msguid = zuuid_new();
+    std::string uid    = zuuid_str(msguid);
+    zuuid_destroy(&msguid);
+
+    zmsg_pushstr(msg, uid.c_str());
+    zmsg_pushstr(msg, "REQUEST");
+    int sendresult = mlm_client_sendto(_client, address.c_str(), subject.c_str(), nullptr, timeout, &msg);
+    if (sendresult != 0) {
+        log_error(
+            "Sending request to %s (topic %s) failed with result %i.", address.c_str(), subject.c_str(), sendresult);
+        zmsg_destroy(&msg);
+        _lastResult = Result::SendFailed;
+        return "";
+    }
+    if (copyContent) {
+        zmsg_destroy(content_p);
+    }
+
+    // from now on, its reply is kept if it comes while waiting for another one
+    expect(uid);
+    _lastResult = Result::Ok;
+    return uid;
+}
+
+zmsg_t* MlmClient::reply(const std::string& uuid, uint32_t timeout)
+{
     if (timeout > 300)
         timeout = 300;
-    int64_t quit = zclock_mono() + timeout * 1000;
+    return waitReply(uuid, zclock_mono() + timeout * 1000);
+}
 
-    std::string uid;
-    {
-        // prepend REQ/uuid to message and send it
-        zmsg_t* msg = zmsg_dup(*content_p);
-
-        zuuid_t* msguid = zuuid_new();
-        uid             = zuuid_str(msguid);
-        zuuid_destroy(&msguid);
-
-        zmsg_pushstr(msg, uid.c_str());
-        zmsg_pushstr(msg, "REQUEST");
-        int sendresult = mlm_client_sendto(_client, address.c_str(), subject.c_str(), nullptr, timeout, &msg);
-        if (sendresult != 0) {
-            log_error("Sending request to %s (topic %s) failed with result %i.", address.c_str(), subject.c_str(),
-                sendresult);
-            zmsg_destroy(&msg);
-            return nullptr;
-        }
-        zmsg_destroy(content_p);
+zmsg_t* MlmClient::reply(const std::string& uuid, std::chrono::milliseconds timeout)
+{
+    return waitReply(uuid, quitOf(deadlineOf(timeout)));
+}
+
+zmsg_t* MlmClient::reply(const std::string& uuid, Clock::time_point deadline)
+{
+    return waitReply(uuid, quitOf(deadline));
+}
+
+zmsg_t* MlmClient::requestreply(const std::string& address, const std::string& subject,
+    std::chrono::milliseconds timeout, zmsg_t** content_p, bool copyContent)
+{
+    return requestreply(address, subject, deadlineOf(timeout), content_p, copyContent);
+}
+
+zmsg_t* MlmClient::requestreply(const std::string& address, const std::string& subject, Clock::time_point deadline,
+    zmsg_t** content_p, bool copyContent)
+{
+    // mlm_client_sendto() takes an uint32_t
+    int64_t     sendTimeout = std::min(std::max(int64_t(_sendTimeout.count()), int64_t(0)), int64_t(UINT32_MAX));
+    std::string uid         = request(address, subject, uint32_t(sendTimeout), content_p, copyContent);
+    if (uid.empty()) {
+        return nullptr;
     }
-    {
-        // wait for reply with the right uuid
-        while (true) {
-            int64_t poller_timeout = quit - zclock_mono();
-            if (poller_timeout <= 0) {
-                return nullptr;
-            }
-            void* which = zpoller_wait(_poller, int(poller_timeout));
-            if (which == nullptr) {
-                log_warning("zpoller_wait (timeout = '%" PRIu64
-                            "') returned NULL. zpoller_expired == '%s', zpoller_terminated == '%s'",
-                    poller_timeout, zpoller_expired(_poller) ? "true" : "false",
-                    zpoller_terminated(_poller) ? "true" : "false");
-                return nullptr;
-            }
-            zmsg_t* msg = mlm_client_recv(_client);
-            if (!msg)
-                continue;
-            char* msg_uuid = zmsg_popstr(msg);
-            char* msg_cmd  = zmsg_popstr(msg);
-            if (!msg_cmd || !streq(msg_cmd, "REPLY") || !msg_uuid || !streq(msg_uuid, uid.c_str())) {
-                // this is not the message we are waiting for
-                log_info("Discarting unexpected/invalid message from %s (topic %s)", sender(), this->subject());
-                zmsg_destroy(&msg);
-            }
+    return waitReply(uid, quitOf(deadline));
+}
+
+zmsg_t* MlmClient::waitReply(const std::string& uuid, int64_t quit)
+{
+    // wait for reply with the right uuid
+    while (zmsg_t* msg = waitFor(uuid, quit)) {
+        char* msg_cmd = zmsg_popstr(msg);
+        if (msg_cmd && streq(msg_cmd, "REPLY")) {
             zstr_free(&msg_cmd);
-            zstr_free(&msg_uuid);
-            if (msg)
-                return msg;
+            return msg;
         }
+        // this is not the message we are waiting for
+        log_info("Discarting unexpected/invalid message from %s (topic %s)", sender(), this->subject());
+        zstr_free(&msg_cmd);
+        zmsg_destroy(&msg);
     }
+    return nullptr;
 }
 
 void MlmClient::connect()
 {
-    std::string name("rest.");
+    std::string name(_prefix);
     name.append(zuuid_str_canonical(_uuid));
-    int rv = mlm_client_connect(_client, ENDPOINT.c_str(), 5000, name.c_str());
+    int rv = mlm_client_connect(_client, _endpoint.c_str(), 5000, name.c_str());
     if (rv == -1) {
-        log_error("mlm_client_connect (endpoint = '%s', timeout = 5000, address = '%s') failed", ENDPOINT.c_str(),
+        log_error("mlm_client_connect (endpoint = '%s', timeout = 5000, address = '%s') failed", _endpoint.c_str(),
             name.c_str());
     }
 }
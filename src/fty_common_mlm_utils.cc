@@ -21,7 +21,9 @@
 
 #include <fty_common_mlm_utils.h>
 #include <fty_common_utf8.h>
+#include <algorithm>
 #include <fty_log.h>
+#include <functional>
 
 namespace MlmUtils {
 
@@ -50,4 +52,71 @@ zhash_t* map_to_zhash(std::map<std::string, std::string> map_to_convert)
     return hash;
 }
 
+int zmsg_trysend(zmsg_t** message, void* socket)
+{
+    size_t count = zmsg_size(*message);
+    size_t index = 0;
+    for (zframe_t* frame = zmsg_first(*message); frame != nullptr; frame = zmsg_next(*message)) {
+        // only the first frame can fail: once it is queued, zmq queues the whole message
+        if (zframe_send(&frame, socket, ZFRAME_REUSE | (++index < count ? ZFRAME_MORE : 0)) != 0) {
+            return -1;
+        }
+    }
+    zmsg_destroy(message);
+    return 0;
+}
+
+std::string shardName(const std::string& name, size_t index)
+{
+    return name + "." + std::to_string(index);
+}
+
+uint64_t fnv1a(const void* data, size_t size, uint64_t hash)
+{
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+size_t shardOf(const std::string& key, size_t shards)
+{
+    if (shards <= 1) {
+        return 0;
+    }
+
+    // jump consistent hash (Lamping & Veach)
+    uint64_t hash   = fnv1a(key.data(), key.size());
+    int64_t  bucket = -1;
+    int64_t  jump   = 0;
+    while (jump < int64_t(shards)) {
+        bucket = jump;
+        hash   = hash * 2862933555777941757ULL + 1;
+        jump   = int64_t(double(bucket + 1) * (double(1LL << 31) / double((hash >> 33) + 1)));
+    }
+    return size_t(bucket);
+}
+
+std::vector<std::string> rendezvousOrder(const std::string& key, const std::vector<std::string>& nodes)
+{
+    std::vector<std::pair<uint64_t, std::string>> weighted;
+    for (const std::string& node : nodes) {
+        // FNV-1a is weak on similar strings (endpoints differing by a digit), mixed as in splitmix64
+        std::string part   = key + '\n' + node;
+        uint64_t    weight = fnv1a(part.data(), part.size());
+        weight             = (weight ^ (weight >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        weight             = (weight ^ (weight >> 27)) * 0x94d049bb133111ebULL;
+        weighted.emplace_back(weight ^ (weight >> 31), node);
+    }
+    std::sort(weighted.begin(), weighted.end(), std::greater<std::pair<uint64_t, std::string>>());
+
+    std::vector<std::string> ordered;
+    for (auto& it : weighted) {
+        ordered.push_back(std::move(it.second));
+    }
+    return ordered;
+}
+
 } // namespace MlmUtils
@@ -0,0 +1,503 @@
+/*  =========================================================================
+    fty_common_mlm_agent - Helper C++ class to build a malamute agent (server)
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#include "fty_common_mlm_agent.h"
+#include "fty_common_mlm_guards.h"
+#include <catch2/catch.hpp>
+#include <map>
+#include <string>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <vector>
+
+static const char* testEndpoint = "inproc://fty_common_mlm_agent_test";
+
+static std::vector<std::string> s_handled;
+
+class LaneAgent : public mlm::MlmAgent
+{
+public:
+    explicit LaneAgent(zsock_t* pipe)
+        : mlm::MlmAgent(pipe, testEndpoint, "lane-agent")
+    {
+    }
+
+private:
+    bool handleMailbox(zmsg_t* /*message*/) override
+    {
+        s_handled.push_back(subject());
+        // keep the agent busy while the client fills the connection
+        if (s_handled.size() == 1) {
+            zclock_sleep(300);
+        }
+        return true;
+    }
+};
+
+static void lane_agent_actor(zsock_t* pipe, void* /*args*/)
+{
+    LaneAgent agent(pipe);
+    agent.setPriorityLanes(2, [](const char* subject, zmsg_t* /*message*/) {
+        return streq(subject, "HEALTH") ? 0u : 1u;
+    });
+    agent.mainloop();
+}
+
+TEST_CASE("Agent priority lanes")
+{
+    zactor_t* broker = zactor_new(mlm_server, const_cast<char*>("Malamute"));
+    zstr_sendx(broker, "BIND", testEndpoint, NULL);
+
+    s_handled.clear();
+    zactor_t* agent = zactor_new(lane_agent_actor, nullptr);
+
+    {
+        MlmClientGuard client(mlm_client_new());
+        REQUIRE(mlm_client_connect(client, testEndpoint, 1000, "lane-client") == 0);
+
+        auto send = [&](const char* subject) {
+            zmsg_t* msg = zmsg_new();
+            zmsg_addstr(msg, subject);
+            CHECK(mlm_client_sendto(client, "lane-agent", subject, nullptr, 1000, &msg) == 0);
+        };
+
+        send("BULK");
+        zclock_sleep(100);
+        for (int i = 0; i < 5; i++) {
+            send("BULK");
+        }
+        send("HEALTH");
+        zclock_sleep(800);
+    }
+
+    zactor_destroy(&agent);
+    zactor_destroy(&broker);
+
+    REQUIRE(s_handled.size() == 7);
+    // the health check overtakes the bulk requests queued before it
+    CHECK(s_handled[0] == "BULK");
+    CHECK(s_handled[1] == "HEALTH");
+}
+
+static const size_t benchmarkMessages = 20000;
+
+class CountingAgent : public mlm::MlmAgent
+{
+public:
+    explicit CountingAgent(zsock_t* pipe)
+        : mlm::MlmAgent(pipe, testEndpoint, "counting-agent")
+    {
+    }
+
+private:
+    bool handleMailbox(zmsg_t* /*message*/) override
+    {
+        if (++m_count == benchmarkMessages) {
+            zstr_send(pipe(), "DONE");
+        }
+        return true;
+    }
+
+    size_t m_count = 0;
+};
+
+static void counting_agent_actor(zsock_t* pipe, void* args)
+{
+    CountingAgent agent(pipe);
+    agent.setBatch(*static_cast<size_t*>(args));
+    agent.mainloop();
+}
+
+// hidden by default, run it with: <test binary> "[benchmark]"
+TEST_CASE("Agent batch throughput", "[.][benchmark]")
+{
+    zactor_t* broker = zactor_new(mlm_server, const_cast<char*>("Malamute"));
+    zstr_sendx(broker, "BIND", testEndpoint, NULL);
+
+    for (size_t batch : {size_t(1), size_t(16), size_t(256)}) {
+        zactor_t* agent = zactor_new(counting_agent_actor, &batch);
+
+        MlmClientGuard client(mlm_client_new());
+        REQUIRE(mlm_client_connect(client, testEndpoint, 1000, "counting-client") == 0);
+
+        int64_t start = zclock_usecs();
+        for (size_t i = 0; i < benchmarkMessages; i++) {
+            zmsg_t* msg = zmsg_new();
+            zmsg_addstr(msg, "payload");
+            REQUIRE(mlm_client_sendto(client, "counting-agent", "BENCH", nullptr, 1000, &msg) == 0);
+        }
+        ZstrGuard done(zstr_recv(agent));
+        int64_t   elapsed = zclock_usecs() - start;
+        CHECK(streq(done, "DONE"));
+
+        printf("batch %4zu: %zu messages in %" PRId64 " ms, %.0f msg/s\n", batch, benchmarkMessages,
+            elapsed / 1000, double(benchmarkMessages) * 1e6 / double(elapsed));
+
+        zactor_destroy(&agent);
+    }
+
+    zactor_destroy(&broker);
+}
+
+class SocketAgent : public mlm::MlmAgent
+{
+public:
+    explicit SocketAgent(zsock_t* pipe)
+        : mlm::MlmAgent(pipe, testEndpoint, "socket-agent")
+        , m_pull(zsock_new_pull("inproc://fty_common_mlm_agent_test_pull"))
+    {
+        registerSocket(m_pull, [this](zmsg_t* message) {
+            ZstrGuard frame(zmsg_popstr(message));
+            s_handled.push_back(frame.get());
+            if (streq(frame, "last")) {
+                bool unregistered = unregisterSocket(m_pull) && !unregisterSocket(m_pull);
+                zstr_send(this->pipe(), unregistered ? "UNREGISTERED" : "FAILED");
+            }
+            return true;
+        });
+    }
+
+    ~SocketAgent() override
+    {
+        zsock_destroy(&m_pull);
+    }
+
+private:
+    zsock_t* m_pull;
+};
+
+static void socket_agent_actor(zsock_t* pipe, void* /*args*/)
+{
+    SocketAgent agent(pipe);
+    agent.mainloop();
+}
+
+TEST_CASE("Agent registered sockets")
+{
+    zactor_t* broker = zactor_new(mlm_server, const_cast<char*>("Malamute"));
+    zstr_sendx(broker, "BIND", testEndpoint, NULL);
+
+    s_handled.clear();
+    zactor_t* agent = zactor_new(socket_agent_actor, nullptr);
+
+    zsock_t* push = zsock_new_push(">inproc://fty_common_mlm_agent_test_pull");
+    zstr_send(push, "first");
+    zstr_send(push, "second");
+    zstr_send(push, "last");
+
+    ZstrGuard unregistered(zstr_recv(agent));
+    CHECK(streq(unregistered, "UNREGISTERED"));
+
+    // no longer polled
+    zstr_send(push, "ignored");
+    zclock_sleep(100);
+
+    zactor_destroy(&agent);
+    zsock_destroy(&push);
+    zactor_destroy(&broker);
+
+    CHECK(s_handled == std::vector<std::string>({"first", "second", "last"}));
+}
+
+class EpollAgent : public mlm::MlmAgent
+{
+public:
+    explicit EpollAgent(zsock_t* pipe)
+        : mlm::MlmAgent(pipe, testEndpoint, "epoll-agent")
+    {
+        setBackend(Backend::Epoll);
+        registerFd(s_eventFd, [this](int fd, uint32_t events) {
+            uint64_t value = 0;
+            if (!(events & EPOLLIN) || read(fd, &value, sizeof(value)) != sizeof(value)) {
+                zstr_sendx(this->pipe(), "FAILED", "", NULL);
+                return true;
+            }
+            zstr_sendx(this->pipe(), "EVENT", std::to_string(value).c_str(), NULL);
+            return true;
+        });
+    }
+
+    static int s_eventFd;
+
+private:
+    bool handleMailbox(zmsg_t* /*message*/) override
+    {
+        zstr_sendx(pipe(), "MAILBOX", subject(), NULL);
+        return true;
+    }
+};
+
+int EpollAgent::s_eventFd = -1;
+
+static void epoll_agent_actor(zsock_t* pipe, void* /*args*/)
+{
+    EpollAgent agent(pipe);
+    agent.mainloop();
+}
+
+TEST_CASE("Agent epoll backend")
+{
+    zactor_t* broker = zactor_new(mlm_server, const_cast<char*>("Malamute"));
+    zstr_sendx(broker, "BIND", testEndpoint, NULL);
+
+    EpollAgent::s_eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    REQUIRE(EpollAgent::s_eventFd != -1);
+    zactor_t* agent = zactor_new(epoll_agent_actor, nullptr);
+
+    {
+        // raw file descriptor
+        uint64_t value = 3;
+        CHECK(write(EpollAgent::s_eventFd, &value, sizeof(value)) == sizeof(value));
+
+        char* event = nullptr;
+        char* count = nullptr;
+        zstr_recvx(agent, &event, &count, NULL);
+        CHECK(streq(event, "EVENT"));
+        CHECK(streq(count, "3"));
+        zstr_free(&event);
+        zstr_free(&count);
+
+        // malamute connection
+        MlmClientGuard client(mlm_client_new());
+        REQUIRE(mlm_client_connect(client, testEndpoint, 1000, "epoll-client") == 0);
+        zmsg_t* msg = zmsg_new();
+        zmsg_addstr(msg, "data");
+        REQUIRE(mlm_client_sendto(client, "epoll-agent", "HELLO", nullptr, 1000, &msg) == 0);
+
+        char* pattern = nullptr;
+        char* subject = nullptr;
+        zstr_recvx(agent, &pattern, &subject, NULL);
+        CHECK(streq(pattern, "MAILBOX"));
+        CHECK(streq(subject, "HELLO"));
+        zstr_free(&pattern);
+        zstr_free(&subject);
+    }
+
+    // the pipe is watched too
+    zactor_destroy(&agent);
+    close(EpollAgent::s_eventFd);
+    zactor_destroy(&broker);
+}
+
+class RoutingAgent : public mlm::MlmAgent
+{
+public:
+    explicit RoutingAgent(zsock_t* pipe)
+        : mlm::MlmAgent(pipe, testEndpoint, "routing-agent")
+    {
+        mlm_client_set_consumer(client(), "ROUTING-STREAM", ".*");
+        onMailbox("PING", [this](zmsg_t* /*message*/) {
+            s_handled.push_back(std::string("mailbox PING"));
+            // replace the running handler
+            onMailbox("PING", [](zmsg_t* /*message*/) {
+                s_handled.push_back(std::string("mailbox PING again"));
+                return true;
+            });
+            return true;
+        });
+        onStream("ROUTING-STREAM", "ALERT", [](zmsg_t* /*message*/) {
+            s_handled.push_back(std::string("stream ALERT"));
+            return true;
+        });
+        onStream("ROUTING-STREAM", "^METRIC@", [this](zmsg_t* /*message*/) {
+            // remove the running handler, its captures stay valid until it returns
+            onStream("ROUTING-STREAM", "^METRIC@", nullptr);
+            s_handled.push_back(std::string("stream ") + subject());
+            return true;
+        });
+    }
+
+private:
+    bool handleMailbox(zmsg_t* /*message*/) override
+    {
+        s_handled.push_back(std::string("handleMailbox ") + subject());
+        return true;
+    }
+
+    bool handleStream(zmsg_t* /*message*/) override
+    {
+        s_handled.push_back(std::string("handleStream ") + subject());
+        if (streq(subject(), "DONE")) {
+            zstr_send(pipe(), "DONE");
+        }
+        return true;
+    }
+};
+
+static void routing_agent_actor(zsock_t* pipe, void* /*args*/)
+{
+    RoutingAgent agent(pipe);
+    agent.mainloop();
+}
+
+TEST_CASE("Agent subject handlers")
+{
+    zactor_t* broker = zactor_new(mlm_server, const_cast<char*>("Malamute"));
+    zstr_sendx(broker, "BIND", testEndpoint, NULL);
+
+    s_handled.clear();
+    zactor_t* agent = zactor_new(routing_agent_actor, nullptr);
+
+    {
+        MlmClientGuard client(mlm_client_new());
+        REQUIRE(mlm_client_connect(client, testEndpoint, 1000, "routing-client") == 0);
+        REQUIRE(mlm_client_set_producer(client, "ROUTING-STREAM") == 0);
+
+        for (const char* subject : {"PING", "PING", "OTHER"}) {
+            zmsg_t* msg = zmsg_new();
+            zmsg_addstr(msg, subject);
+            CHECK(mlm_client_sendto(client, "routing-agent", subject, nullptr, 1000, &msg) == 0);
+        }
+        for (const char* subject : {"ALERT", "ALERT@ups-1", "METRIC@ups-1", "ups-1@METRIC@", "DONE"}) {
+            zmsg_t* msg = zmsg_new();
+            zmsg_addstr(msg, subject);
+            CHECK(mlm_client_send(client, subject, &msg) == 0);
+        }
+
+        ZstrGuard done(zstr_recv(agent));
+        CHECK(streq(done, "DONE"));
+    }
+
+    zactor_destroy(&agent);
+    zactor_destroy(&broker);
+
+    std::vector<std::string> expected = {"mailbox PING", "mailbox PING again", "handleMailbox OTHER", "stream ALERT",
+        "handleStream ALERT@ups-1", "stream METRIC@ups-1", "handleStream ups-1@METRIC@", "handleStream DONE"};
+    CHECK(s_handled == expected);
+}
+
+TEST_CASE("Agent stats")
+{
+    zactor_t* broker = zactor_new(mlm_server, const_cast<char*>("Malamute"));
+    zstr_sendx(broker, "BIND", testEndpoint, NULL);
+
+    s_handled.clear();
+    zactor_t* agent = zactor_new(routing_agent_actor, nullptr);
+
+    {
+        MlmClientGuard client(mlm_client_new());
+        REQUIRE(mlm_client_connect(client, testEndpoint, 1000, "stats-client") == 0);
+        REQUIRE(mlm_client_set_producer(client, "ROUTING-STREAM") == 0);
+
+        zmsg_t* msg = zmsg_new();
+        zmsg_addstr(msg, "0123456789");
+        CHECK(mlm_client_sendto(client, "routing-agent", "OTHER", nullptr, 1000, &msg) == 0);
+        msg = zmsg_new();
+        zmsg_addstr(msg, "DONE");
+        CHECK(mlm_client_send(client, "DONE", &msg) == 0);
+
+        ZstrGuard done(zstr_recv(agent));
+        CHECK(streq(done, "DONE"));
+    }
+
+    zstr_send(agent, "STATS");
+    ZmsgGuard reply(zmsg_recv(agent));
+    ZstrGuard header(zmsg_popstr(reply));
+    CHECK(streq(header, "STATS"));
+
+    std::map<std::string, std::string> stats;
+    while (zmsg_size(reply) >= 2) {
+        ZstrGuard name(zmsg_popstr(reply));
+        ZstrGuard value(zmsg_popstr(reply));
+        stats[name.get()] = value.get();
+    }
+    CHECK(stats["mailbox.messages"] == "1");
+    CHECK(stats["mailbox.bytes"] == "10");
+    CHECK(stats["stream.messages"] == "1");
+    CHECK(std::stoul(stats["iterations"]) >= 2);
+    CHECK(stats.count("maxHandlerTime") == 1);
+
+    zactor_destroy(&agent);
+    zactor_destroy(&broker);
+}
+
+class ReconnectingAgent : public mlm::MlmAgent
+{
+public:
+    explicit ReconnectingAgent(zsock_t* pipe)
+        : mlm::MlmAgent(pipe, testEndpoint, "reconnecting-agent")
+    {
+        setConsumer("RECONNECT-STREAM", ".*");
+        setReconnect(100, 50, 400);
+    }
+
+private:
+    void onDisconnect() override
+    {
+        zstr_send(pipe(), "DISCONNECTED");
+    }
+
+    void onReconnect() override
+    {
+        zstr_send(pipe(), "RECONNECTED");
+    }
+
+    bool handleStream(zmsg_t* /*message*/) override
+    {
+        zstr_send(pipe(), subject());
+        return true;
+    }
+};
+
+static void reconnecting_agent_actor(zsock_t* pipe, void* /*args*/)
+{
+    ReconnectingAgent agent(pipe);
+    agent.mainloop();
+}
+
+TEST_CASE("Agent reconnection")
+{
+    zactor_t* broker = zactor_new(mlm_server, const_cast<char*>("Malamute"));
+    zstr_sendx(broker, "BIND", testEndpoint, NULL);
+
+    zactor_t* agent = zactor_new(reconnecting_agent_actor, nullptr);
+    // the broker heartbeats decide how long it takes to notice the restart
+    zsock_set_rcvtimeo(agent, 30000);
+
+    // restart the broker
+    zactor_destroy(&broker);
+    broker = zactor_new(mlm_server, const_cast<char*>("Malamute"));
+    zstr_sendx(broker, "BIND", testEndpoint, NULL);
+
+    ZstrGuard disconnected(zstr_recv(agent));
+    REQUIRE(disconnected.get() != nullptr);
+    CHECK(streq(disconnected, "DISCONNECTED"));
+    ZstrGuard reconnected(zstr_recv(agent));
+    REQUIRE(reconnected.get() != nullptr);
+    CHECK(streq(reconnected, "RECONNECTED"));
+
+    {
+        // the stream consumer was restored
+        MlmClientGuard client(mlm_client_new());
+        REQUIRE(mlm_client_connect(client, testEndpoint, 1000, "reconnecting-client") == 0);
+        REQUIRE(mlm_client_set_producer(client, "RECONNECT-STREAM") == 0);
+        zmsg_t* msg = zmsg_new();
+        zmsg_addstr(msg, "data");
+        CHECK(mlm_client_send(client, "AFTER-RESTART", &msg) == 0);
+
+        ZstrGuard received(zstr_recv(agent));
+        REQUIRE(received.get() != nullptr);
+        CHECK(streq(received, "AFTER-RESTART"));
+    }
+
+    zactor_destroy(&agent);
+    zactor_destroy(&broker);
+}
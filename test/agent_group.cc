@@ -0,0 +1,115 @@
+/*  =========================================================================
+    fty_common_mlm_agent_group - Runtime running the shards of a malamute agent
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#include "fty_common_mlm_agent_group.h"
+#include "fty_common_mlm_guards.h"
+#include "fty_common_mlm_utils.h"
+#include <atomic>
+#include <catch2/catch.hpp>
+#include <string>
+
+static const char*  testEndpoint = "inproc://fty_common_mlm_agent_group_test";
+static const char*  groupName    = "group-agent";
+static const size_t shards       = 3;
+
+static std::atomic<int> s_counts[shards];
+
+class ShardAgent : public mlm::MlmAgent
+{
+public:
+    ShardAgent(zsock_t* pipe, size_t shard)
+        : mlm::MlmAgent(pipe, testEndpoint, MlmUtils::shardName(groupName, shard).c_str())
+        , m_shard(shard)
+    {
+        mlm_client_set_consumer(client(), "GROUP-STREAM", ".*");
+        setStreamPartition(shard, shards);
+    }
+
+private:
+    bool handleStream(zmsg_t* /*message*/) override
+    {
+        s_counts[m_shard]++;
+        return true;
+    }
+
+    bool handleMailbox(zmsg_t* /*message*/) override
+    {
+        zmsg_t* reply = zmsg_new();
+        zmsg_addstr(reply, std::to_string(m_shard).c_str());
+        mlm_client_sendto(client(), sender(), "REPLY", nullptr, 1000, &reply);
+        return true;
+    }
+
+    size_t m_shard;
+};
+
+TEST_CASE("Agent group")
+{
+    zactor_t* broker = zactor_new(mlm_server, const_cast<char*>("Malamute"));
+    zstr_sendx(broker, "BIND", testEndpoint, NULL);
+
+    for (auto& count : s_counts) {
+        count = 0;
+    }
+
+    {
+        mlm::MlmAgentGroup group(shards, [](zsock_t* pipe, size_t shard) {
+            return std::unique_ptr<mlm::MlmAgent>(new ShardAgent(pipe, shard));
+        });
+        REQUIRE(group.size() == shards);
+
+        MlmClientGuard client(mlm_client_new());
+        REQUIRE(mlm_client_connect(client, testEndpoint, 1000, "group-client") == 0);
+        REQUIRE(mlm_client_set_producer(client, "GROUP-STREAM") == 0);
+
+        // every stream message is handled by the shard of its subject only
+        int expected[shards] = {};
+        for (int i = 0; i < 30; i++) {
+            std::string subject = "asset-" + std::to_string(i);
+            expected[MlmUtils::shardOf(subject, shards)]++;
+
+            zmsg_t* msg = zmsg_new();
+            zmsg_addstr(msg, subject.c_str());
+            CHECK(mlm_client_send(client, subject.c_str(), &msg) == 0);
+        }
+
+        // each shard has its own mailbox, answered once its stream messages are handled
+        for (size_t shard = 0; shard < shards; shard++) {
+            zmsg_t* msg = zmsg_new();
+            zmsg_addstr(msg, "PING");
+            CHECK(mlm_client_sendto(
+                      client, MlmUtils::shardName(groupName, shard).c_str(), "REQUEST", nullptr, 1000, &msg) == 0);
+
+            ZmsgGuard reply(mlm_client_recv(client));
+            REQUIRE(reply.get() != nullptr);
+            ZstrGuard replyShard(zmsg_popstr(reply));
+            CHECK(std::to_string(shard) == replyShard.get());
+            CHECK(s_counts[shard] == expected[shard]);
+        }
+
+        zstr_send(group.actor(0), "STATS");
+        ZmsgGuard stats(zmsg_recv(group.actor(0)));
+        ZstrGuard header(zmsg_popstr(stats));
+        CHECK(streq(header, "STATS"));
+    }
+
+    zactor_destroy(&broker);
+}
@@ -68,3 +68,226 @@ TEST_CASE("Basic mailbox server")
 
     printf("Ok\n");
 }
+
+static const char* dedupAgentName = "fty_common_mlm_basic_mailbox_server_dedup";
+
+class CountingServer : public fty::SyncServer
+{
+public:
+    fty::Payload handleRequest(const fty::Sender& /*sender*/, const fty::Payload& payload) override
+    {
+        m_count++;
+        return {payload.front(), std::to_string(m_count)};
+    }
+
+    int m_count = 0;
+};
+
+static CountingServer s_countingServer;
+
+static void fty_common_mlm_basic_mailbox_server_dedup_actor(zsock_t* pipe, void* /*args*/)
+{
+    mlm::MlmBasicMailboxServer agent(pipe, s_countingServer, dedupAgentName, testEndpoint);
+    agent.setDuplicateSuppression(16);
+    agent.mainloop();
+}
+
+TEST_CASE("Basic mailbox server duplicate requests")
+{
+    zactor_t* broker = zactor_new(mlm_server, const_cast<char*>("Malamute"));
+    zstr_sendx(broker, "BIND", testEndpoint, NULL);
+
+    zactor_t* server = zactor_new(fty_common_mlm_basic_mailbox_server_dedup_actor, nullptr);
+
+    {
+        MlmClientGuard client(mlm_client_new());
+        REQUIRE(mlm_client_connect(client, testEndpoint, 1000, "test_dedup.0000002a") == 0);
+
+        auto request = [&](const char* correlationId) {
+            zmsg_t* msg = zmsg_new();
+            zmsg_addstr(msg, correlationId);
+            zmsg_addstr(msg, "data");
+            REQUIRE(mlm_client_sendto(client, dedupAgentName, "REQUEST", nullptr, 1000, &msg) == 0);
+
+            ZmsgGuard reply(mlm_client_recv(client));
+            REQUIRE(zmsg_size(reply) == 3);
+            ZstrGuard replyId(zmsg_popstr(reply));
+            CHECK(streq(replyId, correlationId));
+            ZstrGuard data(zmsg_popstr(reply));
+            ZstrGuard count(zmsg_popstr(reply));
+            return std::string(count.get());
+        };
+
+        CHECK(request("id-1") == "1");
+        // a retry is answered without calling the handler again
+        CHECK(request("id-1") == "1");
+        CHECK(request("id-2") == "2");
+        CHECK(s_countingServer.m_count == 2);
+    }
+
+    zactor_destroy(&server);
+    zactor_destroy(&broker);
+}
+
+TEST_CASE("Basic mailbox server group")
+{
+    static const char* groupName = "fty_common_mlm_basic_mailbox_server_group";
+
+    zactor_t* broker = zactor_new(mlm_server, const_cast<char*>("Malamute"));
+    zstr_sendx(broker, "BIND", testEndpoint, NULL);
+
+    {
+        fty::EchoServer                  server;
+        mlm::MlmBasicMailboxServerGroup group(server, groupName, 3, testEndpoint);
+        CHECK(group.size() == 3);
+
+        mlm::MlmSyncClient keyed("test_client", groupName, 1000, testEndpoint);
+        keyed.setShards(3, 0);
+        mlm::MlmSyncClient roundRobin("test_client", groupName, 1000, testEndpoint);
+        roundRobin.setShards(3);
+
+        for (int i = 0; i < 6; i++) {
+            fty::Payload expectedPayload = {"key-" + std::to_string(i), "test"};
+            CHECK(keyed.syncRequestWithReply(expectedPayload) == expectedPayload);
+            CHECK(roundRobin.syncRequestWithReply(expectedPayload) == expectedPayload);
+        }
+    }
+
+    zactor_destroy(&broker);
+}
+
+static const char* drainAgentName = "fty_common_mlm_basic_mailbox_server_drain";
+
+class SlowServer : public fty::SyncServer
+{
+public:
+    fty::Payload handleRequest(const fty::Sender& /*sender*/, const fty::Payload& payload) override
+    {
+        zclock_sleep(300);
+        return payload;
+    }
+};
+
+static void fty_common_mlm_basic_mailbox_server_drain_actor(zsock_t* pipe, void* /*args*/)
+{
+    SlowServer                 server;
+    mlm::MlmBasicMailboxServer agent(pipe, server, drainAgentName, testEndpoint);
+    agent.setDrain(5000);
+    agent.setShutdownReply({"ERROR", "shutting down"});
+    agent.mainloop();
+}
+
+TEST_CASE("Basic mailbox server drain")
+{
+    zactor_t* broker = zactor_new(mlm_server, const_cast<char*>("Malamute"));
+    zstr_sendx(broker, "BIND", testEndpoint, NULL);
+
+    zactor_t* server = zactor_new(fty_common_mlm_basic_mailbox_server_drain_actor, nullptr);
+
+    {
+        MlmClientGuard client(mlm_client_new());
+        REQUIRE(mlm_client_connect(client, testEndpoint, 1000, "test_drain.0000002a") == 0);
+
+        auto request = [&](const char* correlationId) {
+            zmsg_t* msg = zmsg_new();
+            zmsg_addstr(msg, correlationId);
+            zmsg_addstr(msg, "data");
+            REQUIRE(mlm_client_sendto(client, drainAgentName, "REQUEST", nullptr, 1000, &msg) == 0);
+        };
+        auto reply = [&]() {
+            ZmsgGuard msg(mlm_client_recv(client));
+            std::vector<std::string> frames;
+            while (zmsg_size(msg) > 0) {
+                ZstrGuard frame(zmsg_popstr(msg));
+                frames.push_back(frame.get());
+            }
+            return frames;
+        };
+
+        // $TERM arrives while the first request is being handled, before the second one
+        request("id-1");
+        zclock_sleep(100);
+        zstr_send(server, "$TERM");
+        zclock_sleep(50);
+        request("id-2");
+
+        CHECK(reply() == std::vector<std::string>{"id-1", "data"});
+        CHECK(reply() == std::vector<std::string>{"id-2", "ERROR", "shutting down"});
+    }
+
+    zactor_destroy(&server);
+    zactor_destroy(&broker);
+}
+
+static const char* directAgentName = "fty_common_mlm_basic_mailbox_server_direct";
+
+static void fty_common_mlm_basic_mailbox_server_direct_actor(zsock_t* pipe, void* /*args*/)
+{
+    fty::EchoServer            server;
+    mlm::MlmBasicMailboxServer agent(pipe, server, directAgentName, testEndpoint);
+    agent.setDirectEndpoint("inproc://fty_common_mlm_basic_mailbox_server_direct");
+    agent.mainloop();
+}
+
+TEST_CASE("Basic mailbox server direct channel")
+{
+    zactor_t* broker = zactor_new(mlm_server, const_cast<char*>("Malamute"));
+    zstr_sendx(broker, "BIND", testEndpoint, NULL);
+
+    zactor_t* direct = zactor_new(fty_common_mlm_basic_mailbox_server_direct_actor, nullptr);
+    zactor_t* server = zactor_new(fty_common_mlm_basic_mailbox_server_test_actor, nullptr);
+
+    {
+        fty::Payload payload = {"This", "is", "a", "test"};
+
+        // negotiated at the first request, then reused
+        mlm::MlmSyncClient client("test_client", directAgentName, 1000, testEndpoint);
+        client.setDirect(true);
+        for (int i = 0; i < 3; i++) {
+            CHECK(client.syncRequestWithReply(payload) == payload);
+        }
+
+        // a server without channel is still reached through its mailbox
+        mlm::MlmSyncClient mailbox("test_client", testAgentName, 1000, testEndpoint);
+        mailbox.setDirect(true);
+        CHECK(mailbox.syncRequestWithReply(payload) == payload);
+        CHECK(mailbox.syncRequestWithReply(payload) == payload);
+    }
+
+    zactor_destroy(&server);
+    zactor_destroy(&direct);
+    zactor_destroy(&broker);
+}
+
+static const char* slowAgentName = "fty_common_mlm_basic_mailbox_server_slow";
+
+static void fty_common_mlm_basic_mailbox_server_slow_actor(zsock_t* pipe, void* /*args*/)
+{
+    SlowServer                 server;
+    mlm::MlmBasicMailboxServer agent(pipe, server, slowAgentName, testEndpoint);
+    agent.setDirectEndpoint("inproc://fty_common_mlm_basic_mailbox_server_slow");
+    agent.mainloop();
+}
+
+TEST_CASE("Basic mailbox server direct channel timeout")
+{
+    zactor_t* broker = zactor_new(mlm_server, const_cast<char*>("Malamute"));
+    zstr_sendx(broker, "BIND", testEndpoint, NULL);
+
+    zactor_t* server = zactor_new(fty_common_mlm_basic_mailbox_server_slow_actor, nullptr);
+
+    {
+        mlm::MlmSyncClient client("test_client", slowAgentName, 1000, testEndpoint);
+        client.setDirect(true);
+        client.setReplyTimeout(std::chrono::milliseconds(100));
+
+        // no reply in time: the request fails, the others go through the mailbox until negotiated again
+        CHECK_THROWS_AS(client.syncRequestWithReply({"slow"}), std::runtime_error);
+        zclock_sleep(300);
+        client.setReplyTimeout(std::chrono::milliseconds(1000));
+        CHECK(client.syncRequestWithReply({"slow"}) == fty::Payload{"slow"});
+    }
+
+    zactor_destroy(&server);
+    zactor_destroy(&broker);
+}
@@ -0,0 +1,288 @@
+/*  =========================================================================
+    fty_common_mlm_connection_manager - Broker sessions shared by the clients of a process
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#include "fty_common_mlm_connection_manager.h"
+#include "fty_common_mlm_basic_mailbox_server.h"
+#include "fty_common_mlm_guards.h"
+#include "fty_common_mlm_stream_client.h"
+#include "fty_common_mlm_sync_client.h"
+#include "fty_common_mlm_utils.h"
+#include <atomic>
+#include <catch2/catch.hpp>
+#include <fty_common_unit_tests.h>
+#include <thread>
+#include <vector>
+
+static const char* testEndpoint  = "inproc://fty_common_mlm_connection_manager_test";
+static const char* testAgentName = "fty_common_mlm_connection_manager_test";
+
+static void fty_common_mlm_connection_manager_test_actor(zsock_t* pipe, void* /*args*/)
+{
+    fty::EchoServer            server;
+    mlm::MlmBasicMailboxServer agent(pipe, server, testAgentName, testEndpoint);
+    agent.mainloop();
+}
+
+TEST_CASE("Connection manager requests")
+{
+    mlm::MlmConnectionManager& manager = mlm::MlmConnectionManager::instance();
+
+    zactor_t* broker = zactor_new(mlm_server, const_cast<char*>("Malamute"));
+    zstr_sendx(broker, "BIND", testEndpoint, NULL);
+    zactor_t* server = zactor_new(fty_common_mlm_connection_manager_test_actor, nullptr);
+
+    {
+        // several threads, several clients of the same identity: one session, kept open by the clients
+        mlm::MlmSyncClient       keeper("test_client", testAgentName, 1000, testEndpoint);
+        std::atomic<int>         replies{0};
+        std::vector<std::thread> threads;
+        for (int i = 0; i < 4; i++) {
+            threads.emplace_back([&, i]() {
+                mlm::MlmSyncClient client("test_client", testAgentName, 1000, testEndpoint);
+                for (int j = 0; j < 20; j++) {
+                    fty::Payload payload = {std::to_string(i), std::to_string(j)};
+                    if (client.syncRequestWithReply(payload) == payload) {
+                        replies++;
+                    }
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        CHECK(replies == 80);
+        CHECK(manager.sessions() == 1);
+
+        // a reply never comes
+        zmsg_t* request = zmsg_new();
+        zmsg_addstr(request, "id-1");
+        zmsg_t* reply = manager.requestReply(testEndpoint, "test_client", "nobody", "REQUEST", "id-1", &request, 1000,
+            mlm::MlmConnectionManager::Clock::now() + std::chrono::milliseconds(100));
+        CHECK(reply == nullptr);
+        CHECK(request == nullptr);
+        CHECK(manager.sessions() == 1);
+    }
+
+    // closed with its last client
+    CHECK(manager.sessions() == 0);
+
+    zactor_destroy(&server);
+    zactor_destroy(&broker);
+}
+
+TEST_CASE("Connection manager streams")
+{
+    mlm::MlmConnectionManager& manager = mlm::MlmConnectionManager::instance();
+
+    zactor_t* broker = zactor_new(mlm_server, const_cast<char*>("Malamute"));
+    zstr_sendx(broker, "BIND", testEndpoint, NULL);
+
+    {
+        std::atomic<int> first{0};
+        std::atomic<int> second{0};
+
+        mlm::MlmStreamClient subscriber("test_client", "TEST-STREAM", 1000, testEndpoint);
+        mlm::MlmStreamClient other("test_client", "TEST-STREAM", 1000, testEndpoint);
+        uint32_t             id = subscriber.subscribe([&](const std::vector<std::string>& payload) {
+            if (payload == std::vector<std::string>{"hello"}) {
+                first++;
+            }
+        });
+        other.subscribe([&](const std::vector<std::string>&) {
+            second++;
+        });
+
+        mlm::MlmStreamClient publisher("test_client", "TEST-STREAM", 1000, testEndpoint);
+        publisher.publish({"hello"});
+        publisher.publish({"hello"});
+
+        for (int i = 0; i < 100 && (first < 2 || second < 2); i++) {
+            zclock_sleep(10);
+        }
+        CHECK(first == 2);
+        CHECK(second == 2);
+        // one session to subscribe, one to publish
+        CHECK(manager.sessions() == 2);
+
+        // not called anymore
+        subscriber.unsubscribe(id);
+        publisher.publish({"hello"});
+        for (int i = 0; i < 100 && second < 3; i++) {
+            zclock_sleep(10);
+        }
+        CHECK(first == 2);
+        CHECK(second == 3);
+
+        // a handler may publish, even through its own session
+        std::atomic<int> echoed{0};
+        uint64_t         echo = manager.subscribe(
+            testEndpoint, "test_echo", "TEST-STREAM", "^PING$",
+            [&](const std::string&, zmsg_t*) {
+                zmsg_t* pong = zmsg_new();
+                zmsg_addstr(pong, "pong");
+                manager.publish(testEndpoint, "test_echo", "TEST-STREAM", "PONG", &pong, 1000);
+            },
+            1000);
+        uint64_t pong = manager.subscribe(
+            testEndpoint, "test_pong", "TEST-STREAM", "^PONG$",
+            [&](const std::string&, zmsg_t*) {
+                echoed++;
+            },
+            1000);
+        zmsg_t* ping = zmsg_new();
+        zmsg_addstr(ping, "ping");
+        manager.publish(testEndpoint, "test_ping", "TEST-STREAM", "PING", &ping, 1000);
+        for (int i = 0; i < 100 && echoed < 1; i++) {
+            zclock_sleep(10);
+        }
+        CHECK(echoed == 1);
+        manager.unsubscribe(echo);
+        manager.unsubscribe(pong);
+    }
+
+    // closed with their last client or subscription
+    CHECK(manager.sessions() == 0);
+
+    // a handler closing its own session doesn't wait for itself, the session is closed by another thread
+    std::atomic<int> resets{0};
+    manager.subscribe(
+        testEndpoint, "test_reset", "TEST-STREAM", "^RESET$",
+        [&](const std::string&, zmsg_t*) {
+            manager.reset();
+            resets++;
+        },
+        1000);
+    zmsg_t* message = zmsg_new();
+    zmsg_addstr(message, "reset");
+    manager.publish(testEndpoint, "test_ping", "TEST-STREAM", "RESET", &message, 1000);
+    for (int i = 0; i < 100 && resets < 1; i++) {
+        zclock_sleep(10);
+    }
+    CHECK(resets == 1);
+    CHECK(manager.sessions() == 0);
+    manager.reset();
+
+    zactor_destroy(&broker);
+}
+
+TEST_CASE("Connection manager broker restart")
+{
+    zactor_t* broker = zactor_new(mlm_server, const_cast<char*>("Malamute"));
+    zstr_sendx(broker, "BIND", testEndpoint, NULL);
+
+    {
+        // a session which only consumes notices the restart by itself
+        std::atomic<int>     received{0};
+        mlm::MlmStreamClient subscriber("test_client", "RESTART-STREAM", 1000, testEndpoint);
+        subscriber.subscribe([&](const std::vector<std::string>&) {
+            received++;
+        });
+
+        zactor_destroy(&broker);
+        broker = zactor_new(mlm_server, const_cast<char*>("Malamute"));
+        zstr_sendx(broker, "BIND", testEndpoint, NULL);
+
+        // the broker heartbeats decide how long it takes, the stream consumer is then restored
+        MlmClientGuard client(mlm_client_new());
+        REQUIRE(mlm_client_connect(client, testEndpoint, 1000, "restart-publisher") == 0);
+        REQUIRE(mlm_client_set_producer(client, "RESTART-STREAM") == 0);
+        for (int i = 0; i < 300 && received == 0; i++) {
+            zmsg_t* msg = zmsg_new();
+            zmsg_addstr(msg, "data");
+            mlm_client_send(client, "AFTER-RESTART", &msg);
+            zclock_sleep(100);
+        }
+        CHECK(received > 0);
+    }
+
+    zactor_destroy(&broker);
+}
+
+static void fty_common_mlm_connection_manager_broker_actor(zsock_t* pipe, void* args)
+{
+    fty::EchoServer            server;
+    mlm::MlmBasicMailboxServer agent(pipe, server, testAgentName, static_cast<const char*>(args));
+    agent.mainloop();
+}
+
+TEST_CASE("Connection manager several brokers")
+{
+    mlm::MlmConnectionManager& manager = mlm::MlmConnectionManager::instance();
+
+    const char* endpoints[] = {
+        "inproc://fty_common_mlm_connection_manager_test_0", "inproc://fty_common_mlm_connection_manager_test_1"};
+    std::vector<zactor_t*> brokers;
+    std::vector<zactor_t*> servers;
+    for (const char* endpoint : endpoints) {
+        brokers.push_back(zactor_new(mlm_server, const_cast<char*>("Malamute")));
+        zstr_sendx(brokers.back(), "BIND", endpoint, NULL);
+        servers.push_back(zactor_new(fty_common_mlm_connection_manager_broker_actor, const_cast<char*>(endpoint)));
+    }
+
+    // a broker which isn't there, chosen by consistent hashing for the destination
+    std::string down;
+    for (int i = 0; down.empty(); i++) {
+        std::string candidate = "inproc://fty_common_mlm_connection_manager_down_" + std::to_string(i);
+        if (MlmUtils::rendezvousOrder(testAgentName, {endpoints[0], endpoints[1], candidate})[0] == candidate) {
+            down = candidate;
+        }
+    }
+    std::vector<std::string> all = {endpoints[0], endpoints[1], down};
+
+    {
+        // fails over to the next broker, then skips the unreachable one
+        CHECK(manager.brokers(testAgentName, all)[0] == down);
+        mlm::MlmSyncClient client("test_client", testAgentName, 500, all);
+        fty::Payload       payload = {"This", "is", "a", "test"};
+        CHECK(client.syncRequestWithReply(payload) == payload);
+        CHECK(manager.brokers(testAgentName, all)[2] == down);
+        CHECK(client.syncRequestWithReply(payload) == payload);
+
+        // the subscribers listen on the reachable brokers, the publishers use one of them
+        std::atomic<int>     received{0};
+        mlm::MlmStreamClient subscriber("test_client", "TEST-STREAM", 500, all);
+        subscriber.subscribe([&](const std::vector<std::string>& payload) {
+            if (payload == std::vector<std::string>{"hello"}) {
+                received++;
+            }
+        });
+
+        mlm::MlmStreamClient publisher("test_client", "TEST-STREAM", 500, all);
+        mlm::MlmStreamClient first("test_client", "TEST-STREAM", 500, std::vector<std::string>{endpoints[0]});
+        mlm::MlmStreamClient second("test_client", "TEST-STREAM", 500, std::vector<std::string>{endpoints[1]});
+        for (mlm::MlmStreamClient* stream : {&publisher, &first, &second}) {
+            stream->publish({"hello"});
+        }
+        for (int i = 0; i < 100 && received < 3; i++) {
+            zclock_sleep(10);
+        }
+        zclock_sleep(100);
+        CHECK(received == 3);
+    }
+
+    CHECK(manager.sessions() == 0);
+    for (zactor_t* server : servers) {
+        zactor_destroy(&server);
+    }
+    for (zactor_t* broker : brokers) {
+        zactor_destroy(&broker);
+    }
+}
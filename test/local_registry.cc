@@ -0,0 +1,224 @@
+/*  =========================================================================
+    fty_common_mlm_local_registry - In-process delivery between co-located clients and agents
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#include "fty_common_mlm_local_registry.h"
+#include "fty_common_mlm_basic_mailbox_server.h"
+#include "fty_common_mlm_connection_manager.h"
+#include "fty_common_mlm_guards.h"
+#include "fty_common_mlm_stream_client.h"
+#include "fty_common_mlm_sync_client.h"
+#include <atomic>
+#include <catch2/catch.hpp>
+#include <fty_common_unit_tests.h>
+#include <thread>
+
+static const char* testEndpoint  = "inproc://fty_common_mlm_local_registry_test";
+static const char* testAgentName = "fty_common_mlm_local_registry_test";
+
+// next message of inbox, without its envelope
+static zmsg_t* s_receive(mlm::MlmLocalInbox& inbox, mlm::MlmLocalInbox::Envelope& envelope, int timeout = 1000)
+{
+    zsock_set_rcvtimeo(inbox.socket(), timeout);
+    zmsg_t* message = zmsg_recv(inbox.socket());
+    if (message != nullptr && !mlm::MlmLocalInbox::open(message, envelope)) {
+        zmsg_destroy(&message);
+    }
+    return message;
+}
+
+static void fty_common_mlm_local_registry_test_actor(zsock_t* pipe, void* /*args*/)
+{
+    fty::EchoServer            server;
+    mlm::MlmBasicMailboxServer agent(pipe, server, testAgentName, testEndpoint);
+    agent.setLocalDelivery(true);
+    agent.mainloop();
+}
+
+TEST_CASE("Local registry")
+{
+    mlm::MlmLocalRegistry&       registry = mlm::MlmLocalRegistry::instance();
+    mlm::MlmLocalInbox           first;
+    mlm::MlmLocalInbox           second;
+    mlm::MlmLocalInbox::Envelope envelope;
+
+    // mailboxes
+    registry.addMailbox(testEndpoint, "first", &first, false);
+    zmsg_t* content = zmsg_new();
+    zmsg_addstr(content, "hello");
+    CHECK(registry.sendto(testEndpoint, "sender", "first", "SUBJECT", &content));
+    CHECK(content == nullptr);
+    {
+        ZmsgGuard message(s_receive(first, envelope));
+        REQUIRE(message.get() != nullptr);
+        CHECK(envelope.command == "MAILBOX DELIVER");
+        CHECK(envelope.sender == "sender");
+        CHECK(envelope.subject == "SUBJECT");
+        CHECK(envelope.address == "first");
+        CHECK(zmsg_size(message) == 1);
+        CHECK(zframe_streq(zmsg_first(message), "hello"));
+    }
+
+    // unknown address or endpoint, the content is left to the caller
+    content = zmsg_new();
+    CHECK_FALSE(registry.sendto(testEndpoint, "sender", "second", "SUBJECT", &content));
+    CHECK_FALSE(registry.sendto("inproc://other", "sender", "first", "SUBJECT", &content));
+    CHECK(content != nullptr);
+
+    // removed only by its inbox
+    registry.removeMailbox(testEndpoint, "first", &second);
+    CHECK(registry.sendto(testEndpoint, "sender", "first", "SUBJECT", &content));
+    content = s_receive(first, envelope);
+    CHECK(content != nullptr);
+    zmsg_destroy(&content);
+    registry.removeMailbox(testEndpoint, "first", &first);
+    content = zmsg_new();
+    CHECK_FALSE(registry.sendto(testEndpoint, "sender", "first", "SUBJECT", &content));
+    zmsg_destroy(&content);
+
+    // streams: one copy per matching inbox
+    uint64_t all     = registry.addConsumer(testEndpoint, "STREAM", ".*", &first);
+    uint64_t twice   = registry.addConsumer(testEndpoint, "STREAM", "^A", &first);
+    uint64_t matched = registry.addConsumer(testEndpoint, "STREAM", "^A", &second);
+
+    content = zmsg_new();
+    zmsg_addstr(content, "value");
+    CHECK(registry.publish(testEndpoint, "publisher", "STREAM", "ALERT", content) == 2);
+    CHECK(registry.publish(testEndpoint, "publisher", "STREAM", "METRIC", content) == 1);
+    CHECK(registry.publish(testEndpoint, "publisher", "OTHER", "ALERT", content) == 0);
+    CHECK(zmsg_size(content) == 1);
+    zmsg_destroy(&content);
+
+    for (const char* subject : {"ALERT", "METRIC"}) {
+        ZmsgGuard message(s_receive(first, envelope));
+        REQUIRE(message.get() != nullptr);
+        CHECK(envelope.command == "STREAM DELIVER");
+        CHECK(envelope.sender == "publisher");
+        CHECK(envelope.subject == subject);
+        CHECK(envelope.address == "STREAM");
+    }
+    content = s_receive(first, envelope, 100);
+    CHECK(content == nullptr);
+    {
+        ZmsgGuard message(s_receive(second, envelope));
+        REQUIRE(message.get() != nullptr);
+        CHECK(envelope.subject == "ALERT");
+    }
+
+    registry.removeConsumer(all);
+    registry.removeConsumer(twice);
+    registry.removeConsumer(matched);
+    content = zmsg_new();
+    CHECK(registry.publish(testEndpoint, "publisher", "STREAM", "ALERT", content) == 0);
+    zmsg_destroy(&content);
+
+    // mirrored publishers
+    registry.addMailbox(testEndpoint, "publisher", &first, true);
+    CHECK(registry.mirrored(testEndpoint, "publisher"));
+    CHECK_FALSE(registry.mirrored(testEndpoint, "sender"));
+
+    // their broker copies are dropped by the inboxes which got the local one
+    matched = registry.addConsumer(testEndpoint, "STREAM", "^A", &second);
+    content = zmsg_new();
+    zmsg_addstr(content, "value");
+    CHECK(registry.receivedLocally(testEndpoint, "publisher", "STREAM", "ALERT", content, &second));
+    CHECK_FALSE(registry.receivedLocally(testEndpoint, "publisher", "STREAM", "METRIC", content, &second));
+    CHECK_FALSE(registry.receivedLocally(testEndpoint, "publisher", "STREAM", "ALERT", content, &first));
+    CHECK_FALSE(registry.receivedLocally(testEndpoint, "sender", "STREAM", "ALERT", content, &second));
+
+    // not when the local copy was missed (full inbox), once
+    second.miss({"STREAM DELIVER", "publisher", "ALERT", "STREAM"}, content);
+    CHECK_FALSE(registry.receivedLocally(testEndpoint, "publisher", "STREAM", "ALERT", content, &second));
+    CHECK(registry.receivedLocally(testEndpoint, "publisher", "STREAM", "ALERT", content, &second));
+    registry.removeConsumer(matched);
+    zmsg_destroy(&content);
+
+    registry.removeMailbox(testEndpoint, "publisher", &first);
+    CHECK_FALSE(registry.mirrored(testEndpoint, "publisher"));
+}
+
+TEST_CASE("Local delivery")
+{
+    mlm::MlmConnectionManager& manager  = mlm::MlmConnectionManager::instance();
+    mlm::MlmLocalRegistry&     registry = mlm::MlmLocalRegistry::instance();
+    manager.setLocalDelivery(mlm::MlmConnectionManager::LocalDelivery::Local);
+
+    zactor_t* broker = zactor_new(mlm_server, const_cast<char*>("Malamute"));
+    zstr_sendx(broker, "BIND", testEndpoint, NULL);
+    zactor_t* server = zactor_new(fty_common_mlm_local_registry_test_actor, nullptr);
+
+    SECTION("Requests")
+    {
+        // served by the local server
+        mlm::MlmSyncClient client("test_client", testAgentName, 1000, testEndpoint);
+        fty::Payload       payload = {"This", "is", "a", "test"};
+        CHECK(client.syncRequestWithReply(payload) == payload);
+
+        // a mailbox the broker doesn't know: request and reply don't go through it
+        mlm::MlmLocalInbox ghost;
+        registry.addMailbox(testEndpoint, "ghost", &ghost, false);
+        std::thread responder([&]() {
+            mlm::MlmLocalInbox::Envelope envelope;
+            zmsg_t*                      request = s_receive(ghost, envelope);
+            if (request != nullptr) {
+                registry.sendto(testEndpoint, "ghost", envelope.sender, "REPLY", &request);
+            }
+            zmsg_destroy(&request);
+        });
+
+        zmsg_t* request = zmsg_new();
+        zmsg_addstr(request, "id-1");
+        zmsg_addstr(request, "ping");
+        ZmsgGuard reply(manager.requestReply(testEndpoint, "test_client", "ghost", "REQUEST", "id-1", &request, 1000,
+            mlm::MlmConnectionManager::Clock::now() + std::chrono::seconds(1)));
+        responder.join();
+        registry.removeMailbox(testEndpoint, "ghost", &ghost);
+
+        REQUIRE(reply.get() != nullptr);
+        CHECK(zmsg_size(reply) == 2);
+        CHECK(zframe_streq(zmsg_last(reply), "ping"));
+    }
+
+    SECTION("Streams")
+    {
+        std::atomic<int>     received{0};
+        mlm::MlmStreamClient subscriber("test_client", "TEST-STREAM", 1000, testEndpoint);
+        subscriber.subscribe([&](const std::vector<std::string>& payload) {
+            if (payload == std::vector<std::string>{"hello"}) {
+                received++;
+            }
+        });
+
+        // received locally, the copy of the broker is dropped
+        mlm::MlmStreamClient publisher("test_client", "TEST-STREAM", 1000, testEndpoint);
+        publisher.publish({"hello"});
+        publisher.publish({"hello"});
+        for (int i = 0; i < 100 && received < 2; i++) {
+            zclock_sleep(10);
+        }
+        zclock_sleep(100);
+        CHECK(received == 2);
+    }
+
+    CHECK(manager.sessions() == 0);
+    manager.setLocalDelivery(mlm::MlmConnectionManager::LocalDelivery::Off);
+    zactor_destroy(&server);
+    zactor_destroy(&broker);
+}
@@ -0,0 +1,306 @@
+/*  =========================================================================
+    fty_common_mlm_pool - Pool of objects (malamute clients...)
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#include "fty_common_mlm_pool.h"
+#include <atomic>
+#include <catch2/catch.hpp>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+struct Connection
+{
+    static std::atomic<int> created;
+
+    Connection()
+    {
+        created++;
+    }
+};
+
+std::atomic<int> Connection::created{0};
+
+static std::atomic<bool> s_brokerUp{true};
+
+static bool waitFor(std::function<bool()> condition)
+{
+    for (int i = 0; i < 200 && !condition(); i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return condition();
+}
+
+TEST_CASE("Pool prewarm and validation")
+{
+    Connection::created = 0;
+    s_brokerUp          = true;
+
+    details::Pool<Connection> pool(10, [](Connection&) {
+        return s_brokerUp.load();
+    });
+    pool.prewarm(4, std::chrono::milliseconds(20));
+
+    // created in the background
+    CHECK(waitFor([&]() {
+        return pool.size() == 4;
+    }));
+    CHECK(Connection::created == 4);
+
+    {
+        // served from the spare objects, which are topped up
+        details::Pool<Connection>::Ptr connection = pool.get();
+        CHECK(connection);
+        CHECK(waitFor([&]() {
+            return pool.size() == 4;
+        }));
+        CHECK(Connection::created == 5);
+    }
+
+    // the dead spare objects are discarded, by get() and by the refresh
+    s_brokerUp = false;
+    {
+        details::Pool<Connection>::Ptr connection = pool.get();
+        CHECK(connection);
+    }
+    CHECK(waitFor([&]() {
+        return pool.size() <= 1;
+    }));
+
+    // and replaced once the broker is back
+    s_brokerUp = true;
+    CHECK(waitFor([&]() {
+        return pool.size() >= 4;
+    }));
+}
+
+TEST_CASE("Pool spare objects across threads")
+{
+    Connection::created = 0;
+    details::Pool<Connection> pool(3);
+
+    // released by another thread, which exits
+    std::thread([&]() {
+        std::vector<details::Pool<Connection>::Ptr> connections;
+        for (int i = 0; i < 5; i++) {
+            connections.push_back(pool.get());
+        }
+    }).join();
+    CHECK(Connection::created == 5);
+    CHECK(pool.size() == 3);
+
+    // still reused by this thread
+    {
+        details::Pool<Connection>::Ptr first  = pool.get();
+        details::Pool<Connection>::Ptr second = pool.get();
+        CHECK(Connection::created == 5);
+        CHECK(pool.size() == 1);
+    }
+    CHECK(pool.size() == 3);
+
+    pool.drop(1);
+    CHECK(pool.size() == 1);
+    pool.setMaximumSize(0);
+    CHECK(pool.getMaximumSize() == 0);
+}
+
+TEST_CASE("Pool capacity")
+{
+    Connection::created = 0;
+    details::Pool<Connection> pool(4);
+    pool.setCapacity(2, std::chrono::milliseconds(50));
+
+    {
+        details::Pool<Connection>::Ptr first  = pool.get();
+        details::Pool<Connection>::Ptr second = pool.get();
+        CHECK(first);
+        CHECK(second);
+
+        // no room: empty once timed out
+        details::Pool<Connection>::Ptr third = pool.get();
+        CHECK(!third);
+        details::Pool<Connection>::Stats stats = pool.stats();
+        CHECK(stats.live == 2);
+        CHECK(stats.waits == 1);
+        CHECK(stats.timeouts == 1);
+        CHECK(stats.waitTime >= 50000);
+
+        // released by another thread meanwhile
+        std::thread releaser([&]() {
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            first = details::Pool<Connection>::Ptr(nullptr, nullptr);
+        });
+        details::Pool<Connection>::Ptr fourth = pool.get(std::chrono::milliseconds(5000));
+        releaser.join();
+        CHECK(fourth);
+        CHECK(pool.stats().waits == 2);
+        CHECK(pool.stats().timeouts == 1);
+        CHECK(Connection::created == 2);
+    }
+    CHECK(pool.stats().live == 2);
+    CHECK(pool.size() == 2);
+
+    // the objects destroyed rather than kept make room too
+    pool.setMaximumSize(1);
+    CHECK(pool.stats().live == 1);
+    {
+        details::Pool<Connection>::Ptr first  = pool.get();
+        details::Pool<Connection>::Ptr second = pool.get();
+        CHECK(!pool.get(std::chrono::milliseconds(0)));
+        CHECK(Connection::created == 3);
+    }
+    CHECK(pool.stats().live == 1);
+    CHECK(pool.get(std::chrono::milliseconds(0)));
+}
+
+TEST_CASE("Pool eviction and statistics")
+{
+    Connection::created = 0;
+    details::Pool<Connection> pool(10);
+    {
+        details::Pool<Connection>::Ptr first  = pool.get();
+        details::Pool<Connection>::Ptr second = pool.get();
+        details::Pool<Connection>::Ptr third  = pool.get();
+    }
+    {
+        details::Pool<Connection>::Ptr first = pool.get();
+        CHECK(pool.stats().inUse == 1);
+    }
+
+    details::Pool<Connection>::Stats stats = pool.stats();
+    CHECK(stats.gets == 4);
+    CHECK(stats.hits == 1);
+    CHECK(stats.created == 3);
+    CHECK(stats.inUse == 0);
+    CHECK(stats.peakInUse == 3);
+    CHECK(stats.live == 3);
+
+    // the idle spare objects go, but the ones asked for by prewarm()
+    pool.prewarm(1);
+    pool.setEviction(std::chrono::milliseconds(50));
+    CHECK(waitFor([&]() {
+        return pool.size() == 1;
+    }));
+    CHECK(pool.stats().evicted == 2);
+    CHECK(pool.stats().live == 1);
+
+    // the old objects are not put back, and the spare ones go
+    details::Pool<Connection> aging(10);
+    aging.setEviction(std::chrono::milliseconds(0), std::chrono::milliseconds(100));
+    {
+        details::Pool<Connection>::Ptr old = aging.get();
+        std::this_thread::sleep_for(std::chrono::milliseconds(150));
+    }
+    CHECK(aging.size() == 0);
+    CHECK(aging.stats().evicted == 1);
+    {
+        details::Pool<Connection>::Ptr young = aging.get();
+    }
+    CHECK(aging.size() == 1);
+    CHECK(waitFor([&]() {
+        return aging.size() == 0;
+    }));
+    CHECK(aging.stats().evicted == 2);
+    CHECK(aging.stats().live == 0);
+}
+
+struct Session
+{
+    std::string endpoint;
+    std::string identity;
+
+    Session(const std::string& _endpoint, const std::string& _identity = "")
+        : endpoint(_endpoint)
+        , identity(_identity)
+    {
+    }
+};
+
+TEST_CASE("Pool factory and keys")
+{
+    // not default constructible
+    details::Pool<Session> pool(2, nullptr, []() {
+        return std::make_unique<Session>("ipc://@/test", "agent");
+    });
+    {
+        details::Pool<Session>::Ptr session = pool.get();
+        CHECK(session->endpoint == "ipc://@/test");
+    }
+    CHECK(pool.size() == 1);
+
+    // constructed from the key
+    details::KeyedPool<Session> byEndpoint(2);
+    {
+        details::KeyedPool<Session>::Ptr first  = byEndpoint.get("ipc://@/first");
+        details::KeyedPool<Session>::Ptr second = byEndpoint.get("ipc://@/second");
+        CHECK(first->endpoint == "ipc://@/first");
+        CHECK(second->endpoint == "ipc://@/second");
+    }
+    CHECK(byEndpoint.size() == 2);
+    CHECK(byEndpoint.pool("ipc://@/first").size() == 1);
+    {
+        // reused for its key only
+        details::KeyedPool<Session>::Ptr first = byEndpoint.get("ipc://@/first");
+        CHECK(byEndpoint.pool("ipc://@/first").size() == 0);
+        CHECK(byEndpoint.pool("ipc://@/second").size() == 1);
+    }
+
+    // by endpoint and identity
+    using Profile = std::pair<std::string, std::string>;
+    details::KeyedPool<Session, Profile> byProfile(2, nullptr, [](const Profile& profile) {
+        return std::make_unique<Session>(profile.first, profile.second);
+    });
+    details::KeyedPool<Session, Profile>::Ptr session = byProfile.get({"ipc://@/first", "rest."});
+    CHECK(session->identity == "rest.");
+
+    byEndpoint.drop();
+    CHECK(byEndpoint.pool("ipc://@/first").size() == 0);
+}
+
+// hidden by default, run it with: <test binary> "[benchmark]"
+TEST_CASE("Pool contention", "[.][benchmark]")
+{
+    const int iterations = 100000;
+
+    for (int threads : {1, 4, 16, 64}) {
+        details::Pool<Connection> pool(unsigned(threads) * 2);
+
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> workers;
+        for (int i = 0; i < threads; i++) {
+            workers.emplace_back([&]() {
+                for (int j = 0; j < iterations; j++) {
+                    details::Pool<Connection>::Ptr connection = pool.get();
+                }
+            });
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+
+        printf("%2d threads: %8.0f get/put per ms\n", threads,
+            double(threads) * iterations * 1000 / double(elapsed.count() > 0 ? elapsed.count() : 1));
+    }
+}
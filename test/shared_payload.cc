@@ -0,0 +1,195 @@
+/*  =========================================================================
+    fty_common_mlm_shared_payload - Large payloads handed over in shared memory
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#include "fty_common_mlm_shared_payload.h"
+#include "fty_common_mlm_basic_mailbox_server.h"
+#include "fty_common_mlm_guards.h"
+#include "fty_common_mlm_stream_client.h"
+#include "fty_common_mlm_sync_client.h"
+#include <atomic>
+#include <catch2/catch.hpp>
+#include <fcntl.h>
+#include <fty_common_unit_tests.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static const char* testEndpoint  = "inproc://fty_common_mlm_shared_payload_test";
+static const char* testAgentName = "fty_common_mlm_shared_payload_test";
+
+static void fty_common_mlm_shared_payload_test_actor(zsock_t* pipe, void* /*args*/)
+{
+    fty::EchoServer            server;
+    mlm::MlmBasicMailboxServer agent(pipe, server, testAgentName, testEndpoint);
+    agent.setSharedMemory(1024);
+    agent.mainloop();
+}
+
+static std::string s_frame(zmsg_t* message, size_t index)
+{
+    zframe_t* frame = zmsg_first(message);
+    for (size_t i = 0; i < index; i++) {
+        frame = zmsg_next(message);
+    }
+    return std::string(reinterpret_cast<const char*>(zframe_data(frame)), zframe_size(frame));
+}
+
+TEST_CASE("Shared payload")
+{
+    std::string large(4096, 'x');
+    large[10] = '\0';
+
+    ZmsgGuard message(zmsg_new());
+    zmsg_addstr(message, "id-1");
+    zmsg_addmem(message, large.data(), large.size());
+    zmsg_addmem(message, nullptr, 0);
+
+    // too small
+    CHECK_FALSE(mlm::MlmSharedPayload::share(message, 1, 8192, std::chrono::seconds(1)));
+    CHECK_FALSE(mlm::MlmSharedPayload::share(message, 1, 0, std::chrono::seconds(1)));
+    CHECK(zmsg_size(message) == 3);
+    CHECK_FALSE(mlm::MlmSharedPayload::isShared(message, 1));
+
+    // the frames after the skipped ones are replaced by a descriptor
+    REQUIRE(mlm::MlmSharedPayload::share(message, 1, 1024, std::chrono::seconds(1)));
+    CHECK(zmsg_size(message) == 4);
+    CHECK(zmsg_content_size(message) < 100);
+    CHECK(s_frame(message, 0) == "id-1");
+    CHECK(s_frame(message, 1) == mlm::MlmSharedPayload::MARKER);
+    CHECK(mlm::MlmSharedPayload::isShared(message, 1));
+
+    // read by several readers, then by the last one
+    ZmsgGuard copy(zmsg_dup(message));
+    CHECK(mlm::MlmSharedPayload::fetch(copy, 1, false));
+    CHECK(mlm::MlmSharedPayload::fetch(message, 1, true));
+    for (zmsg_t* fetched : {copy.get(), message.get()}) {
+        CHECK(zmsg_size(fetched) == 3);
+        CHECK(s_frame(fetched, 0) == "id-1");
+        CHECK(s_frame(fetched, 1) == large);
+        CHECK(s_frame(fetched, 2).empty());
+    }
+
+    // nothing to fetch
+    CHECK(mlm::MlmSharedPayload::fetch(message, 1, true));
+    CHECK(zmsg_size(message) == 3);
+
+    // unlinked by its reader, or by its creator once expired
+    ZmsgGuard unread(zmsg_new());
+    zmsg_addmem(unread, large.data(), large.size());
+    REQUIRE(mlm::MlmSharedPayload::share(unread, 0, 1024, std::chrono::milliseconds(0)));
+    ZmsgGuard lost(zmsg_dup(unread));
+    CHECK(mlm::MlmSharedPayload::fetch(unread, 0, true));
+    CHECK_FALSE(mlm::MlmSharedPayload::fetch(lost, 0, false));
+    CHECK(mlm::MlmSharedPayload::isShared(lost, 0));
+
+    ZmsgGuard expired(zmsg_new());
+    zmsg_addmem(expired, large.data(), large.size());
+    REQUIRE(mlm::MlmSharedPayload::share(expired, 0, 1024, std::chrono::milliseconds(0)));
+    mlm::MlmSharedPayload::collect();
+    CHECK_FALSE(mlm::MlmSharedPayload::fetch(expired, 0, false));
+
+    // payloads looking like a descriptor
+    for (const char* name : {"/etc/passwd", "/fty-mlm-1", "/fty-mlm-1-x", "fty-mlm-1-2", "/fty-mlm--2"}) {
+        ZmsgGuard fake(zmsg_new());
+        zmsg_addstr(fake, mlm::MlmSharedPayload::MARKER);
+        zmsg_addstr(fake, name);
+        zmsg_addstr(fake, "4096");
+        CHECK_FALSE(mlm::MlmSharedPayload::isShared(fake, 0));
+        CHECK(mlm::MlmSharedPayload::fetch(fake, 0, true));
+        CHECK(zmsg_size(fake) == 3);
+    }
+
+    // an invalid segment isn't unlinked
+    std::string invalid = "/fty-mlm-" + std::to_string(getpid()) + "-0";
+    int         fd      = shm_open(invalid.c_str(), O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+    REQUIRE(fd != -1);
+    CHECK(ftruncate(fd, 64) == 0);
+    close(fd);
+    ZmsgGuard garbage(zmsg_new());
+    zmsg_addstr(garbage, mlm::MlmSharedPayload::MARKER);
+    zmsg_addstr(garbage, invalid.c_str());
+    zmsg_addstr(garbage, "64");
+    CHECK(mlm::MlmSharedPayload::isShared(garbage, 0));
+    CHECK_FALSE(mlm::MlmSharedPayload::fetch(garbage, 0, true));
+    fd = shm_open(invalid.c_str(), O_RDONLY, 0);
+    CHECK(fd != -1);
+    close(fd);
+    shm_unlink(invalid.c_str());
+
+    // the segments of a dead process are collected
+    pid_t child = fork();
+    REQUIRE(child != -1);
+    if (child == 0) {
+        _exit(0);
+    }
+    waitpid(child, nullptr, 0);
+    std::string orphan = "/fty-mlm-" + std::to_string(child) + "-1";
+    fd                 = shm_open(orphan.c_str(), O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+    REQUIRE(fd != -1);
+    close(fd);
+    mlm::MlmSharedPayload::collectOrphans();
+    fd = shm_open(orphan.c_str(), O_RDONLY, 0);
+    CHECK(fd == -1);
+    if (fd != -1) {
+        close(fd);
+        shm_unlink(orphan.c_str());
+    }
+}
+
+TEST_CASE("Shared payload through the broker")
+{
+    zactor_t* broker = zactor_new(mlm_server, const_cast<char*>("Malamute"));
+    zstr_sendx(broker, "BIND", testEndpoint, NULL);
+    zactor_t* server = zactor_new(fty_common_mlm_shared_payload_test_actor, nullptr);
+
+    {
+        // large request and reply, the small ones still go in frames
+        mlm::MlmSyncClient client("test_client", testAgentName, 1000, testEndpoint);
+        client.setSharedMemory(1024);
+        fty::Payload large = {"large", std::string(100000, 'x')};
+        CHECK(client.syncRequestWithReply(large) == large);
+        fty::Payload small = {"small"};
+        CHECK(client.syncRequestWithReply(small) == small);
+
+        // each subscriber reads the segment
+        std::atomic<int>     received{0};
+        mlm::MlmStreamClient subscriber("test_client", "TEST-STREAM", 1000, testEndpoint);
+        mlm::MlmStreamClient other("other_client", "TEST-STREAM", 1000, testEndpoint);
+        for (mlm::MlmStreamClient* stream : {&subscriber, &other}) {
+            stream->subscribe([&](const std::vector<std::string>& payload) {
+                if (payload == large) {
+                    received++;
+                }
+            });
+        }
+
+        mlm::MlmStreamClient publisher("test_client", "TEST-STREAM", 1000, testEndpoint);
+        publisher.setSharedMemory(1024);
+        publisher.publish(large);
+        for (int i = 0; i < 100 && received < 2; i++) {
+            zclock_sleep(10);
+        }
+        CHECK(received == 2);
+    }
+
+    zactor_destroy(&server);
+    zactor_destroy(&broker);
+}
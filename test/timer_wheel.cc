@@ -0,0 +1,151 @@
+/*  =========================================================================
+    fty_common_mlm_timer_wheel - Hierarchical timer wheel for agent timers
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#include "fty_common_mlm_timer_wheel.h"
+#include <catch2/catch.hpp>
+#include <random>
+#include <vector>
+
+// advance the wheel the way the agent mainloop does, sleeping until the next timeout
+static void runUntil(mlm::TimerWheel& wheel, int64_t& now, int64_t end)
+{
+    while (now < end) {
+        int64_t timeout = wheel.timeout(now);
+        now             = (timeout < 0 || now + timeout > end) ? end : now + timeout;
+        REQUIRE(wheel.advance(now));
+    }
+}
+
+TEST_CASE("Timer wheel one shot and periodic timers")
+{
+    int64_t              now = 1000000;
+    mlm::TimerWheel      wheel(now);
+    std::vector<int64_t> fired;
+
+    CHECK(wheel.timeout(now) == -1);
+
+    wheel.addOneShot(now, 150, [&]() {
+        fired.push_back(now);
+        return true;
+    });
+    CHECK(wheel.size() == 1);
+    CHECK(wheel.timeout(now) > 0);
+    CHECK(wheel.timeout(now) <= 150);
+
+    runUntil(wheel, now, 1000149);
+    CHECK(fired.empty());
+    runUntil(wheel, now, 1000150);
+    REQUIRE(fired.size() == 1);
+    CHECK(fired[0] == 1000150);
+    CHECK(wheel.size() == 0);
+
+    // periodic timer doesn't drift
+    fired.clear();
+    wheel.add(now, 100, [&]() {
+        fired.push_back(now);
+        return true;
+    });
+    runUntil(wheel, now, 1001150);
+    REQUIRE(fired.size() == 10);
+    for (size_t i = 0; i < fired.size(); i++) {
+        CHECK(fired[i] == 1000150 + 100 * int64_t(i + 1));
+    }
+
+    // missed periods are skipped, not replayed
+    fired.clear();
+    now += 1050;
+    wheel.advance(now);
+    CHECK(fired.size() == 1);
+}
+
+TEST_CASE("Timer wheel cancel")
+{
+    int64_t         now = 0;
+    mlm::TimerWheel wheel(now);
+    int             count = 0;
+
+    auto id = wheel.addOneShot(now, 10, [&]() {
+        count++;
+        return true;
+    });
+    CHECK(wheel.cancel(id));
+    CHECK_FALSE(wheel.cancel(id));
+    runUntil(wheel, now, 100);
+    CHECK(count == 0);
+
+    // a periodic timer cancelling itself, and another timer of the same slot
+    mlm::TimerWheel::TimerId self  = 0;
+    mlm::TimerWheel::TimerId other = 0;
+    self                           = wheel.add(now, 20, [&]() {
+        count++;
+        wheel.cancel(other);
+        if (count == 3) {
+            wheel.cancel(self);
+        }
+        return true;
+    });
+    other = wheel.add(now, 20, [&]() {
+        count += 100;
+        return true;
+    });
+    runUntil(wheel, now, 1000);
+    CHECK(count == 3);
+    CHECK(wheel.size() == 0);
+}
+
+TEST_CASE("Timer wheel stop request")
+{
+    int64_t         now = 0;
+    mlm::TimerWheel wheel(now);
+
+    wheel.addOneShot(now, 5, []() {
+        return false;
+    });
+    CHECK(wheel.advance(4));
+    CHECK_FALSE(wheel.advance(5));
+}
+
+TEST_CASE("Timer wheel many timers")
+{
+    int64_t                                now = 123456789;
+    mlm::TimerWheel                        wheel(now);
+    std::mt19937                           random(42);
+    std::uniform_int_distribution<int64_t> delays(1, 10000000);
+    size_t                                 late  = 0;
+    size_t                                 fired = 0;
+
+    for (int i = 0; i < 5000; i++) {
+        int64_t deadline = now + delays(random);
+        wheel.addOneShot(now, deadline - now, [&, deadline]() {
+            fired++;
+            if (now != deadline) {
+                late++;
+            }
+            return true;
+        });
+    }
+    CHECK(wheel.size() == 5000);
+
+    runUntil(wheel, now, now + 10000001);
+    CHECK(fired == 5000);
+    CHECK(late == 0);
+    CHECK(wheel.size() == 0);
+}
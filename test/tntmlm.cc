@@ -22,6 +22,8 @@
 #include "fty_common_mlm_pool.h"
 #include "fty_common_mlm_utils.h"
 #include <catch2/catch.hpp>
+#include <string>
+#include <vector>
 
 TEST_CASE("mlm tntmlm")
 {
@@ -267,3 +269,119 @@ TEST_CASE("mlm tntmlm")
     zactor_destroy(&server);
     printf("OK");
 }
+
+// replies to the requestreply() requests: REQUEST/uuid/payload -> uuid/REPLY/payload
+static void tntmlm_echo_actor(zsock_t* pipe, void* /*args*/)
+{
+    mlm_client_t* agent = mlm_client_new();
+    mlm_client_connect(agent, MlmClient::ENDPOINT.c_str(), 1000, "AGENT-ECHO");
+    zpoller_t* poller = zpoller_new(pipe, mlm_client_msgpipe(agent), nullptr);
+    zsock_signal(pipe, 0);
+
+    while (!zsys_interrupted) {
+        void* which = zpoller_wait(poller, -1);
+        if (which != mlm_client_msgpipe(agent)) {
+            break;
+        }
+        zmsg_t* msg     = mlm_client_recv(agent);
+        char*   request = zmsg_popstr(msg);
+        char*   uuid    = zmsg_popstr(msg);
+        zmsg_pushstr(msg, "REPLY");
+        zmsg_pushstr(msg, uuid);
+        mlm_client_sendto(agent, mlm_client_sender(agent), mlm_client_subject(agent), nullptr, 1000, &msg);
+        zstr_free(&request);
+        zstr_free(&uuid);
+    }
+
+    zpoller_destroy(&poller);
+    mlm_client_destroy(&agent);
+}
+
+TEST_CASE("mlm tntmlm requestreply")
+{
+    std::string& ref = const_cast<std::string&>(MlmClient::ENDPOINT);
+    ref              = "inproc://tntmlm-catch-2";
+
+    zactor_t* server = zactor_new(mlm_server, const_cast<char*>("Malamute"));
+    zstr_sendx(server, "BIND", MlmClient::ENDPOINT.c_str(), nullptr);
+    zactor_t* echo = zactor_new(tntmlm_echo_actor, nullptr);
+
+    {
+        MlmClient client;
+
+        // the content is copied, and destroyed once sent
+        zmsg_t* msg = zmsg_new();
+        zmsg_addstr(msg, "copied");
+        zmsg_t* reply = client.requestreply("AGENT-ECHO", "TEST", 1, &msg);
+        CHECK(msg == nullptr);
+        REQUIRE(reply != nullptr);
+        char* tmp = zmsg_popstr(reply);
+        CHECK(streq(tmp, "copied"));
+        zstr_free(&tmp);
+        zmsg_destroy(&reply);
+
+        // the content is sent as is
+        msg = zmsg_new();
+        zmsg_addstr(msg, "moved");
+        zmsg_addmem(msg, std::string(1 << 20, 'x').data(), 1 << 20);
+        reply = client.requestreply("AGENT-ECHO", "TEST", 1, &msg, false);
+        CHECK(msg == nullptr);
+        REQUIRE(reply != nullptr);
+        CHECK(zmsg_size(reply) == 2);
+        tmp = zmsg_popstr(reply);
+        CHECK(streq(tmp, "moved"));
+        zstr_free(&tmp);
+        zmsg_destroy(&reply);
+
+        // several requests in flight, the replies are waited for in reverse order
+        std::vector<std::string> uuids;
+        for (const char* payload : {"first", "second", "third"}) {
+            msg = zmsg_new();
+            zmsg_addstr(msg, payload);
+            uuids.push_back(client.request("AGENT-ECHO", "TEST", 1000, &msg));
+            CHECK(!uuids.back().empty());
+        }
+        for (const char* payload : {"third", "second", "first"}) {
+            reply = client.reply(uuids.back(), 1);
+            uuids.pop_back();
+            REQUIRE(reply != nullptr);
+            tmp = zmsg_popstr(reply);
+            CHECK(streq(tmp, payload));
+            zstr_free(&tmp);
+            zmsg_destroy(&reply);
+        }
+
+        // sub-second timeouts
+        int64_t start = zclock_mono();
+        CHECK(client.recv("nobody", std::chrono::milliseconds(150)) == nullptr);
+        CHECK(client.lastResult() == MlmClient::Result::Timeout);
+        CHECK(zclock_mono() - start < 1000);
+        CHECK(client.reply("nobody", std::chrono::milliseconds::min()) == nullptr);
+        CHECK(client.lastResult() == MlmClient::Result::Timeout);
+
+        msg = zmsg_new();
+        zmsg_addstr(msg, "fast");
+        reply = client.requestreply("AGENT-ECHO", "TEST", std::chrono::milliseconds(500), &msg);
+        CHECK(client.lastResult() == MlmClient::Result::Ok);
+        REQUIRE(reply != nullptr);
+        tmp = zmsg_popstr(reply);
+        CHECK(streq(tmp, "fast"));
+        zstr_free(&tmp);
+        zmsg_destroy(&reply);
+
+        zmsg_t* empty = nullptr;
+        CHECK(client.requestreply("AGENT-ECHO", "TEST", std::chrono::milliseconds(500), &empty) == nullptr);
+        CHECK(client.lastResult() == MlmClient::Result::Invalid);
+
+        // invalid arguments: the content is left when copied, consumed otherwise
+        msg = zmsg_new();
+        CHECK(client.request("", "TEST", 1000, &msg).empty());
+        CHECK(client.lastResult() == MlmClient::Result::Invalid);
+        CHECK(msg != nullptr);
+        CHECK(client.request("", "TEST", 1000, &msg, false).empty());
+        CHECK(msg == nullptr);
+    }
+
+    zactor_destroy(&echo);
+    zactor_destroy(&server);
+}
@@ -20,6 +20,7 @@
 */
 
 #include "fty_common_mlm_utils.h"
+#include <algorithm>
 #include <catch2/catch.hpp>
 #include <fty_common_utf8.h>
 #include <fty_log.h>
@@ -163,3 +164,91 @@ TEST_CASE("mlm utils")
     printf("fty-common-mlm-utils OK\n");
 }
 
+
+TEST_CASE("mlm utils shards")
+{
+    CHECK(MlmUtils::shardName("agent", 2) == "agent.2");
+
+    CHECK(MlmUtils::shardOf("key", 0) == 0);
+    CHECK(MlmUtils::shardOf("key", 1) == 0);
+
+    // adding a shard only moves the keys to the new shard
+    size_t moved = 0;
+    for (int i = 0; i < 1000; i++) {
+        std::string key   = "key-" + std::to_string(i);
+        size_t      shard = MlmUtils::shardOf(key, 4);
+        CHECK(shard < 4);
+        CHECK(MlmUtils::shardOf(key, 4) == shard);
+
+        size_t grown = MlmUtils::shardOf(key, 5);
+        if (grown != shard) {
+            CHECK(grown == 4);
+            moved++;
+        }
+    }
+    CHECK(moved > 100);
+    CHECK(moved < 300);
+
+    // shared by processes built apart: pinned
+    CHECK(MlmUtils::shardOf("", 4) == 1);
+    CHECK(MlmUtils::shardOf("key", 4) == 0);
+    CHECK(MlmUtils::shardOf("key", 7) == 6);
+    CHECK(MlmUtils::shardOf("key", 16) == 13);
+    CHECK(MlmUtils::shardOf("ups-1", 4) == 3);
+    CHECK(MlmUtils::shardOf("ups-1", 16) == 10);
+}
+
+TEST_CASE("mlm utils rendezvous")
+{
+    std::vector<std::string> nodes = {"ipc://@/malamute-0", "ipc://@/malamute-1", "ipc://@/malamute-2"};
+    CHECK(MlmUtils::rendezvousOrder("key", {}).empty());
+
+    // removing a node only moves its keys, to the next node of their order
+    std::vector<int> owned(3, 0);
+    for (int i = 0; i < 300; i++) {
+        std::string              key     = "key-" + std::to_string(i);
+        std::vector<std::string> ordered = MlmUtils::rendezvousOrder(key, nodes);
+        REQUIRE(ordered.size() == 3);
+        CHECK(MlmUtils::rendezvousOrder(key, nodes) == ordered);
+        owned[size_t(ordered[0].back() - '0')]++;
+
+        std::vector<std::string> reduced = MlmUtils::rendezvousOrder(key, {nodes[0], nodes[2]});
+        ordered.erase(std::remove(ordered.begin(), ordered.end(), nodes[1]), ordered.end());
+        CHECK(reduced == ordered);
+    }
+    for (int count : owned) {
+        CHECK(count > 50);
+    }
+
+    // shared by processes built apart: pinned
+    CHECK(MlmUtils::rendezvousOrder("key", nodes) == std::vector<std::string>{nodes[1], nodes[0], nodes[2]});
+    CHECK(MlmUtils::rendezvousOrder("agent", nodes) == std::vector<std::string>{nodes[0], nodes[2], nodes[1]});
+}
+
+TEST_CASE("mlm utils trysend")
+{
+    zsock_t* push = zsock_new_push("@inproc://fty_common_mlm_utils_trysend");
+    zsock_set_sndtimeo(push, 0);
+
+    zmsg_t* message = zmsg_new();
+    zmsg_addstr(message, "first");
+    zmsg_addstr(message, "second");
+
+    // no peer yet: kept as it was
+    CHECK(MlmUtils::zmsg_trysend(&message, push) == -1);
+    REQUIRE(message != nullptr);
+    CHECK(zmsg_size(message) == 2);
+
+    zsock_t* pull = zsock_new_pull(">inproc://fty_common_mlm_utils_trysend");
+    CHECK(MlmUtils::zmsg_trysend(&message, push) == 0);
+    CHECK(message == nullptr);
+
+    zmsg_t* received = zmsg_recv(pull);
+    REQUIRE(received != nullptr);
+    CHECK(zmsg_size(received) == 2);
+    CHECK(MlmUtils::zmsg_popstring(received) == "first");
+    zmsg_destroy(&received);
+
+    zsock_destroy(&pull);
+    zsock_destroy(&push);
+}